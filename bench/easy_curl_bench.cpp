@@ -0,0 +1,761 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+// Benchmarks of the easy_curl client against an in-process loopback HTTP
+// server. Time per iteration is the latency of one request (or one batch,
+// as noted); the items_per_second and bytes_per_second counters give the
+// request rate and throughput.
+//
+// Build with -DEASY_CURL_BUILD_BENCHMARKS=ON and run e.g.
+//   ./easy_curl_bench --benchmark_filter=FetchURL
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <poll.h>
+#include <unistd.h>
+
+#include "easy_curl.h"
+#include "easy_curl_async.h"
+#include "easy_curl_batch.h"
+#include "easy_curl_cache.h"
+#include "easy_curl_dns.h"
+#include "easy_curl_epoll.h"
+#include "easy_curl_limiter.h"
+#ifdef EASY_CURL_COROUTINES
+#include "easy_curl_coro.h"
+#endif
+#include "easy_curl_metrics.h"
+#include "easy_curl_multi.h"
+#include "easy_curl_pool.h"
+#include "easy_curl_ranged.h"
+#include "easy_curl_single_flight.h"
+#include "bench/loopback_http_server.h"
+
+using namespace std;
+
+namespace {
+
+LoopbackHttpServer* Server() {
+  static LoopbackHttpServer* server = []() {
+    auto* s = new LoopbackHttpServer();
+    s->Start();
+    return s;
+  }();
+  return server;
+}
+
+string SizeURL(int64_t size) {
+  return Server()->url() + "/?size=" + to_string(size);
+}
+
+void CheckOk(benchmark::State& state, const Error& e) {
+  if (e.code != kOk) {
+    state.SkipWithError(e.msg.c_str());
+  }
+}
+
+// Response body sizes, from tiny API responses to bulk downloads.
+void BodySizes(benchmark::internal::Benchmark* b) {
+  b->RangeMultiplier(16)->Range(16, 16 << 20);
+}
+
+////////////////////////////////////////////////////////////
+// Blocking requests
+////////////////////////////////////////////////////////////
+
+// One handle reused across requests, keeping its connection.
+void BM_FetchURL(benchmark::State& state) {
+  EasyCurl curl;
+  string url = SizeURL(state.range(0));
+  string resp;
+  for (auto _ : state) {
+    CheckOk(state, curl.FetchURL(url, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FetchURL)->Apply(BodySizes);
+
+// As BM_FetchURL, watching a CancellationToken and a deadline, to measure the
+// cost of the progress callback.
+void BM_FetchURLCancellable(benchmark::State& state) {
+  EasyCurl curl;
+  CancellationToken token;
+  curl.set_cancellation_token(&token);
+  curl.set_deadline(std::chrono::steady_clock::now() + std::chrono::hours(1));
+  string url = SizeURL(state.range(0));
+  string resp;
+  for (auto _ : state) {
+    CheckOk(state, curl.FetchURL(url, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FetchURLCancellable)->Apply(BodySizes);
+
+// A fresh handle, and hence a fresh connection, per request.
+void BM_FetchURLFreshHandle(benchmark::State& state) {
+  string url = SizeURL(state.range(0));
+  string resp;
+  for (auto _ : state) {
+    EasyCurl curl;
+    CheckOk(state, curl.FetchURL(url, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FetchURLFreshHandle)->Arg(16)->Arg(64 << 10);
+
+// A fresh destination buffer per request, so it has to grow from nothing
+// (or be preallocated from Content-Length) every time.
+void BM_FetchURLFreshBuffer(benchmark::State& state) {
+  EasyCurl curl;
+  curl.set_max_preallocate_bytes(state.range(1));
+  string url = SizeURL(state.range(0));
+  for (auto _ : state) {
+    string resp;
+    CheckOk(state, curl.FetchURL(url, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FetchURLFreshBuffer)
+    ->ArgNames({"size", "prealloc"})
+    ->Args({16 << 20, 0})
+    ->Args({16 << 20, 256 << 20});
+
+// Streaming the response through a sink which only counts bytes.
+void BM_FetchURLSink(benchmark::State& state) {
+  EasyCurl curl;
+  string url = SizeURL(state.range(0));
+  size_t received = 0;
+  EasyCurl::WriteSink sink = [&](const char* /*data*/, size_t len) {
+    received += len;
+    return len;
+  };
+  for (auto _ : state) {
+    CheckOk(state, curl.FetchURL(url, sink));
+  }
+  benchmark::DoNotOptimize(received);
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FetchURLSink)->Apply(BodySizes);
+
+void BM_FetchURLTemplate(benchmark::State& state) {
+  EasyCurl curl;
+  RequestTemplate tmpl(Server()->url(), {"Accept: application/json", "X-Request-Source: bench"});
+  string path = "/?size=" + to_string(state.range(0));
+  string resp;
+  for (auto _ : state) {
+    CheckOk(state, curl.FetchURL(tmpl, path, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchURLTemplate)->Arg(16);
+
+void BM_FetchURLHeaders(benchmark::State& state) {
+  EasyCurl curl;
+  string url = SizeURL(state.range(0));
+  vector<string> headers = {"Accept: application/json", "X-Request-Source: bench"};
+  for (int i = 2; i < state.range(1); i++) {
+    headers.push_back("X-Bench-" + to_string(i) + ": " + string(32, 'h'));
+  }
+  string resp;
+  for (auto _ : state) {
+    CheckOk(state, curl.FetchURL(url, &resp, headers));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchURLHeaders)
+    ->ArgNames({"size", "headers"})
+    ->Args({16, 2})
+    ->Args({16, 32});
+
+// Reading a response header: split off the headers prepended to the body
+// (capture:0), or look it up in the captured headers (capture:1).
+void BM_FetchURLResponseHeader(benchmark::State& state) {
+  EasyCurl curl;
+  bool capture = state.range(1) != 0;
+  curl.set_return_headers(!capture);
+  curl.set_capture_headers(capture);
+  string url = SizeURL(state.range(0));
+  string resp;
+  string body;
+  for (auto _ : state) {
+    CheckOk(state, curl.FetchURL(url, &resp));
+    string_view length;
+    if (capture) {
+      curl.response_headers().Get("Content-Length", &length);
+    } else {
+      size_t end = resp.find("\r\n\r\n");
+      size_t pos = resp.find("Content-Length:");
+      length = string_view(resp).substr(pos + 16, resp.find("\r\n", pos) - pos - 16);
+      body.assign(resp, end + 4, string::npos);
+    }
+    benchmark::DoNotOptimize(length);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchURLResponseHeader)
+    ->ArgNames({"size", "capture"})
+    ->Args({16 << 10, 0})
+    ->Args({16 << 10, 1});
+
+// A request whose URL and headers vary per iteration, built into a fresh
+// string and vector for FetchURL() (api:0), or into a reused Request for
+// Perform() (api:1).
+void BM_Perform(benchmark::State& state) {
+  EasyCurl curl;
+  string base = SizeURL(16);
+  string id = "&id=0123456789abcdef";
+  string resp;
+  Request req;
+  Response response;
+  for (auto _ : state) {
+    if (state.range(0) == 0) {
+      vector<string> headers = {"Accept: application/json", "X-Request-Id: " + id};
+      CheckOk(state, curl.FetchURL(base + id, &resp, headers));
+    } else {
+      req.clear();
+      req.set_url(base).append_url(id);
+      req.add_header("Accept", "application/json").add_header("X-Request-Id", id);
+      CheckOk(state, curl.Perform(req, &response));
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_Perform)->ArgName("api")->Arg(0)->Arg(1);
+
+// Compare with BM_FetchURL: the response goes to a file as it arrives,
+// rather than being held in memory.
+void BM_FetchToFile(benchmark::State& state) {
+  EasyCurl curl;
+  string url = SizeURL(state.range(0));
+  char path[] = "/tmp/easy_curl_bench_XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    state.SkipWithError("could not create temporary file");
+    return;
+  }
+  unlink(path);
+  for (auto _ : state) {
+    CheckOk(state, curl.FetchToFile(url, fd));
+  }
+  close(fd);
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_FetchToFile)->Arg(64 << 10)->Arg(16 << 20);
+
+// Polling a 1MB response through an EasyCurlResponseCache: fetched in full
+// without the cache (mode:0), revalidated with a 304 (mode:1), or fresh
+// (mode:2).
+void BM_FetchURLCached(benchmark::State& state) {
+  ResponseCacheOptions options;
+  options.default_ttl_ms = state.range(0) == 2 ? 3600 * 1000 : 0;
+  EasyCurlResponseCache cache(options);
+  EasyCurl curl;
+  string url = SizeURL(1 << 20) + (state.range(0) == 1 ? "&etag=1" : "");
+  string resp;
+  std::shared_ptr<const string> body;
+  for (auto _ : state) {
+    if (state.range(0) == 0) {
+      CheckOk(state, curl.FetchURL(url, &resp));
+    } else {
+      CheckOk(state, cache.FetchURL(&curl, url, &body));
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchURLCached)->ArgName("mode")->Arg(0)->Arg(1)->Arg(2);
+
+// A 256MB download split into ranges fetched over 'connections' at once.
+// With one connection, it is a plain FetchURL() plus a HEAD request.
+void BM_RangedFetch(benchmark::State& state) {
+  RangedFetchOptions options;
+  options.connections = state.range(0);
+  options.range_bytes = state.range(0) == 1 ? (512 << 20) : (16 << 20);
+  EasyCurlRangedFetcher fetcher(options);
+  const int64_t size = 256 << 20;
+  string url = SizeURL(size);
+  string resp;
+  for (auto _ : state) {
+    CheckOk(state, fetcher.FetchURL(url, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * size);
+}
+BENCHMARK(BM_RangedFetch)->ArgName("connections")->Arg(1)->Arg(4)->Arg(8)->UseRealTime();
+
+// Per-request cost of resolving through an EasyCurlDnsCache, here for a
+// pinned host name, from many threads at once.
+void BM_FetchURLDnsCache(benchmark::State& state) {
+  static EasyCurlDnsCache dns;
+  static Error pinned = dns.Pin("bench.test", Server()->port(), {"127.0.0.1"});
+  CheckOk(state, pinned);
+  EasyCurl curl;
+  curl.set_dns_cache(&dns);
+  string url = "http://bench.test:" + to_string(Server()->port()) + "/?size=16";
+  string resp;
+  for (auto _ : state) {
+    CheckOk(state, curl.FetchURL(url, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchURLDnsCache)->ThreadRange(1, 16)->UseRealTime();
+
+void BM_PostToURL(benchmark::State& state) {
+  EasyCurl curl;
+  string url = SizeURL(16);
+  string body(state.range(0), 'p');
+  string resp;
+  for (auto _ : state) {
+    CheckOk(state, curl.PostToURL(url, body, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PostToURL)->Apply(BodySizes);
+
+void BM_PostToURLStreaming(benchmark::State& state) {
+  EasyCurl curl;
+  string url = SizeURL(16);
+  string chunk(64 << 10, 'p');
+  string resp;
+  for (auto _ : state) {
+    int64_t left = state.range(0);
+    EasyCurl::ReadSource source = [&](char* buf, size_t len) {
+      size_t n = min<int64_t>(left, min(len, chunk.size()));
+      memcpy(buf, chunk.data(), n);
+      left -= n;
+      return n;
+    };
+    CheckOk(state, curl.PostToURL(url, source, state.range(0), &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+  state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_PostToURLStreaming)->Arg(64 << 10)->Arg(16 << 20);
+
+////////////////////////////////////////////////////////////
+// Thread scaling
+////////////////////////////////////////////////////////////
+
+// Each thread owns a handle.
+void BM_FetchURLThreads(benchmark::State& state) {
+  EasyCurl curl;
+  string url = SizeURL(state.range(0));
+  string resp;
+  for (auto _ : state) {
+    CheckOk(state, curl.FetchURL(url, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchURLThreads)->Arg(16)->ThreadRange(1, 64)->UseRealTime();
+
+// Threads check a handle out of a shared pool for every request.
+void BM_FetchURLPool(benchmark::State& state) {
+  static EasyCurlPool* pool = new EasyCurlPool(64);
+  string url = SizeURL(state.range(0));
+  string resp;
+  for (auto _ : state) {
+    auto curl = pool->Acquire();
+    CheckOk(state, curl->FetchURL(url, &resp));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchURLPool)->Arg(16)->ThreadRange(1, 64)->UseRealTime();
+
+// The first request on each handle of a new pool, with (range(0) = 1) and
+// without its connections opened ahead of time by Prewarm().
+void BM_FetchURLPoolColdStart(benchmark::State& state) {
+  const size_t kHandles = 8;
+  string url = SizeURL(16);
+  string resp;
+  for (auto _ : state) {
+    state.PauseTiming();
+    EasyCurlPool pool(kHandles);
+    if (state.range(0) != 0) {
+      CheckOk(state, pool.Prewarm({url}, kHandles));
+    }
+    vector<EasyCurlPool::Lease> leases;
+    for (size_t i = 0; i < kHandles; i++) {
+      leases.emplace_back(pool.Acquire());
+    }
+    state.ResumeTiming();
+    for (auto& curl : leases) {
+      CheckOk(state, curl->FetchURL(url, &resp));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * kHandles);
+}
+BENCHMARK(BM_FetchURLPoolColdStart)->ArgName("prewarm")->Arg(0)->Arg(1);
+
+// Each request on its own lease of a one-handle pool, bounded by the deadline
+// and token of a call which then goes away. The next lease of the handle sets
+// neither, and must not inherit them.
+void BM_FetchURLPoolDeadline(benchmark::State& state) {
+  EasyCurlPool pool(1);
+  string url = SizeURL(16);
+  string resp;
+  for (auto _ : state) {
+    {
+      auto curl = pool.Acquire();
+      std::unique_ptr<CancellationToken> token(new CancellationToken());
+      curl->set_cancellation_token(token.get());
+      curl->set_deadline(std::chrono::steady_clock::now() + std::chrono::hours(1));
+      CheckOk(state, curl->FetchURL(url, &resp));
+      // The call runs out of time before the handle goes back.
+      curl->set_deadline(std::chrono::steady_clock::now());
+    }
+    auto curl = pool.Acquire();
+    CheckOk(state, curl->FetchURL(url, &resp));
+  }
+  state.SetItemsProcessed(state.iterations() * 2);
+}
+BENCHMARK(BM_FetchURLPoolDeadline);
+
+// Compare with BM_FetchURLPool: threads fetching the same 1MB response at
+// once share transfers through an EasyCurlSingleFlight.
+void BM_FetchURLSingleFlight(benchmark::State& state) {
+  static EasyCurlPool* pool = new EasyCurlPool(64);
+  static EasyCurlSingleFlight* flights = new EasyCurlSingleFlight();
+  string url = SizeURL(1 << 20);
+  std::shared_ptr<const string> body;
+  for (auto _ : state) {
+    CheckOk(state, flights->FetchURL(pool, url, &body));
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FetchURLSingleFlight)->ThreadRange(1, 16)->UseRealTime();
+
+// The cost of a pool checkout and return alone.
+void BM_PoolAcquire(benchmark::State& state) {
+  static EasyCurlPool* pool = new EasyCurlPool(64);
+  for (auto _ : state) {
+    auto curl = pool->Acquire();
+    benchmark::DoNotOptimize(curl.get());
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_PoolAcquire)->ThreadRange(1, 64)->UseRealTime();
+
+// The cost of a limiter admission and release alone, rate and adaptive
+// concurrency limited but never turned down.
+void BM_LimiterAcquire(benchmark::State& state) {
+  static EasyCurlLimiter* limiter = []() {
+    LimiterOptions options;
+    options.requests_per_sec = 1e9;
+    options.burst = 1e6;
+    options.adaptive_concurrency = true;
+    options.initial_concurrency = 1024;
+    options.max_concurrency = 1024;
+    return new EasyCurlLimiter(options);
+  }();
+  // Looked up once, as EasyCurl does for requests to the same host.
+  LimiterHost* host = limiter->FindHost("127.0.0.1:8080");
+  for (auto _ : state) {
+    int64_t wait_us = limiter->TryAcquire(host);
+    if (wait_us == 0) {
+      limiter->Release(host, kOk, 200);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_LimiterAcquire)->ThreadRange(1, 16)->UseRealTime();
+
+////////////////////////////////////////////////////////////
+// Multi engine
+////////////////////////////////////////////////////////////
+
+// One iteration fetches range(1) URLs concurrently from a single thread.
+void BM_MultiFetch(benchmark::State& state) {
+  const int concurrency = static_cast<int>(state.range(1));
+  EasyCurlMulti multi;
+  vector<unique_ptr<EasyCurl>> curls;
+  vector<string> resps(concurrency);
+  for (int i = 0; i < concurrency; i++) {
+    curls.emplace_back(new EasyCurl());
+  }
+  string url = SizeURL(state.range(0));
+  Error error = kOk;
+  auto done = [&](EasyCurl* /*curl*/, const Error& e) {
+    if (e.code != kOk) {
+      error = e;
+    }
+  };
+  for (auto _ : state) {
+    for (int i = 0; i < concurrency; i++) {
+      CheckOk(state, multi.AddFetch(curls[i].get(), url, &resps[i], done));
+    }
+    CheckOk(state, multi.Run());
+    CheckOk(state, error);
+  }
+  state.SetItemsProcessed(state.iterations() * concurrency);
+  state.SetBytesProcessed(state.iterations() * concurrency * state.range(0));
+}
+BENCHMARK(BM_MultiFetch)
+    ->ArgNames({"size", "concurrency"})
+    ->ArgsProduct({{16, 64 << 10}, {1, 16, 64, 256}})
+    ->UseRealTime();
+
+// As BM_MultiFetch, with the transfers driven by EasyCurlEpoll rather than
+// EasyCurlMulti::Poll().
+void BM_MultiFetchEpoll(benchmark::State& state) {
+  const int concurrency = static_cast<int>(state.range(1));
+  EasyCurlMulti multi;
+  EasyCurlEpoll loop(&multi);
+  vector<unique_ptr<EasyCurl>> curls;
+  vector<string> resps(concurrency);
+  for (int i = 0; i < concurrency; i++) {
+    curls.emplace_back(new EasyCurl());
+  }
+  string url = SizeURL(state.range(0));
+  Error error = kOk;
+  auto done = [&](EasyCurl* /*curl*/, const Error& e) {
+    if (e.code != kOk) {
+      error = e;
+    }
+  };
+  for (auto _ : state) {
+    for (int i = 0; i < concurrency; i++) {
+      CheckOk(state, multi.AddFetch(curls[i].get(), url, &resps[i], done));
+    }
+    CheckOk(state, loop.Run());
+    CheckOk(state, error);
+  }
+  state.SetItemsProcessed(state.iterations() * concurrency);
+  state.SetBytesProcessed(state.iterations() * concurrency * state.range(0));
+}
+BENCHMARK(BM_MultiFetchEpoll)
+    ->ArgNames({"size", "concurrency"})
+    ->ArgsProduct({{16, 64 << 10}, {1, 16, 64, 256}})
+    ->UseRealTime();
+
+// EasyCurlEpoll run the way a reactor does: RunOnce(0) only once fd() is
+// readable. Each iteration starts from a fresh multi handle, so it opens a
+// connection, whose socket must be watched by then for fd() to wake up.
+void BM_MultiFetchEpollReactor(benchmark::State& state) {
+  EasyCurl curl;
+  string url = SizeURL(16);
+  string resp;
+  for (auto _ : state) {
+    EasyCurlMulti multi;
+    EasyCurlEpoll loop(&multi);
+    Error error = kOk;
+    bool done = false;
+    CheckOk(state, multi.AddFetch(&curl, url, &resp, [&](EasyCurl* /*curl*/, const Error& e) {
+      error = e;
+      done = true;
+    }));
+    while (!done) {
+      // Gives up waiting after a second, so that a stalled loop shows as
+      // slow iterations rather than hanging.
+      struct pollfd pfd = {loop.fd(), POLLIN, 0};
+      poll(&pfd, 1, 1000);
+      CheckOk(state, loop.RunOnce(0));
+    }
+    CheckOk(state, error);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MultiFetchEpollReactor)->UseRealTime();
+
+// As BM_MultiFetch with 256 transfers, at most range(0) of them in flight to
+// the server at a time (0 for no limit), the others waiting in the queue.
+void BM_MultiFetchHostLimit(benchmark::State& state) {
+  const int concurrency = 256;
+  EasyCurlMulti multi;
+  multi.set_max_transfers_per_host(static_cast<size_t>(state.range(0)));
+  vector<unique_ptr<EasyCurl>> curls;
+  vector<string> resps(concurrency);
+  for (int i = 0; i < concurrency; i++) {
+    curls.emplace_back(new EasyCurl());
+  }
+  string url = SizeURL(16);
+  Error error = kOk;
+  auto done = [&](EasyCurl* /*curl*/, const Error& e) {
+    if (e.code != kOk) {
+      error = e;
+    }
+  };
+  for (auto _ : state) {
+    for (int i = 0; i < concurrency; i++) {
+      CheckOk(state, multi.AddFetch(curls[i].get(), url, &resps[i], done));
+    }
+    CheckOk(state, multi.Run());
+    CheckOk(state, error);
+  }
+  state.SetItemsProcessed(state.iterations() * concurrency);
+}
+BENCHMARK(BM_MultiFetchHostLimit)->ArgName("per_host")->Arg(0)->Arg(4)->Arg(16)->UseRealTime();
+
+// One iteration fetches a batch of 500 URLs, at most range(1) at a time.
+void BM_FetchURLs(benchmark::State& state) {
+  EasyCurlBatch batch(static_cast<size_t>(state.range(1)));
+  vector<string> urls(500, SizeURL(state.range(0)));
+  vector<BatchResult> results;
+  for (auto _ : state) {
+    CheckOk(state, batch.FetchURLs(urls, &results));
+    for (const auto& result : results) {
+      CheckOk(state, result.error);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * urls.size());
+  state.SetBytesProcessed(state.iterations() * urls.size() * state.range(0));
+}
+BENCHMARK(BM_FetchURLs)
+    ->ArgNames({"size", "concurrency"})
+    ->ArgsProduct({{16, 64 << 10}, {1, 16, 64}})
+    ->UseRealTime();
+
+////////////////////////////////////////////////////////////
+// Asynchronous client
+////////////////////////////////////////////////////////////
+
+// Counts down completed requests, and lets the benchmark thread wait for
+// all of them.
+class Latch {
+ public:
+  void Reset(int n) {
+    std::lock_guard<std::mutex> l(lock_);
+    remaining_ = n;
+  }
+  void CountDown() {
+    std::lock_guard<std::mutex> l(lock_);
+    if (--remaining_ == 0) {
+      cond_.notify_one();
+    }
+  }
+  void Wait() {
+    std::unique_lock<std::mutex> l(lock_);
+    cond_.wait(l, [&]() { return remaining_ == 0; });
+  }
+
+ private:
+  std::mutex lock_;
+  std::condition_variable cond_;
+  int remaining_ = 0;
+};
+
+// One iteration submits range(1) requests from the benchmark thread and
+// waits for their callbacks, which run on the background thread.
+void BM_AsyncFetch(benchmark::State& state) {
+  const int concurrency = static_cast<int>(state.range(1));
+  EasyCurlAsync client(static_cast<size_t>(concurrency));
+  string url = SizeURL(state.range(0));
+  Latch latch;
+  Error error = kOk;
+  auto done = [&](EasyCurlAsync::Result result) {
+    if (result.error.code != kOk) {
+      error = result.error;
+    }
+    latch.CountDown();
+  };
+  for (auto _ : state) {
+    latch.Reset(concurrency);
+    for (int i = 0; i < concurrency; i++) {
+      client.Fetch(url, done);
+    }
+    latch.Wait();
+    CheckOk(state, error);
+  }
+  state.SetItemsProcessed(state.iterations() * concurrency);
+  state.SetBytesProcessed(state.iterations() * concurrency * state.range(0));
+}
+BENCHMARK(BM_AsyncFetch)
+    ->ArgNames({"size", "concurrency"})
+    ->ArgsProduct({{16, 64 << 10}, {1, 16, 64}})
+    ->UseRealTime();
+
+#ifdef EASY_CURL_COROUTINES
+// A coroutine which runs as soon as it is called, and cleans up after
+// itself once done.
+struct Detached {
+  struct promise_type {
+    Detached get_return_object() { return {}; }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+  };
+};
+
+Detached FetchInCoroutine(EasyCurlAsync* client, const string& url, Error* error, Latch* latch) {
+  auto result = co_await AsyncFetch(client, url);
+  if (result.error.code != kOk) {
+    *error = result.error;
+  }
+  latch->CountDown();
+}
+
+// As BM_AsyncFetch, with each request awaited by a coroutine of its own.
+void BM_CoroFetch(benchmark::State& state) {
+  const int concurrency = static_cast<int>(state.range(1));
+  EasyCurlAsync client(static_cast<size_t>(concurrency));
+  string url = SizeURL(state.range(0));
+  Latch latch;
+  Error error = kOk;
+  for (auto _ : state) {
+    latch.Reset(concurrency);
+    for (int i = 0; i < concurrency; i++) {
+      FetchInCoroutine(&client, url, &error, &latch);
+    }
+    latch.Wait();
+    CheckOk(state, error);
+  }
+  state.SetItemsProcessed(state.iterations() * concurrency);
+  state.SetBytesProcessed(state.iterations() * concurrency * state.range(0));
+}
+BENCHMARK(BM_CoroFetch)
+    ->ArgNames({"size", "concurrency"})
+    ->ArgsProduct({{16, 64 << 10}, {1, 16, 64}})
+    ->UseRealTime();
+#endif
+
+////////////////////////////////////////////////////////////
+// Metrics
+////////////////////////////////////////////////////////////
+
+void BM_MetricsRecord(benchmark::State& state) {
+  static EasyCurlMetrics* metrics = new EasyCurlMetrics();
+  TransferStats stats;
+  stats.effective_url = SizeURL(16);
+  stats.response_code = 200;
+  stats.total_us = 1234;
+  Error error = kOk;
+  for (auto _ : state) {
+    metrics->Record(stats, error);
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_MetricsRecord)->ThreadRange(1, 16)->UseRealTime();
+
+} // anonymous namespace
+
+BENCHMARK_MAIN();
@@ -0,0 +1,308 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "bench/loopback_http_server.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace {
+
+// Body bytes are sent from this buffer, as many times over as needed.
+const string& BodyChunk() {
+  static const string chunk(64 * 1024, 'x');
+  return chunk;
+}
+
+bool SendAll(int fd, const char* data, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+    if (n <= 0) {
+      return false;
+    }
+    data += n;
+    len -= n;
+  }
+  return true;
+}
+
+// Returns the value of the header 'name' (including the trailing ':') in
+// 'headers', or an empty string.
+string HeaderValue(const string& headers, const char* name) {
+  size_t name_len = strlen(name);
+  size_t pos = 0;
+  while ((pos = headers.find("\r\n", pos)) != string::npos) {
+    pos += 2;
+    if (strncasecmp(headers.c_str() + pos, name, name_len) == 0) {
+      size_t start = headers.find_first_not_of(' ', pos + name_len);
+      size_t end = headers.find("\r\n", start);
+      return headers.substr(start, end - start);
+    }
+  }
+  return "";
+}
+
+// Returns the value of the query parameter 'size' in the request target.
+uint64_t RequestedSize(const string& target) {
+  size_t pos = target.find("size=");
+  if (pos == string::npos) {
+    return 0;
+  }
+  return strtoull(target.c_str() + pos + 5, nullptr, 10);
+}
+
+} // anonymous namespace
+
+LoopbackHttpServer::LoopbackHttpServer() = default;
+
+LoopbackHttpServer::~LoopbackHttpServer() {
+  Stop();
+}
+
+void LoopbackHttpServer::Start() {
+  listen_fd_ = socket(AF_INET, SOCK_STREAM, 0);
+  int one = 1;
+  setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = 0;
+  socklen_t addr_len = sizeof(addr);
+  if (listen_fd_ < 0 ||
+      bind(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      listen(listen_fd_, 1024) != 0 ||
+      getsockname(listen_fd_, reinterpret_cast<struct sockaddr*>(&addr), &addr_len) != 0) {
+    cerr << "Could not start loopback HTTP server: " << strerror(errno) << endl;
+    exit(1);
+  }
+  port_ = ntohs(addr.sin_port);
+  acceptor_ = thread([this]() { AcceptLoop(); });
+}
+
+void LoopbackHttpServer::Stop() {
+  if (listen_fd_ < 0 || stopping_.exchange(true)) {
+    return;
+  }
+  shutdown(listen_fd_, SHUT_RDWR);
+  acceptor_.join();
+  close(listen_fd_);
+
+  unique_lock<mutex> l(lock_);
+  for (int fd : conn_fds_) {
+    shutdown(fd, SHUT_RDWR);
+  }
+  workers_done_.wait(l, [this]() { return conn_fds_.empty(); });
+}
+
+string LoopbackHttpServer::url() const {
+  return "http://127.0.0.1:" + to_string(port_);
+}
+
+void LoopbackHttpServer::AcceptLoop() {
+  while (!stopping_) {
+    int fd = accept(listen_fd_, nullptr, nullptr);
+    if (fd < 0) {
+      if (stopping_) {
+        return;
+      }
+      continue;
+    }
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    num_connections_.fetch_add(1, memory_order_relaxed);
+    lock_guard<mutex> l(lock_);
+    if (stopping_) {
+      close(fd);
+      return;
+    }
+    conn_fds_.push_back(fd);
+    thread([this, fd]() { ServeConnection(fd); }).detach();
+  }
+}
+
+void LoopbackHttpServer::ServeConnection(int fd) {
+  string buf;
+  char rd[64 * 1024];
+  bool ok = true;
+  while (ok) {
+    // Read until the end of the request headers.
+    size_t headers_end;
+    while ((headers_end = buf.find("\r\n\r\n")) == string::npos) {
+      ssize_t n = recv(fd, rd, sizeof(rd), 0);
+      if (n <= 0) {
+        ok = false;
+        break;
+      }
+      buf.append(rd, n);
+    }
+    if (!ok) {
+      break;
+    }
+    string headers = buf.substr(0, headers_end + 2);
+    buf.erase(0, headers_end + 4);
+
+    size_t method_end = headers.find(' ');
+    size_t target_end = headers.find(' ', method_end + 1);
+    string method = headers.substr(0, method_end);
+    string target = headers.substr(method_end + 1, target_end - method_end - 1);
+
+    if (strcasecmp(HeaderValue(headers, "Expect:").c_str(), "100-continue") == 0) {
+      static const char kContinue[] = "HTTP/1.1 100 Continue\r\n\r\n";
+      ok = SendAll(fd, kContinue, sizeof(kContinue) - 1);
+    }
+
+    // Consume and discard the request body.
+    if (strcasecmp(HeaderValue(headers, "Transfer-Encoding:").c_str(), "chunked") == 0) {
+      while (ok) {
+        size_t line_end;
+        while ((line_end = buf.find("\r\n")) == string::npos) {
+          ssize_t n = recv(fd, rd, sizeof(rd), 0);
+          if (n <= 0) {
+            ok = false;
+            break;
+          }
+          buf.append(rd, n);
+        }
+        if (!ok) {
+          break;
+        }
+        uint64_t chunk_len = strtoull(buf.c_str(), nullptr, 16);
+        // The chunk data is followed by a CRLF; the last, empty, chunk by
+        // an empty trailer line.
+        uint64_t need = line_end + 2 + chunk_len + 2;
+        while (buf.size() < need) {
+          ssize_t n = recv(fd, rd, sizeof(rd), 0);
+          if (n <= 0) {
+            ok = false;
+            break;
+          }
+          buf.append(rd, n);
+        }
+        if (!ok) {
+          break;
+        }
+        buf.erase(0, need);
+        if (chunk_len == 0) {
+          break;
+        }
+      }
+    } else {
+      uint64_t body_len = strtoull(HeaderValue(headers, "Content-Length:").c_str(), nullptr, 10);
+      uint64_t have = min<uint64_t>(body_len, buf.size());
+      buf.erase(0, have);
+      body_len -= have;
+      while (ok && body_len > 0) {
+        ssize_t n = recv(fd, rd, min<uint64_t>(sizeof(rd), body_len), 0);
+        if (n <= 0) {
+          ok = false;
+          break;
+        }
+        body_len -= n;
+      }
+    }
+    if (!ok) {
+      break;
+    }
+
+    uint64_t size = RequestedSize(target);
+    string response_headers;
+    // Serve "Range: bytes=first-last" requests within the body; the body is
+    // the same bytes over and over, so any range of it looks alike.
+    string range = HeaderValue(headers, "Range:");
+    uint64_t first = 0;
+    uint64_t last = 0;
+    if (sscanf(range.c_str(), "bytes=%" SCNu64 "-%" SCNu64, &first, &last) == 2 &&
+        first <= last && last < size) {
+      response_headers = "HTTP/1.1 206 Partial Content\r\nContent-Range: bytes " +
+          to_string(first) + "-" + to_string(last) + "/" + to_string(size) +
+          "\r\nContent-Length: " + to_string(last - first + 1) + "\r\n\r\n";
+      size = last - first + 1;
+    } else if (target.find("etag=1") != string::npos) {
+      // A response to revalidate every time, whose ETag is its size.
+      string etag = "\"" + to_string(size) + "\"";
+      if (HeaderValue(headers, "If-None-Match:") == etag) {
+        response_headers = "HTTP/1.1 304 Not Modified\r\nETag: " + etag + "\r\n\r\n";
+        size = 0;
+      } else {
+        response_headers = "HTTP/1.1 200 OK\r\nETag: " + etag +
+            "\r\nCache-Control: no-cache\r\nContent-Length: " + to_string(size) + "\r\n\r\n";
+      }
+    } else {
+      response_headers = "HTTP/1.1 200 OK\r\nContent-Length: " + to_string(size) + "\r\n\r\n";
+    }
+    const string& chunk = BodyChunk();
+    if (method == "HEAD") {
+      size = 0;
+    }
+    // Send the headers and the start of the body in a single write, without
+    // SIGPIPE if the client went away, as SendAll().
+    struct iovec iov[2];
+    iov[0].iov_base = const_cast<char*>(response_headers.data());
+    iov[0].iov_len = response_headers.size();
+    iov[1].iov_base = const_cast<char*>(chunk.data());
+    iov[1].iov_len = min<uint64_t>(size, chunk.size());
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    if (n < static_cast<ssize_t>(iov[0].iov_len + iov[1].iov_len)) {
+      // Finish a short write the slow way.
+      size_t total = iov[0].iov_len + iov[1].iov_len;
+      size_t sent = n < 0 ? 0 : n;
+      if (n < 0) {
+        break;
+      }
+      if (sent < iov[0].iov_len) {
+        ok = SendAll(fd, response_headers.data() + sent, iov[0].iov_len - sent);
+        sent = iov[0].iov_len;
+      }
+      if (ok) {
+        ok = SendAll(fd, chunk.data() + (sent - iov[0].iov_len), total - sent);
+      }
+    }
+    size -= iov[1].iov_len;
+    while (ok && size > 0) {
+      size_t len = min<uint64_t>(size, chunk.size());
+      ok = SendAll(fd, chunk.data(), len);
+      size -= len;
+    }
+  }
+
+  lock_guard<mutex> l(lock_);
+  conn_fds_.erase(std::remove(conn_fds_.begin(), conn_fds_.end(), fd), conn_fds_.end());
+  close(fd);
+  workers_done_.notify_all();
+}
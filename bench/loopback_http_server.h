@@ -0,0 +1,79 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_BENCH_LOOPBACK_HTTP_SERVER_H
+#define EASY_CURL_BENCH_LOOPBACK_HTTP_SERVER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A minimal HTTP/1.1 server listening on the loopback interface, to measure
+// the client side without a real network or server getting in the way.
+//
+// Every request is answered with a 200 and a body of the size given by the
+// "size" query parameter (default 0), e.g. "GET /?size=1024". The body of a
+// POST is read and discarded. Connections are kept alive, each served by a
+// (detached) thread of its own.
+class LoopbackHttpServer {
+ public:
+  LoopbackHttpServer();
+  ~LoopbackHttpServer();
+
+  LoopbackHttpServer(const LoopbackHttpServer& that) = delete;
+  LoopbackHttpServer& operator=(const LoopbackHttpServer& that) = delete;
+
+  // Start listening on an ephemeral port. Exits the process on failure.
+  void Start();
+
+  // Stop accepting connections, close the open ones and join all threads.
+  void Stop();
+
+  int port() const {
+    return port_;
+  }
+
+  // Returns "http://127.0.0.1:<port>".
+  std::string url() const;
+
+  // Returns the number of connections accepted so far.
+  int64_t num_connections() const {
+    return num_connections_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  void AcceptLoop();
+  void ServeConnection(int fd);
+
+  int listen_fd_ = -1;
+  int port_ = 0;
+  std::atomic<bool> stopping_{false};
+  std::atomic<int64_t> num_connections_{0};
+
+  std::thread acceptor_;
+
+  std::mutex lock_;
+  std::condition_variable workers_done_;
+  // Sockets of the open connections, each served by one worker thread.
+  std::vector<int> conn_fds_;
+};
+
+#endif //EASY_CURL_BENCH_LOOPBACK_HTTP_SERVER_H
@@ -16,18 +16,31 @@
 // under the License.
 
 #include "easy_curl.h"
+#include "easy_curl_dns.h"
+#include "easy_curl_limiter.h"
+#include "easy_curl_metrics.h"
+#include "easy_curl_share.h"
 #include "scoped_cleanup.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
 #include <iostream>
 #include <cstdint>
 #include <cstring>
 #include <mutex>
 #include <ostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <curl/curl.h>
 #include <cassert>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 namespace {
 
@@ -36,46 +49,251 @@ inline Error TranslateError(CURLcode code, const char* errbuf) {
     return kOk;
   }
 
-  string err_msg = curl_easy_strerror(code);
-  if (strlen(errbuf) != 0) {
-    err_msg += ": " + string(errbuf);
+  ErrorCode error_code = kNetworkError;
+  const char* prefix = "curl error: ";
+  if (code == CURLE_OPERATION_TIMEDOUT) {
+    error_code = kTimedOut;
+    prefix = "curl timeout: ";
+  } else if (code == CURLE_ABORTED_BY_CALLBACK) {
+    error_code = kAborted;
+    prefix = "curl aborted: ";
   }
 
-  if (code == CURLE_OPERATION_TIMEDOUT) {
-    return Error(kTimedOut, "curl timeout" + err_msg);
+  // Build the message in place rather than out of temporaries.
+  const char* description = curl_easy_strerror(code);
+  size_t errbuf_len = strlen(errbuf);
+  string err_msg;
+  err_msg.reserve(strlen(prefix) + strlen(description) + 2 + errbuf_len);
+  err_msg.append(prefix).append(description);
+  if (errbuf_len != 0) {
+    err_msg.append(": ").append(errbuf, errbuf_len);
+  }
+  return Error(error_code, std::move(err_msg));
+}
+
+// CURLOPT_XFERINFOFUNCTION callback aborting transfers once their token is
+// cancelled; 'user_ptr' is the CancellationToken.
+int CancellationCallback(void* user_ptr, curl_off_t /* dltotal */, curl_off_t /* dlnow */,
+                         curl_off_t /* ultotal */, curl_off_t /* ulnow */) {
+  return reinterpret_cast<const CancellationToken*>(user_ptr)->cancelled() ? 1 : 0;
+}
+
+inline long TranslateHttpVersion(CurlHttpVersion version) { // NOLINT(*) curl wants a long
+  switch (version) {
+    case CurlHttpVersion::HTTP_1_1:
+      return CURL_HTTP_VERSION_1_1;
+    case CurlHttpVersion::HTTP_2:
+      return CURL_HTTP_VERSION_2_0;
+    case CurlHttpVersion::HTTP_2_TLS:
+      return CURL_HTTP_VERSION_2TLS;
+    case CurlHttpVersion::HTTP_2_PRIOR_KNOWLEDGE:
+      return CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE;
+    case CurlHttpVersion::DEFAULT:
+    default:
+      return CURL_HTTP_VERSION_NONE;
+  }
+}
+
+// Parses the value of a Content-Range header, "bytes <first>-<last>/<size>"
+// or "bytes */<size>", where the size may also be "*". Unknown parts are -1.
+void ParseContentRange(const string& value, int64_t* start, int64_t* total) {
+  *start = -1;
+  *total = -1;
+  size_t pos = value.find_first_not_of(" \t");
+  if (pos == string::npos || strncasecmp(value.c_str() + pos, "bytes ", 6) != 0) {
+    return;
+  }
+  pos = value.find_first_not_of(' ', pos + 6);
+  if (pos != string::npos && isdigit(static_cast<unsigned char>(value[pos]))) {
+    *start = strtoll(value.c_str() + pos, nullptr, 10);
+  }
+  size_t slash = value.find('/');
+  if (slash != string::npos && slash + 1 < value.size() && value[slash + 1] != '*') {
+    *total = strtoll(value.c_str() + slash + 1, nullptr, 10);
   }
-  return Error(kNetworkError, "curl error" + err_msg);
 }
 
 extern "C" {
-size_t WriteCallback(void* buffer, size_t size, size_t nmemb, void* user_ptr) {
-  size_t real_size = size * nmemb;
-  string* buf = reinterpret_cast<string*>(user_ptr);
-  buf->append(reinterpret_cast<const char*>(buffer), real_size);
-  return real_size;
+size_t ReadCallback(char* buffer, size_t size, size_t nitems, void* user_ptr) {
+  const auto* source = reinterpret_cast<const EasyCurl::ReadSource*>(user_ptr);
+  return (*source)(buffer, size * nitems);
 }
 } // extern "C"
 
 } // anonymous namespace
 
-#define CURL_RETURN_NOT_OK(expr)  { \
-    auto error = TranslateError((expr), errbuf_); \
+#define RETURN_NOT_OK(expr)  { \
+    auto error = (expr); \
     if (error.code != kOk) { \
       return error; \
     } \
   }
 
-EasyCurl::EasyCurl() : timeout_secs_(-1) {
+#define CURL_RETURN_NOT_OK(expr) RETURN_NOT_OK(TranslateError((expr), errbuf_))
+
+namespace {
+
+// Guards the initialization of libcurl and the allocator it is given.
+std::mutex global_init_lock;
+std::atomic<bool> global_initialized(false);
+bool has_global_allocator = false;
+CurlAllocator global_allocator;
+
+} // anonymous namespace
+
+void EasyCurl::GlobalInit() {
   // curl_global_init() is not thread safe and multiple calls have the
   // same effect as one call.
   // See more details: https://curl.haxx.se/libcurl/c/curl_global_init.html
-  static std::once_flag once;
-  std::call_once(once, []() {
-    if (curl_global_init(CURL_GLOBAL_DEFAULT & ~CURL_GLOBAL_SSL) != 0) {
-      cerr << "CURL init fatal error";
-      exit(1);
+  if (global_initialized.load(std::memory_order_acquire)) {
+    return;
+  }
+  std::lock_guard<std::mutex> l(global_init_lock);
+  if (global_initialized.load(std::memory_order_relaxed)) {
+    return;
+  }
+  // Initialize the TLS backend up front as well, rather than leaving it to
+  // whichever thread happens to open the first HTTPS connection.
+  CURLcode res;
+  if (has_global_allocator) {
+    const CurlAllocator& a = global_allocator;
+    res = curl_global_init_mem(CURL_GLOBAL_DEFAULT, a.malloc_fn, a.free_fn, a.realloc_fn,
+                               a.strdup_fn, a.calloc_fn);
+  } else {
+    res = curl_global_init(CURL_GLOBAL_DEFAULT);
+  }
+  if (res != CURLE_OK) {
+    cerr << "CURL init fatal error";
+    exit(1);
+  }
+  global_initialized.store(true, std::memory_order_release);
+}
+
+Error EasyCurl::set_global_allocator(const CurlAllocator& allocator) {
+  if (allocator.malloc_fn == nullptr || allocator.free_fn == nullptr ||
+      allocator.realloc_fn == nullptr || allocator.strdup_fn == nullptr ||
+      allocator.calloc_fn == nullptr) {
+    return Error(kInvalidArgument, "all allocation functions must be set");
+  }
+  std::lock_guard<std::mutex> l(global_init_lock);
+  if (global_initialized.load(std::memory_order_relaxed)) {
+    return Error(kIllegalState, "libcurl is already initialized");
+  }
+  global_allocator = allocator;
+  has_global_allocator = true;
+  return kOk;
+}
+
+bool EasyCurl::ParseHost(string_view url, string_view* host, int* port) {
+  // This runs for every transfer, so it is a hand-rolled pass rather than a
+  // series of find() calls. Like curl, take URLs without a scheme for HTTP
+  // ones.
+  size_t start = 0;
+  *port = 80;
+  for (size_t i = 0; i < url.size(); i++) {
+    char c = url[i];
+    if (c == ':') {
+      if (i + 2 < url.size() && url[i + 1] == '/' && url[i + 2] == '/') {
+        auto scheme_is = [&](string_view s) {
+          if (i != s.size()) {
+            return false;
+          }
+          for (size_t j = 0; j < i; j++) {
+            if ((url[j] | 0x20) != s[j]) {
+              return false;
+            }
+          }
+          return true;
+        };
+        *port = scheme_is("http") ? 80 : scheme_is("https") ? 443 : 0;
+        start = i + 3;
+      }
+      break;
     }
-  });
+    if (c == '/' || c == '?' || c == '#') {
+      break;
+    }
+  }
+  // The authority ends the URL or is followed by the path, query or
+  // fragment; user info ends with its last '@'.
+  size_t end = start;
+  for (; end < url.size(); end++) {
+    char c = url[end];
+    if (c == '/' || c == '?' || c == '#') {
+      break;
+    }
+    if (c == '@') {
+      start = end + 1;
+    }
+  }
+  string_view authority = url.substr(start, end - start);
+  string_view port_str;
+  if (!authority.empty() && authority[0] == '[') {
+    size_t close = authority.find(']');
+    if (close == string_view::npos) {
+      return false;
+    }
+    *host = authority.substr(1, close - 1);
+    port_str = authority.substr(close + 1);
+    if (!port_str.empty() && port_str[0] != ':') {
+      return false;
+    }
+  } else {
+    size_t colon = authority.find(':');
+    *host = authority.substr(0, colon);
+    port_str = colon == string_view::npos ? string_view() : authority.substr(colon);
+  }
+  if (port_str.size() > 1) {
+    int parsed = 0;
+    for (char c : port_str.substr(1)) {
+      if (c < '0' || c > '9' || parsed > 65535) {
+        return false;
+      }
+      parsed = parsed * 10 + (c - '0');
+    }
+    if (parsed > 65535) {
+      return false;
+    }
+    *port = parsed;
+  }
+  return !host->empty();
+}
+
+void EasyCurl::HostKey(string_view url, string* key) {
+  key->clear();
+  string_view host;
+  int port;
+  if (!ParseHost(url, &host, &port)) {
+    return;
+  }
+  bool ipv6 = host.find(':') != string_view::npos;
+  if (ipv6) {
+    key->push_back('[');
+  }
+  key->append(host.data(), host.size());
+  for (size_t i = ipv6 ? 1 : 0; i < key->size(); i++) {
+    char c = (*key)[i];
+    if (c >= 'A' && c <= 'Z') {
+      (*key)[i] = static_cast<char>(c - 'A' + 'a');
+    }
+  }
+  if (ipv6) {
+    key->push_back(']');
+  }
+  if (port != 0) {
+    char buf[8];
+    char* p = buf + sizeof(buf);
+    do {
+      *--p = static_cast<char>('0' + port % 10);
+      port /= 10;
+    } while (port != 0);
+    *--p = ':';
+    key->append(p, buf + sizeof(buf) - p);
+  }
+}
+
+EasyCurl::EasyCurl() {
+  GlobalInit();
   curl_ = curl_easy_init();
   if (curl_ == nullptr) {
     cerr << "Could not init curl";
@@ -90,34 +308,854 @@ EasyCurl::EasyCurl() : timeout_secs_(-1) {
     cerr << "Failed configuring CURL error buffer";
     exit(1);
   }
+
+  if (curl_easy_setopt(curl_, CURLOPT_HEADERFUNCTION, HeaderCallback) != CURLE_OK ||
+      curl_easy_setopt(curl_, CURLOPT_HEADERDATA, static_cast<void *>(this)) != CURLE_OK) {
+    cerr << "Failed configuring CURL header callback";
+    exit(1);
+  }
+
+  // The write callbacks find the destination of the in-flight request
+  // through the instance.
+  if (curl_easy_setopt(curl_, CURLOPT_WRITEDATA, static_cast<void *>(this)) != CURLE_OK) {
+    cerr << "Failed configuring CURL write callback";
+    exit(1);
+  }
+}
+
+namespace {
+std::atomic<uint64_t> next_template_id(1);
+} // anonymous namespace
+
+RequestTemplate::RequestTemplate(std::string url_base, const vector<string>& headers)
+    : id_(next_template_id.fetch_add(1, std::memory_order_relaxed)),
+      url_base_(std::move(url_base)) {
+  for (const auto& header : headers) {
+    headers_ = curl_slist_append(headers_, header.c_str());
+  }
+}
+
+RequestTemplate::~RequestTemplate() {
+  curl_slist_free_all(headers_);
+}
+
+namespace {
+
+bool HeaderNameEquals(string_view a, string_view b) {
+  return a.size() == b.size() && strncasecmp(a.data(), b.data(), a.size()) == 0;
+}
+
+} // anonymous namespace
+
+void ResponseHeaders::Parse() const {
+  if (parsed_) {
+    return;
+  }
+  headers_.clear();
+  status_line_ = string_view();
+  string_view rest = raw_;
+  while (!rest.empty()) {
+    size_t eol = rest.find('\n');
+    string_view line = rest.substr(0, eol);
+    rest = eol == string_view::npos ? string_view() : rest.substr(eol + 1);
+    if (!line.empty() && line.back() == '\r') {
+      line.remove_suffix(1);
+    }
+    if (line.size() >= 5 && line.substr(0, 5) == "HTTP/") {
+      status_line_ = line;
+      continue;
+    }
+    // Skips the blank line ending the headers, and obsolete line folding.
+    size_t colon = line.find(':');
+    if (line.empty() || line[0] == ' ' || line[0] == '\t' || colon == string_view::npos) {
+      continue;
+    }
+    Header header;
+    header.name = line.substr(0, colon);
+    string_view value = line.substr(colon + 1);
+    size_t start = value.find_first_not_of(" \t");
+    size_t end = value.find_last_not_of(" \t");
+    header.value = start == string_view::npos ? string_view() : value.substr(start, end - start + 1);
+    headers_.push_back(header);
+  }
+  parsed_ = true;
+}
+
+string_view ResponseHeaders::status_line() const {
+  Parse();
+  return status_line_;
+}
+
+bool ResponseHeaders::Get(string_view name, string_view* value) const {
+  Parse();
+  for (const auto& header : headers_) {
+    if (HeaderNameEquals(header.name, name)) {
+      *value = header.value;
+      return true;
+    }
+  }
+  return false;
+}
+
+void ResponseHeaders::GetAll(string_view name, vector<string_view>* values) const {
+  Parse();
+  for (const auto& header : headers_) {
+    if (HeaderNameEquals(header.name, name)) {
+      values->push_back(header.value);
+    }
+  }
+}
+
+const vector<ResponseHeaders::Header>& ResponseHeaders::headers() const {
+  Parse();
+  return headers_;
 }
 
 EasyCurl::~EasyCurl() {
   curl_easy_cleanup(curl_);
 }
 
+Error EasyCurl::set_share(EasyCurlShare* share) {
+  errbuf_[0] = 0;
+  // Addresses from the DNS cache went to the DNS cache curl used so far.
+  applied_dns_versions_.clear();
+  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_SHARE,
+                                      share ? share->share_ : nullptr));
+  return kOk;
+}
+
 Error EasyCurl::FetchURL(const string& url, string* dst,
                          const vector<string>& headers) {
-  return DoRequest(url, nullptr, dst, headers);
+  assert(dst != nullptr);
+  return DoRequest(url, nullptr, dst, nullptr, headers);
+}
+
+Error EasyCurl::FetchURL(const string& url, const WriteSink& sink,
+                         const vector<string>& headers) {
+  return DoRequest(url, nullptr, nullptr, &sink, headers);
+}
+
+Error EasyCurl::HeadURL(const string& url, const vector<string>& headers) {
+  // HEAD responses have no body; the buffer only satisfies PrepareRequest().
+  string body;
+  RETURN_NOT_OK(PrepareRequest(url, nullptr, &body, nullptr, headers));
+  auto reset_nobody = MakeScopedCleanup([&]() {
+    // Switching to GET or POST doesn't always clear it.
+    curl_easy_setopt(curl_, CURLOPT_NOBODY, 0L);
+  });
+  CURLcode code = curl_easy_setopt(curl_, CURLOPT_NOBODY, 1L);
+  return FinishRequest(code == CURLE_OK ? curl_easy_perform(curl_) : code);
+}
+
+struct EasyCurl::FileFetch {
+  int fd = -1;
+  const FileFetchOptions* options = nullptr;
+
+  // Whether 'fd' is a regular file, written to at 'offset' with pwrite(),
+  // rather than sequentially.
+  bool regular = false;
+
+  // The size of the file to resume from, and where the next byte of the
+  // response goes.
+  int64_t resume_from = 0;
+  int64_t offset = 0;
+
+  // Gathers the response into large writes. Page-aligned, so it could be
+  // written out with O_DIRECT as well.
+  char* buffer = nullptr;
+  size_t buffer_size = 0;
+  size_t buffered = 0;
+
+  // Whether the body of the response started arriving, and whether it is
+  // thrown away rather than written to the file, as for error pages.
+  bool started = false;
+  bool discard = false;
+
+  // Set if writing to the file failed, which aborts the transfer.
+  Error error = Error(kOk);
+
+  Error Write(const char* data, size_t len) {
+    while (len > 0) {
+      ssize_t n = regular ? pwrite(fd, data, len, offset) : write(fd, data, len);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return Error(kIOError, string("could not write downloaded file: ") + strerror(errno));
+      }
+      data += n;
+      len -= static_cast<size_t>(n);
+      offset += n;
+    }
+    return kOk;
+  }
+
+  Error Flush() {
+    size_t len = buffered;
+    buffered = 0;
+    return Write(buffer, len);
+  }
+};
+
+Error EasyCurl::FetchToFile(const string& url,
+                            const string& path,
+                            const FileFetchOptions& options,
+                            const vector<string>& headers) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC | (options.resume ? 0 : O_TRUNC),
+                0644);
+  if (fd < 0) {
+    return Error(kIOError, "could not open " + path + ": " + strerror(errno));
+  }
+  auto error = FetchToFile(url, fd, options, headers);
+  // Errors writing back the data may only show up now.
+  if (close(fd) != 0 && error.code == kOk) {
+    return Error(kIOError, "could not close " + path + ": " + strerror(errno));
+  }
+  return error;
+}
+
+Error EasyCurl::FetchToFile(const string& url,
+                            int fd,
+                            const FileFetchOptions& options,
+                            const vector<string>& headers) {
+  FileFetch file;
+  file.fd = fd;
+  file.options = &options;
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return Error(kIOError, string("could not stat downloaded file: ") + strerror(errno));
+  }
+  file.regular = S_ISREG(st.st_mode);
+  if (file.regular && options.resume) {
+    file.resume_from = st.st_size;
+  } else if (file.regular && ftruncate(fd, 0) != 0) {
+    return Error(kIOError, string("could not truncate downloaded file: ") + strerror(errno));
+  }
+
+  static const constexpr size_t kAlignment = 4096;
+  file.buffer_size = (std::max<size_t>(options.buffer_size, 1) + kAlignment - 1) &
+      ~(kAlignment - 1);
+  if (file_buffer_size_ != file.buffer_size) {
+    void* buffer;
+    if (posix_memalign(&buffer, kAlignment, file.buffer_size) != 0) {
+      return Error(kRuntimeError, "could not allocate download buffer");
+    }
+    file_buffer_.reset(static_cast<char*>(buffer));
+    file_buffer_size_ = file.buffer_size;
+  }
+  file.buffer = file_buffer_.get();
+
+  bool range_ignored = false;
+  auto error = DoFileFetch(url, &file, headers, &range_ignored);
+  if (range_ignored) {
+    // The server can only send the whole file.
+    if (ftruncate(fd, 0) != 0) {
+      return Error(kIOError, string("could not truncate downloaded file: ") + strerror(errno));
+    }
+    file.resume_from = 0;
+    error = DoFileFetch(url, &file, headers, &range_ignored);
+  }
+  if (error.code == kOk && options.sync && fdatasync(fd) != 0) {
+    return Error(kIOError, string("could not sync downloaded file: ") + strerror(errno));
+  }
+  return error;
+}
+
+Error EasyCurl::DoFileFetch(const string& url,
+                            FileFetch* file,
+                            const vector<string>& headers,
+                            bool* range_ignored) {
+  file->offset = file->resume_from;
+  file->buffered = 0;
+  file->started = false;
+  file->discard = false;
+  file->error = Error(kOk);
+
+  WriteSink sink = [this, file](const char* data, size_t len) -> size_t {
+    if (!file->started) {
+      file->started = true;
+      long response_code = 0; // NOLINT(*) curl wants a long
+      curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &response_code);
+      file->discard = response_code < 200 || response_code >= 300;
+#ifdef __linux__
+      curl_off_t content_length;
+      if (!file->discard && file->regular && file->options->preallocate &&
+          curl_easy_getinfo(curl_, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                            &content_length) == CURLE_OK &&
+          content_length > 0 &&
+          static_cast<uint64_t>(content_length) > file->buffer_size &&
+          fallocate(file->fd, FALLOC_FL_KEEP_SIZE, file->offset, content_length) != 0 &&
+          errno == ENOSPC) {
+        // Other failures only mean the file system can't do it.
+        file->error = Error(kIOError, "not enough space for downloaded file");
+        return 0;
+      }
+#endif
+    }
+    if (file->discard) {
+      return len;
+    }
+    // Large chunks skip the buffer, rather than being copied into it.
+    if (file->buffered == 0 && len >= file->buffer_size) {
+      file->error = file->Write(data, len);
+      return file->error.code == kOk ? len : 0;
+    }
+    size_t remaining = len;
+    while (remaining > 0) {
+      size_t n = std::min(remaining, file->buffer_size - file->buffered);
+      memcpy(file->buffer + file->buffered, data, n);
+      file->buffered += n;
+      data += n;
+      remaining -= n;
+      if (file->buffered == file->buffer_size) {
+        file->error = file->Flush();
+        if (file->error.code != kOk) {
+          return 0;
+        }
+      }
+    }
+    return len;
+  };
+
+  // Set up before the request, as the request must be finished once it is
+  // prepared.
+  errbuf_[0] = 0;
+  CURL_RETURN_NOT_OK(curl_easy_setopt(
+      curl_, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(file->resume_from)));
+  // Have curl hand over the data in large chunks too.
+#ifdef CURL_MAX_READ_SIZE
+  CURL_RETURN_NOT_OK(curl_easy_setopt(
+      curl_, CURLOPT_BUFFERSIZE,
+      static_cast<long>(std::min<size_t>(file->buffer_size, CURL_MAX_READ_SIZE)))); // NOLINT(*)
+#endif
+  auto reset_handle = MakeScopedCleanup([&]() {
+    curl_easy_setopt(curl_, CURLOPT_RESUME_FROM_LARGE, static_cast<curl_off_t>(0));
+    curl_easy_setopt(curl_, CURLOPT_BUFFERSIZE, static_cast<long>(CURL_MAX_WRITE_SIZE)); // NOLINT(*)
+  });
+
+  RETURN_NOT_OK(PrepareRequest(url, nullptr, nullptr, &sink, headers));
+  auto error = FinishRequest(curl_easy_perform(curl_));
+  if (file->error.code == kOk) {
+    file->error = file->Flush();
+  }
+  if (file->error.code != kOk) {
+    return file->error;
+  }
+
+  *range_ignored = stats_.curl_code == CURLE_RANGE_ERROR && file->resume_from > 0;
+  // Resuming a download which was complete already.
+  if (error.code == kRemoteError && stats_.response_code == 416 && file->resume_from > 0 &&
+      response_range_total_ == file->resume_from) {
+    return kOk;
+  }
+  return error;
 }
 
 Error EasyCurl::PostToURL(const string& url,
-                          const string& post_data,
+                          string_view post_data,
                           string* dst,
                           const vector<string>& headers) {
-  return DoRequest(url, &post_data, dst, headers);
+  assert(dst != nullptr);
+  PostBody body;
+  body.data = post_data;
+  return DoRequest(url, &body, dst, nullptr, headers);
 }
 
-Error EasyCurl::DoRequest(const string& url,
-                          const string* post_data,
+Error EasyCurl::PostToURL(const string& url,
+                          string_view post_data,
+                          const WriteSink& sink,
+                          const vector<string>& headers) {
+  PostBody body;
+  body.data = post_data;
+  return DoRequest(url, &body, nullptr, &sink, headers);
+}
+
+Error EasyCurl::PostToURL(const string& url,
+                          const ReadSource& source,
+                          int64_t post_size,
                           string* dst,
                           const vector<string>& headers) {
   assert(dst != nullptr);
-  dst->clear();
+  PostBody body;
+  body.source = &source;
+  body.source_size = post_size;
+  return DoRequest(url, &body, dst, nullptr, headers);
+}
+
+Error EasyCurl::Unpause() {
+  static_assert(kPauseTransfer == CURL_WRITEFUNC_PAUSE, "kPauseTransfer mismatch");
+  static_assert(kPauseTransfer == CURL_READFUNC_PAUSE, "kPauseTransfer mismatch");
+  static_assert(kAbortUpload == CURL_READFUNC_ABORT, "kAbortUpload mismatch");
+  errbuf_[0] = 0;
+  CURL_RETURN_NOT_OK(curl_easy_pause(curl_, CURLPAUSE_CONT));
+  return kOk;
+}
+
+Error EasyCurl::FetchURL(const RequestTemplate& tmpl,
+                         const string& path,
+                         string* dst) {
+  assert(dst != nullptr);
+  return DoTemplateRequest(tmpl, path, nullptr, dst, nullptr);
+}
+
+Error EasyCurl::FetchURL(const RequestTemplate& tmpl,
+                         const string& path,
+                         const WriteSink& sink) {
+  return DoTemplateRequest(tmpl, path, nullptr, nullptr, &sink);
+}
+
+Error EasyCurl::PostToURL(const RequestTemplate& tmpl,
+                          const string& path,
+                          string_view post_data,
+                          string* dst) {
+  assert(dst != nullptr);
+  PostBody body;
+  body.data = post_data;
+  return DoTemplateRequest(tmpl, path, &body, dst, nullptr);
+}
+
+Error EasyCurl::DoTemplateRequest(const RequestTemplate& tmpl,
+                                  const string& path,
+                                  const PostBody* post_data,
+                                  string* dst,
+                                  const WriteSink* sink) {
+  // Assemble the URL in a buffer owned by this instance so that its
+  // capacity is reused from one request to the next.
+  url_buf_.assign(tmpl.url_base_);
+  url_buf_.append(path);
+  RETURN_NOT_OK(PrepareRequest(url_buf_, post_data, dst, sink, {}, &tmpl));
+  return FinishRequest(curl_easy_perform(curl_));
+}
+
+Error EasyCurl::Perform(const Request& request, Response* response) {
+  assert(response != nullptr);
+  PostBody body;
+  body.data = request.post_data_;
+  bool capture_headers = capture_headers_;
+  capture_headers_ = true;
+  auto error = PrepareRequest(request.url_, request.post_ ? &body : nullptr, &response->body_,
+                              nullptr, {}, nullptr, &request);
+  if (error.code == kOk) {
+    error = FinishRequest(curl_easy_perform(curl_));
+    response->stats_ = stats_;
+  } else {
+    // Nothing of the request made it to the response.
+    response->body_.clear();
+    response_headers_.Clear();
+    response->stats_ = TransferStats();
+  }
+  capture_headers_ = capture_headers;
+  // The buffers of the previous headers of 'response' take the next ones.
+  std::swap(response->headers_, response_headers_);
+  response_headers_.Clear();
+  return error;
+}
+
+Error EasyCurl::DoRequest(const string& url,
+                          const PostBody* post_data,
+                          string* dst,
+                          const WriteSink* sink,
+                          const vector<string>& headers) {
+  RETURN_NOT_OK(PrepareRequest(url, post_data, dst, sink, headers));
+  return FinishRequest(curl_easy_perform(curl_));
+}
+
+Error EasyCurl::PrepareRequest(const string& url,
+                               const PostBody* post_data,
+                               string* dst,
+                               const WriteSink* sink,
+                               const vector<string>& headers,
+                               const RequestTemplate* tmpl,
+                               const Request* request) {
+  assert((dst != nullptr) != (sink != nullptr));
+  if (cancellation_token_ != nullptr && cancellation_token_->cancelled()) {
+    return Error(kAborted, "request cancelled");
+  }
+  // Transfers of an EasyCurlMulti got through the limiter in its queue.
+  if (limiter_ != nullptr && acquired_limiter_ == nullptr) {
+    RETURN_NOT_OK(WaitForLimiter(url));
+  }
+  // Leave nothing of the request behind unless it is ready to start, e.g.
+  // its place in the limiter, or pointers to its destination.
+  auto abandon_request = MakeScopedCleanup([&]() {
+    AbandonRequest();
+  });
+  int64_t deadline_ms = -1;
+  if (deadline_ != std::chrono::steady_clock::time_point::max()) {
+    // Rounded up, so the request doesn't time out before the deadline.
+    deadline_ms = std::chrono::ceil<std::chrono::milliseconds>(
+        deadline_ - std::chrono::steady_clock::now()).count();
+    if (deadline_ms <= 0) {
+      return Error(kTimedOut, "deadline exceeded");
+    }
+  }
+  dst_ = dst;
+  sink_ = sink;
+  if (dst) {
+    dst->clear();
+  }
+  stats_.bytes_decoded = 0;
+  response_headers_.Clear();
+  response_range_start_ = -1;
+  response_range_total_ = -1;
   // Mark the error buffer as cleared.
   errbuf_[0] = 0;
 
-  switch (auth_type_) {
+  // Options which stay the same from one request to the next are only
+  // (re)applied to the handle when they change.
+  if (options_dirty_) {
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_VERBOSE, verbose_ ? 1L : 0L));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_FAILONERROR, fail_on_http_error_ ? 1L : 0L));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_HEADER, return_headers_ ? 1L : 0L));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_HTTP_VERSION,
+                                        TranslateHttpVersion(http_version_)));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_PIPEWAIT, wait_for_multiplexing_ ? 1L : 0L));
+    // An empty string asks for all the encodings libcurl supports, nullptr
+    // leaves the response alone.
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_ACCEPT_ENCODING, accept_encoding_ ? accept_encodings_.c_str() : nullptr));
+
+    // Timeouts are implemented with signals unless NOSIGNAL is set, which is
+    // not safe in multi-threaded programs.
+    if (timeout_ms_ > 0 || connect_timeout_ms_ > 0) {
+      CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_NOSIGNAL, 1));
+    }
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_TIMEOUT_MS, static_cast<long>(std::max<int64_t>(timeout_ms_, 0)))); // NOLINT(*)
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_CONNECTTIMEOUT_MS,
+        static_cast<long>(std::max<int64_t>(connect_timeout_ms_, 0)))); // NOLINT(*)
+    bool low_speed = low_speed_bytes_per_sec_ > 0 && low_speed_secs_ > 0;
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_LOW_SPEED_LIMIT,
+        low_speed ? static_cast<long>(low_speed_bytes_per_sec_) : 0L)); // NOLINT(*)
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_LOW_SPEED_TIME, low_speed ? static_cast<long>(low_speed_secs_) : 0L)); // NOLINT(*)
+
+    // The progress callback costs a call every few milliseconds of a
+    // transfer, so it is only installed if needed.
+    if (cancellation_token_ != nullptr) {
+      CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_XFERINFOFUNCTION, CancellationCallback));
+      CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_XFERINFODATA, cancellation_token_));
+    }
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_NOPROGRESS, cancellation_token_ != nullptr ? 0L : 1L));
+
+    RETURN_NOT_OK(ApplyTlsOptions());
+
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_TCP_KEEPALIVE, tcp_keepalive_ ? 1L : 0L));
+    if (tcp_keepalive_) {
+      CURL_RETURN_NOT_OK(curl_easy_setopt(
+          curl_, CURLOPT_TCP_KEEPIDLE, static_cast<long>(tcp_keepidle_secs_))); // NOLINT(*)
+      CURL_RETURN_NOT_OK(curl_easy_setopt(
+          curl_, CURLOPT_TCP_KEEPINTVL, static_cast<long>(tcp_keepintvl_secs_))); // NOLINT(*)
+    }
+
+    // Set even when back to the defaults, in case they were changed before.
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_MAXAGE_CONN,
+        max_connection_idle_secs_ >= 0 ? static_cast<long>(max_connection_idle_secs_) : 118L)); // NOLINT(*)
+#if LIBCURL_VERSION_NUM >= 0x075000
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_MAXLIFETIME_CONN,
+        max_connection_age_secs_ >= 0 ? static_cast<long>(max_connection_age_secs_) : 0L)); // NOLINT(*)
+#else
+    if (max_connection_age_secs_ >= 0) {
+      return Error(kNotSupported, "connection age limit requires libcurl 7.80.0 or later");
+    }
+#endif
+
+    // Addresses curl resolves on its own are kept as long as those of the
+    // DNS cache, if any, or for the libcurl default of 60 seconds.
+    long dns_cache_timeout_secs = 60; // NOLINT(*) curl wants a long
+    if (dns_cache_ != nullptr) {
+      dns_cache_timeout_secs = static_cast<long>( // NOLINT(*)
+          std::max<int64_t>(1, dns_cache_->options_.ttl_ms / 1000));
+    }
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_DNS_CACHE_TIMEOUT, dns_cache_timeout_secs));
+
+    // Only touch CURLOPT_DNS_SERVERS when it is or was in use: it is not
+    // available unless libcurl is built with c-ares.
+    if (!dns_servers_.empty() || dns_servers_set_) {
+      CURL_RETURN_NOT_OK(curl_easy_setopt(
+          curl_, CURLOPT_DNS_SERVERS, dns_servers_.empty() ? nullptr : dns_servers_.c_str()));
+      dns_servers_set_ = !dns_servers_.empty();
+    }
+  }
+
+  // A template may carry its own credentials, which take precedence over the
+  // ones of this instance.
+  uint64_t auth_source = (tmpl && tmpl->has_auth_) ? tmpl->id_ : 0;
+  if (options_dirty_ || auth_source != applied_auth_source_) {
+    if (auth_source != 0) {
+      RETURN_NOT_OK(ApplyAuth(tmpl->auth_type_, tmpl->username_, tmpl->password_));
+    } else {
+      RETURN_NOT_OK(ApplyAuth(auth_type_, username_, password_));
+    }
+    applied_auth_source_ = auth_source;
+  }
+  options_dirty_ = false;
+
+  // The time left until the deadline changes from one request to the next.
+  if (deadline_ms >= 0 || deadline_applied_) {
+    int64_t timeout_ms = std::max<int64_t>(timeout_ms_, 0);
+    if (deadline_ms >= 0) {
+      timeout_ms = timeout_ms > 0 ? std::min(timeout_ms, deadline_ms) : deadline_ms;
+      CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_NOSIGNAL, 1));
+    }
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_TIMEOUT_MS, static_cast<long>(timeout_ms))); // NOLINT(*)
+    deadline_applied_ = deadline_ms >= 0;
+  }
+
+  // Add headers if specified. The list must outlive the transfer, so it is
+  // released by FinishRequest() rather than at the end of this scope.
+  // curl only ever reads the list, so rather than having curl_slist_append()
+  // allocate two chunks per header, the nodes are laid out in the arena of
+  // the request.
+  if (resolve_set_) {
+    // Left over from an earlier request which failed to start.
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_RESOLVE, nullptr));
+    resolve_set_ = false;
+  }
+  request_arena_.Reset();
+  if (tmpl) {
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, tmpl->headers_));
+  } else if (request) {
+    // The lines are NUL-terminated in the buffer of the request already.
+    struct curl_slist* request_headers = nullptr;
+    struct curl_slist** tail = &request_headers;
+    const char* line = request->headers_.data();
+    for (size_t i = 0; i < request->num_headers_; i++) {
+      auto* node = request_arena_.New<curl_slist>();
+      node->data = const_cast<char*>(line);
+      node->next = nullptr;
+      *tail = node;
+      tail = &node->next;
+      line += strlen(line) + 1;
+    }
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, request_headers));
+  } else {
+    struct curl_slist* request_headers = nullptr;
+    struct curl_slist** tail = &request_headers;
+    for (const auto& header : headers) {
+      auto* node = request_arena_.New<curl_slist>();
+      node->data = request_arena_.AddString(header);
+      node->next = nullptr;
+      *tail = node;
+      tail = &node->next;
+    }
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, request_headers));
+  }
+
+  if (dns_cache_ != nullptr) {
+    RETURN_NOT_OK(ApplyDnsCache(url));
+  }
+
+  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_URL, url.c_str()));
+  CURL_RETURN_NOT_OK(curl_easy_setopt(
+      curl_, CURLOPT_WRITEFUNCTION, dst ? WriteCallback : SinkWriteCallback));
+  if (post_data && post_data->source) {
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_POST, 1L));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, nullptr));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_READFUNCTION, ReadCallback));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_READDATA,
+        const_cast<void*>(static_cast<const void*>(post_data->source))));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(post_data->source_size)));
+  } else if (post_data) {
+    // Pass the size explicitly: otherwise curl calls strlen() on the data,
+    // which is wasted work on large bodies and truncates binary ones.
+    // POSTFIELDS must not be NULL, or curl would use the read callback.
+    const char* data = post_data->data.data() ? post_data->data.data() : "";
+    CURL_RETURN_NOT_OK(curl_easy_setopt(
+        curl_, CURLOPT_POSTFIELDSIZE_LARGE, static_cast<curl_off_t>(post_data->data.size())));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_POSTFIELDS, data));
+  } else {
+    // The handle may be reused after a POST, so explicitly switch back to GET.
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_HTTPGET, 1));
+  }
+  abandon_request.cancel();
+  return kOk;
+}
+
+Error EasyCurl::WaitForLimiter(const string& url) {
+  HostKey(url, &host_key_);
+  LimiterHost* host = FindLimiterHost(host_key_);
+  std::chrono::steady_clock::time_point start;
+  bool waited = false;
+  while (true) {
+    uint64_t num_releases = limiter_->num_releases();
+    int64_t wait_us = limiter_->TryAcquire(host);
+    if (wait_us == 0) {
+      break;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (!waited) {
+      start = now;
+      waited = true;
+    }
+    // Look at the token and the deadline at least every 100ms.
+    int64_t max_wait_us = 100000;
+    if (deadline_ != std::chrono::steady_clock::time_point::max()) {
+      int64_t left_us =
+          std::chrono::duration_cast<std::chrono::microseconds>(deadline_ - now).count();
+      if (left_us <= 0) {
+        return Error(kTimedOut, "deadline exceeded waiting for the limiter");
+      }
+      max_wait_us = std::min(max_wait_us, left_us);
+    }
+    if (wait_us == EasyCurlLimiter::kWaitForRelease) {
+      limiter_->WaitForRelease(num_releases, max_wait_us);
+    } else {
+      std::this_thread::sleep_for(std::chrono::microseconds(std::min(wait_us, max_wait_us)));
+    }
+    if (cancellation_token_ != nullptr && cancellation_token_->cancelled()) {
+      return Error(kAborted, "request cancelled");
+    }
+  }
+  acquired_limiter_ = limiter_;
+  if (waited) {
+    queue_us_ = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  }
+  return kOk;
+}
+
+void EasyCurl::ReleaseLimiter(const Error& error, int response_code) {
+  if (acquired_limiter_ != nullptr) {
+    acquired_limiter_->Release(limiter_host_, error, response_code);
+    acquired_limiter_ = nullptr;
+  }
+}
+
+int EasyCurl::current_response_code() const {
+  long response_code = 0; // NOLINT(*) curl wants a long
+  curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &response_code);
+  return static_cast<int>(response_code);
+}
+
+LimiterHost* EasyCurl::FindLimiterHost(string_view host) {
+  if (limiter_host_ == nullptr || limiter_host_name_ != host) {
+    limiter_host_name_.assign(host.data(), host.size());
+    limiter_host_ = limiter_->FindHost(limiter_host_name_);
+  }
+  return limiter_host_;
+}
+
+Error EasyCurl::ApplyDnsCache(const string& url) {
+  // Only HTTP(S) hosts by name need a lookup.
+  string_view host;
+  int port;
+  if (!ParseHost(url, &host, &port) || port == 0 ||
+      host.find_first_not_of("0123456789.") == string_view::npos ||
+      host.find(':') != string_view::npos) {
+    return kOk;
+  }
+  EasyCurlDnsCache::MakeKey(host, port, &dns_key_);
+  auto it = applied_dns_versions_.find(dns_key_);
+  uint64_t applied_version = it == applied_dns_versions_.end() ? 0 : it->second;
+  uint64_t version = 0;
+  const char* entry = nullptr;
+  if (dns_cache_->Lookup(dns_key_, applied_version, &version, &dns_resolve_)) {
+    if (version == applied_version) {
+      return kOk;
+    }
+    // Replaces whatever curl has for the host, and stays until replaced or
+    // removed: curl never expires these entries on its own.
+    entry = request_arena_.AddString(dns_resolve_);
+    if (it == applied_dns_versions_.end()) {
+      it = applied_dns_versions_.emplace(dns_key_, version).first;
+    } else {
+      it->second = version;
+    }
+  } else {
+    if (applied_version == 0) {
+      return kOk;
+    }
+    // The addresses handed to curl earlier expired: have it resolve the
+    // host again.
+    dns_resolve_.assign("-").append(dns_key_);
+    entry = request_arena_.AddString(dns_resolve_);
+    applied_dns_versions_.erase(it);
+  }
+
+  // Like the headers, the list must outlive the transfer.
+  auto* node = request_arena_.New<curl_slist>();
+  node->data = const_cast<char*>(entry);
+  node->next = nullptr;
+  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_RESOLVE, node));
+  resolve_set_ = true;
+  return kOk;
+}
+
+Error EasyCurl::ApplyTlsOptions() {
+  const TlsOptions& tls = tls_options_;
+  if (tls.ca_bundle) {
+#if LIBCURL_VERSION_NUM >= 0x074D00
+    // The bundle is kept alive by 'tls_options_', so curl need not copy it.
+    struct curl_blob blob;
+    blob.data = const_cast<char*>(tls.ca_bundle->data());
+    blob.len = tls.ca_bundle->size();
+    blob.flags = CURL_BLOB_NOCOPY;
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_CAINFO_BLOB, &blob));
+#else
+    return Error(kNotSupported, "in-memory CA bundle requires libcurl 7.77.0 or later");
+#endif
+  } else {
+#if LIBCURL_VERSION_NUM >= 0x074D00
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_CAINFO_BLOB, nullptr));
+#endif
+    if (!tls.ca_bundle_path.empty()) {
+      CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_CAINFO, tls.ca_bundle_path.c_str()));
+    } else {
+      // Back to the bundle libcurl was built with, in case another one was
+      // set before: nullptr would mean none at all.
+      const char* default_ca_bundle = nullptr;
+#if LIBCURL_VERSION_NUM >= 0x074600
+      default_ca_bundle = curl_version_info(CURLVERSION_NOW)->cainfo;
+#endif
+      CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_CAINFO, default_ca_bundle));
+    }
+  }
+
+#if LIBCURL_VERSION_NUM >= 0x075700
+  // The libcurl default is 24 hours.
+  CURL_RETURN_NOT_OK(curl_easy_setopt(
+      curl_, CURLOPT_CA_CACHE_TIMEOUT,
+      static_cast<long>(tls.ca_cache_timeout_secs >= 0 // NOLINT(*)
+                        ? tls.ca_cache_timeout_secs : 24 * 60 * 60)));
+#else
+  if (tls.ca_cache_timeout_secs >= 0) {
+    return Error(kNotSupported, "CA cache timeout requires libcurl 7.87.0 or later");
+  }
+#endif
+
+  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_SSL_VERIFYPEER, tls.verify_peer ? 1L : 0L));
+  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_SSL_VERIFYHOST, tls.verify_peer ? 2L : 0L));
+  CURL_RETURN_NOT_OK(curl_easy_setopt(
+      curl_, CURLOPT_SSL_SESSIONID_CACHE, tls.session_cache ? 1L : 0L));
+  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_SSL_ENABLE_ALPN, tls.alpn ? 1L : 0L));
+
+  long ssl_options = 0; // NOLINT(*) curl wants a long
+  if (tls.early_data) {
+#ifdef CURLSSLOPT_EARLYDATA
+    ssl_options |= CURLSSLOPT_EARLYDATA;
+#else
+    return Error(kNotSupported, "TLS early data requires libcurl 8.11.0 or later");
+#endif
+  }
+  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_SSL_OPTIONS, ssl_options));
+  return kOk;
+}
+
+Error EasyCurl::ApplyAuth(CurlAuthType auth_type,
+                          const string& username,
+                          const string& password) {
+  switch (auth_type) {
     case CurlAuthType::BASIC:
       CURL_RETURN_NOT_OK(curl_easy_setopt(
           curl_, CURLOPT_HTTPAUTH, CURLAUTH_BASIC));
@@ -129,58 +1167,166 @@ Error EasyCurl::DoRequest(const string& url,
       break;
   }
 
-  if (auth_type_ != CurlAuthType::NONE) {
-    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_USERNAME, username_.c_str()));
-    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_PASSWORD, password_.c_str()));
+  if (auth_type != CurlAuthType::NONE) {
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_USERNAME, username.c_str()));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_PASSWORD, password.c_str()));
+  } else {
+    // Drop credentials left over from an earlier request on this handle.
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_USERNAME, nullptr));
+    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_PASSWORD, nullptr));
   }
+  return kOk;
+}
 
-  if (verbose_) {
-    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_VERBOSE, 1));
+size_t EasyCurl::WriteCallback(char* buffer, size_t size, size_t nmemb, void* user_ptr) {
+  size_t real_size = size * nmemb;
+  auto* ec = reinterpret_cast<EasyCurl*>(user_ptr);
+  ec->dst_->append(buffer, real_size);
+  ec->stats_.bytes_decoded += static_cast<int64_t>(real_size);
+  return real_size;
+}
+
+size_t EasyCurl::SinkWriteCallback(char* buffer, size_t size, size_t nmemb, void* user_ptr) {
+  size_t real_size = size * nmemb;
+  auto* ec = reinterpret_cast<EasyCurl*>(user_ptr);
+  size_t consumed = (*ec->sink_)(buffer, real_size);
+  // A paused sink is handed the same data again once unpaused.
+  if (consumed == real_size) {
+    ec->stats_.bytes_decoded += static_cast<int64_t>(real_size);
   }
-  if (fail_on_http_error_) {
-    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_FAILONERROR, 1));
+  return consumed;
+}
+
+size_t EasyCurl::HeaderCallback(char* buffer, size_t size, size_t nmemb, void* user_ptr) {
+  size_t real_size = size * nmemb;
+  auto* ec = reinterpret_cast<EasyCurl*>(user_ptr);
+
+  if (ec->capture_headers_) {
+    if (real_size >= 5 && memcmp(buffer, "HTTP/", 5) == 0) {
+      // The start of another response: keep the final one only.
+      ec->response_headers_.Clear();
+    }
+    ec->response_headers_.Append(buffer, real_size);
   }
 
-  // Add headers if specified.
-  struct curl_slist* curl_headers = nullptr;
-  auto clean_up_curl_slist = MakeScopedCleanup([&]() {
-    curl_slist_free_all(curl_headers);
-  });
+  // Which part of the object a range response holds. A download to a file
+  // resumed past the end of the file is also refused with
+  // "Content-Range: bytes */<size>", telling whether it was complete.
+  static const char kContentRange[] = "content-range:";
+  static const size_t kContentRangeLen = sizeof(kContentRange) - 1;
+  if (real_size >= 5 && memcmp(buffer, "HTTP/", 5) == 0) {
+    // The start of another response, e.g. after a redirect.
+    ec->response_range_start_ = -1;
+    ec->response_range_total_ = -1;
+  } else if (real_size > kContentRangeLen &&
+             strncasecmp(buffer, kContentRange, kContentRangeLen) == 0) {
+    ParseContentRange(string(buffer + kContentRangeLen, real_size - kContentRangeLen),
+                      &ec->response_range_start_, &ec->response_range_total_);
+  }
 
-  for (const auto& header : headers) {
-    curl_headers = curl_slist_append(curl_headers, header.c_str());
+  // Once the blank line ending the headers of a response shows up, curl has
+  // parsed any Content-Length, so capacity for the body can be reserved
+  // before its first byte arrives.
+  bool end_of_headers = (real_size == 2 && buffer[0] == '\r' && buffer[1] == '\n') ||
+      (real_size == 1 && buffer[0] == '\n');
+  if (end_of_headers && ec->dst_ != nullptr && ec->max_preallocate_bytes_ > 0) {
+    curl_off_t content_length;
+    if (curl_easy_getinfo(ec->curl_, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T,
+                          &content_length) == CURLE_OK &&
+        content_length > 0 &&
+        static_cast<uint64_t>(content_length) <= ec->max_preallocate_bytes_) {
+      ec->dst_->reserve(ec->dst_->size() + static_cast<size_t>(content_length));
+    }
   }
-  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, curl_headers));
+  return real_size;
+}
 
-  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_URL, url.c_str()));
-  if (return_headers_) {
-    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_HEADER, 1));
+void EasyCurl::CollectTransferStats() {
+  // This runs for failed transfers too, so the stats are best-effort: any
+  // piece of information curl can't provide is left at 0.
+  auto get_time = [&](CURLINFO info) -> int64_t {
+    curl_off_t us = 0;
+    return curl_easy_getinfo(curl_, info, &us) == CURLE_OK ? us : 0;
+  };
+  auto get_size = [&](CURLINFO info) -> int64_t {
+    curl_off_t bytes = 0;
+    return curl_easy_getinfo(curl_, info, &bytes) == CURLE_OK ? bytes : 0;
+  };
+  auto get_long = [&](CURLINFO info) -> long { // NOLINT(*) curl wants a long
+    long val = 0; // NOLINT(*)
+    return curl_easy_getinfo(curl_, info, &val) == CURLE_OK ? val : 0;
+  };
+
+  // curl reports the time from the start of the transfer until the end of
+  // each phase; turn those into durations.
+  int64_t namelookup = get_time(CURLINFO_NAMELOOKUP_TIME_T);
+  int64_t connect = get_time(CURLINFO_CONNECT_TIME_T);
+  int64_t appconnect = get_time(CURLINFO_APPCONNECT_TIME_T);
+  stats_.dns_us = namelookup;
+  stats_.connect_us = connect > namelookup ? connect - namelookup : 0;
+  stats_.tls_us = appconnect > connect ? appconnect - connect : 0;
+  stats_.ttfb_us = get_time(CURLINFO_STARTTRANSFER_TIME_T);
+  stats_.total_us = get_time(CURLINFO_TOTAL_TIME_T);
+  stats_.queue_us = queue_us_;
+
+  stats_.bytes_uploaded = get_size(CURLINFO_SIZE_UPLOAD_T);
+  stats_.bytes_downloaded = get_size(CURLINFO_SIZE_DOWNLOAD_T);
+
+  stats_.response_code = static_cast<int>(get_long(CURLINFO_RESPONSE_CODE));
+  curl_off_t content_length = -1;
+  if (curl_easy_getinfo(curl_, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length) != CURLE_OK) {
+    content_length = -1;
   }
-  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, WriteCallback));
-  CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_WRITEDATA, static_cast<void *>(dst)));
-  if (post_data) {
-    CURL_RETURN_NOT_OK(curl_easy_setopt(
-        curl_, CURLOPT_POSTFIELDS, post_data->c_str()));
+  stats_.content_length = content_length;
+  stats_.num_connects = static_cast<int>(get_long(CURLINFO_NUM_CONNECTS));
+
+  const char* effective_url = nullptr;
+  if (curl_easy_getinfo(curl_, CURLINFO_EFFECTIVE_URL, &effective_url) == CURLE_OK &&
+      effective_url != nullptr) {
+    stats_.effective_url.assign(effective_url);
+  } else {
+    stats_.effective_url.clear();
   }
+}
 
-  if (timeout_secs_ > 0) {
-    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_NOSIGNAL, 1));
-    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_TIMEOUT, timeout_secs_));
+void EasyCurl::AbandonRequest() {
+  ReleaseLimiter(Error(kAborted), 0);
+  ResetRequest();
+}
+
+void EasyCurl::ResetRequest() {
+  if (resolve_set_) {
+    // The list is about to go away; curl already loaded it.
+    curl_easy_setopt(curl_, CURLOPT_RESOLVE, nullptr);
+    resolve_set_ = false;
   }
+  request_arena_.Reset();
+  queue_us_ = 0;
+  dst_ = nullptr;
+  sink_ = nullptr;
+}
 
-  if (!dns_servers_.empty()) {
-    CURL_RETURN_NOT_OK(curl_easy_setopt(curl_, CURLOPT_DNS_SERVERS, dns_servers_.c_str()));
+Error EasyCurl::FinishRequest(int curl_code) {
+  auto clean_up_request = MakeScopedCleanup([&]() {
+    ResetRequest();
+  });
+
+  CollectTransferStats();
+  stats_.curl_code = curl_code;
+  auto error = CheckTransferResult(curl_code);
+  ReleaseLimiter(error, stats_.response_code);
+  if (metrics_ != nullptr) {
+    metrics_->Record(stats_, error);
   }
+  return error;
+}
 
-  CURL_RETURN_NOT_OK(curl_easy_perform(curl_));
-  long val; // NOLINT(*) curl wants a long
-  CURL_RETURN_NOT_OK(curl_easy_getinfo(curl_, CURLINFO_NUM_CONNECTS, &val));
-  num_connects_ = static_cast<int>(val);
+Error EasyCurl::CheckTransferResult(int curl_code) {
+  CURL_RETURN_NOT_OK(static_cast<CURLcode>(curl_code));
 
-  CURL_RETURN_NOT_OK(curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &val));
+  long val = stats_.response_code; // NOLINT(*)
   if (val < 200 || val >= 300) {
-    return Error(kRemoteError, "HTTP " + val);
+    return Error(kRemoteError, "HTTP " + std::to_string(val));
   }
   return kOk;
 }
-
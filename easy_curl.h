@@ -18,19 +18,57 @@
 #ifndef EASY_CURL_LIBRARY_H
 #define EASY_CURL_LIBRARY_H
 
+#include <atomic>
+#include <chrono>
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <functional>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "easy_curl_arena.h"
+
 using namespace std;
 typedef void CURL;
+struct curl_slist;
+
+class EasyCurlDnsCache;
+class EasyCurlLimiter;
+class EasyCurlMetrics;
+class EasyCurlShare;
+struct LimiterHost;
 
 enum class CurlAuthType {
   NONE,
   BASIC
 };
 
+enum class CurlHttpVersion {
+  // Let libcurl pick (HTTP/1.1, or HTTP/2 over TLS if the server supports it
+  // in libcurl 7.62 and later).
+  DEFAULT,
+  HTTP_1_1,
+  // Attempt HTTP/2, falling back to HTTP/1.1.
+  HTTP_2,
+  // Attempt HTTP/2 over TLS only, using HTTP/1.1 for cleartext connections.
+  HTTP_2_TLS,
+  // Speak HTTP/2 right away, without HTTP/1.1 Upgrade, even for cleartext.
+  HTTP_2_PRIOR_KNOWLEDGE,
+};
+
+// Priority classes of the transfers queued by an EasyCurlMulti, see
+// EasyCurlMulti::set_max_transfers().
+enum class TransferPriority {
+  HIGH,
+  NORMAL,
+  LOW,
+};
+
 enum ErrorCode {
   kOk = 0,
   kNotFound = 1,
@@ -53,6 +91,216 @@ enum ErrorCode {
   kEndOfFile = 18,
 };
 
+// TLS settings of an EasyCurl instance. The defaults match libcurl's.
+struct TlsOptions {
+  // Path to a PEM file of CA certificates to verify peers with, instead of
+  // the system default bundle.
+  std::string ca_bundle_path;
+
+  // PEM-encoded CA certificates to verify peers with, taking precedence over
+  // 'ca_bundle_path'. The same bundle can be handed to many instances so it
+  // is only read and kept in memory once. Requires libcurl 7.77.0 or later.
+  std::shared_ptr<const std::string> ca_bundle;
+
+  // How long a parsed CA bundle is cached and reused by later connections of
+  // the same instance, in seconds. -1 keeps the libcurl default (one day),
+  // 0 disables the cache. Requires libcurl 7.87.0 or later.
+  int ca_cache_timeout_secs = -1;
+
+  // Whether to verify the certificate and the host name of the peer.
+  bool verify_peer = true;
+
+  // Whether to resume earlier TLS sessions, skipping the full handshake on
+  // reconnects. Attach an EasyCurlShare to resume them across instances.
+  bool session_cache = true;
+
+  // Whether to negotiate the application protocol with ALPN, which HTTP/2
+  // over TLS requires.
+  bool alpn = true;
+
+  // Whether to send TLS 1.3 early data (0-RTT) on resumed sessions. Early
+  // data can be replayed, so only enable this for idempotent requests.
+  // Requires libcurl 8.11.0 or later.
+  bool early_data = false;
+};
+
+// Options of EasyCurl::FetchToFile().
+struct FileFetchOptions {
+  // Continue an interrupted download: keep what the file holds already and
+  // only fetch the rest of it, with a range request. If the server doesn't
+  // support ranges, the whole file is fetched again.
+  bool resume = false;
+
+  // Reserve disk space for the rest of the file once the server announces
+  // its length, so the file is laid out contiguously and a full disk fails
+  // the download right away. The space is reserved beyond the end of the
+  // file, whose size only grows as data is written, so a failed download
+  // can still be resumed. Only on Linux, and file systems supporting it,
+  // for responses larger than 'buffer_size', which are written out at once.
+  bool preallocate = true;
+
+  // Size of the buffer the response is gathered in before it is written
+  // out, rounded up to a multiple of 4KB. Bounds the memory a download
+  // takes, whatever the size of the file.
+  size_t buffer_size = 1024 * 1024;
+
+  // Whether to flush the file to disk with fdatasync() before returning.
+  bool sync = false;
+};
+
+// Details about a completed (or failed) transfer.
+struct TransferStats {
+  // Time spent in each phase of the transfer, in microseconds. Phases which
+  // didn't happen, e.g. because a connection was reused, take 0.
+  //
+  // Resolving the host name.
+  int64_t dns_us = 0;
+  // Establishing the TCP connection, once the name was resolved.
+  int64_t connect_us = 0;
+  // The TLS handshake, once connected.
+  int64_t tls_us = 0;
+  // From the start of the transfer until the first byte of the response was
+  // received, i.e. including all the phases above.
+  int64_t ttfb_us = 0;
+  // The whole transfer.
+  int64_t total_us = 0;
+  // Time the transfer waited in the queue of an EasyCurlMulti, or for its
+  // EasyCurlLimiter, before it started, not included in the above. See
+  // EasyCurlMulti::set_max_transfers().
+  int64_t queue_us = 0;
+
+  // Body bytes sent and received. Received bytes are counted as they came
+  // off the wire, i.e. still compressed if the response was.
+  int64_t bytes_uploaded = 0;
+  int64_t bytes_downloaded = 0;
+
+  // Body bytes handed to the destination buffer or sink, after decoding any
+  // Content-Encoding (see EasyCurl::set_accept_encoding()). Same as
+  // 'bytes_downloaded' for responses which weren't compressed.
+  int64_t bytes_decoded = 0;
+
+  // The HTTP response code, or 0 if no response was received.
+  int response_code = 0;
+
+  // The length of the response body announced by the server, or -1 if it
+  // didn't announce one. For HEAD requests, that of the resource.
+  int64_t content_length = -1;
+
+  // The number of new connections created for the transfer.
+  int num_connects = 0;
+
+  // The CURLcode the transfer completed with, CURLE_OK (0) if it succeeded
+  // at the protocol level. Tells apart failures which the ErrorCode of the
+  // returned Error lumps together, e.g. to decide whether to retry.
+  int curl_code = 0;
+
+  // The last URL used, which differs from the requested one if redirects
+  // were followed.
+  std::string effective_url;
+};
+
+// The headers of a response, as received, parsed only when first looked
+// into. Names and values are views into the raw bytes, valid until the
+// headers are replaced by those of the next request.
+//
+// Example:
+//   curl.set_capture_headers(true);
+//   auto e = curl.FetchURL(url, &body);
+//   std::string_view etag;
+//   if (curl.response_headers().Get("ETag", &etag)) { ... }
+//
+// This is not thread-safe, not even for concurrent lookups.
+class ResponseHeaders {
+ public:
+  struct Header {
+    std::string_view name;
+    // Without surrounding whitespace.
+    std::string_view value;
+  };
+
+  // The header lines of the response as curl handed them over, including
+  // the status line and line endings. Only the headers of the final
+  // response are kept, e.g. those after a redirect or "100 Continue", along
+  // with any trailers.
+  std::string_view raw() const {
+    return raw_;
+  }
+
+  // The status line, e.g. "HTTP/1.1 200 OK", without line ending.
+  std::string_view status_line() const;
+
+  // Returns whether there is a header called 'name', ignoring case, and if
+  // so sets 'value' to the value of the first one.
+  bool Get(std::string_view name, std::string_view* value) const;
+
+  // Appends the values of all the headers called 'name' to 'values', e.g.
+  // for Set-Cookie, which can't be combined into one.
+  void GetAll(std::string_view name, std::vector<std::string_view>* values) const;
+
+  // All the headers in the order received.
+  const std::vector<Header>& headers() const;
+
+  bool empty() const {
+    return raw_.empty();
+  }
+
+  ResponseHeaders() = default;
+
+  // Moves leave the index to be rebuilt, as its views may point into the
+  // inline buffer of a short 'raw_'.
+  ResponseHeaders(ResponseHeaders&& that) noexcept
+      : raw_(std::move(that.raw_)),
+        headers_(std::move(that.headers_)) {
+    that.parsed_ = false;
+  }
+  ResponseHeaders& operator=(ResponseHeaders&& that) noexcept {
+    raw_ = std::move(that.raw_);
+    headers_ = std::move(that.headers_);
+    parsed_ = false;
+    that.parsed_ = false;
+    return *this;
+  }
+
+  ResponseHeaders(const ResponseHeaders& that) = delete;
+  ResponseHeaders& operator=(const ResponseHeaders& that) = delete;
+
+ private:
+  friend class EasyCurl;
+
+  void Clear() {
+    raw_.clear();
+    parsed_ = false;
+  }
+
+  void Append(const char* data, size_t len) {
+    raw_.append(data, len);
+    parsed_ = false;
+  }
+
+  // Index the headers in 'raw_', unless done already.
+  void Parse() const;
+
+  std::string raw_;
+
+  // The index of 'raw_'. Its capacity is kept from one response to the
+  // next.
+  mutable std::vector<Header> headers_;
+  mutable std::string_view status_line_;
+  mutable bool parsed_ = false;
+};
+
+// Memory allocation functions for libcurl to use instead of malloc() and
+// friends, e.g. to route its allocations to a pool or per-thread caching
+// allocator. See EasyCurl::set_global_allocator() and
+// 'man curl_global_init_mem'. All of them must be set, and be thread-safe.
+struct CurlAllocator {
+  void* (*malloc_fn)(size_t size) = nullptr;
+  void (*free_fn)(void* ptr) = nullptr;
+  void* (*realloc_fn)(void* ptr, size_t size) = nullptr;
+  char* (*strdup_fn)(const char* str) = nullptr;
+  void* (*calloc_fn)(size_t nmemb, size_t size) = nullptr;
+};
+
 struct Error {
   ErrorCode code;
   string msg;
@@ -60,41 +308,500 @@ struct Error {
   Error(ErrorCode code, string msg) : code(code), msg(std::move(msg)) {}
 };
 
+// The parts of a request which stay the same across many requests -- the
+// base URL, the headers and optionally the credentials -- prepared once so
+// they can be issued repeatedly through EasyCurl without rebuilding them.
+//
+// Example:
+//   RequestTemplate tmpl("http://localhost:40080/api/", {"Accept: application/json"});
+//   while (polling) {
+//     auto e = ec.FetchURL(tmpl, "status", &resp);
+//     ...
+//   }
+//
+// A template is immutable once created apart from set_auth(), and can be
+// used by many EasyCurl instances (and threads) at once.
+class RequestTemplate {
+ public:
+  explicit RequestTemplate(std::string url_base,
+                           const std::vector<std::string>& headers = {});
+  ~RequestTemplate();
+
+  RequestTemplate(const RequestTemplate& that) = delete;
+  RequestTemplate& operator=(const RequestTemplate& that) = delete;
+
+  // Use these credentials, instead of the ones of the EasyCurl instance
+  // issuing the request. Not safe to call while the template is in use.
+  void set_auth(CurlAuthType auth_type, std::string username = "", std::string password = "") {
+    has_auth_ = true;
+    auth_type_ = auth_type;
+    username_ = std::move(username);
+    password_ = std::move(password);
+  }
+
+  const std::string& url_base() const {
+    return url_base_;
+  }
+
+ private:
+  friend class EasyCurl;
+
+  // Unique across all templates of the process, so EasyCurl can tell whether
+  // the credentials of this template are already applied to its handle.
+  const uint64_t id_;
+
+  const std::string url_base_;
+
+  struct curl_slist* headers_ = nullptr;
+
+  bool has_auth_ = false;
+  CurlAuthType auth_type_ = CurlAuthType::NONE;
+  std::string username_;
+  std::string password_;
+};
+
+// A request assembled from views -- the URL for instance from a base, a path
+// and a query -- which are copied into buffers of its own. The buffers keep
+// their capacity across clear(), so a Request reused for request after
+// request stops allocating once they have grown to size. See
+// EasyCurl::Perform().
+//
+// Example:
+//   Request req;
+//   Response resp;
+//   for (const auto& id : ids) {
+//     req.clear();
+//     req.set_url(base).append_url(id).add_header("Accept", "application/json");
+//     auto e = curl.Perform(req, &resp);
+//     ...
+//   }
+class Request {
+ public:
+  Request() = default;
+  explicit Request(std::string_view url) {
+    set_url(url);
+  }
+
+  Request& set_url(std::string_view url) {
+    url_.assign(url.data(), url.size());
+    return *this;
+  }
+
+  // Append 'part' to the URL.
+  Request& append_url(std::string_view part) {
+    url_.append(part.data(), part.size());
+    return *this;
+  }
+
+  // Add a header line, e.g. "Accept: application/json".
+  Request& add_header(std::string_view header) {
+    headers_.append(header.data(), header.size()).push_back('\0');
+    num_headers_++;
+    return *this;
+  }
+
+  // Add the header "<name>: <value>".
+  Request& add_header(std::string_view name, std::string_view value) {
+    headers_.append(name.data(), name.size()).append(": ", 2);
+    headers_.append(value.data(), value.size()).push_back('\0');
+    num_headers_++;
+    return *this;
+  }
+
+  // Send 'data' as the body of a POST rather than doing a GET. As with
+  // EasyCurl::PostToURL(), the data is not copied, so must stay valid while
+  // the request is performed.
+  Request& set_post_data(std::string_view data) {
+    post_ = true;
+    post_data_ = data;
+    return *this;
+  }
+
+  // Forget the URL, the headers and the body, keeping the buffers.
+  void clear() {
+    url_.clear();
+    headers_.clear();
+    num_headers_ = 0;
+    post_ = false;
+    post_data_ = std::string_view();
+  }
+
+  const std::string& url() const {
+    return url_;
+  }
+
+  size_t num_headers() const {
+    return num_headers_;
+  }
+
+ private:
+  friend class EasyCurl;
+
+  std::string url_;
+  // The header lines back to back, each followed by a NUL byte, so curl can
+  // be pointed at them in place.
+  std::string headers_;
+  size_t num_headers_ = 0;
+  bool post_ = false;
+  std::string_view post_data_;
+};
+
+// The outcome of a request performed with EasyCurl::Perform(): status, body,
+// headers and transfer stats in one place. It is move-only, so a body is
+// never copied by accident. Reusing one Response for many requests reuses
+// its buffers.
+class Response {
+ public:
+  Response() = default;
+
+  Response(Response&& that) noexcept = default;
+  Response& operator=(Response&& that) noexcept = default;
+
+  Response(const Response& that) = delete;
+  Response& operator=(const Response& that) = delete;
+
+  // The HTTP response code, or 0 if no response was received.
+  int status() const {
+    return stats_.response_code;
+  }
+
+  const std::string& body() const {
+    return body_;
+  }
+
+  // The body, e.g. to move it out of the response.
+  std::string* mutable_body() {
+    return &body_;
+  }
+
+  const ResponseHeaders& headers() const {
+    return headers_;
+  }
+
+  const TransferStats& stats() const {
+    return stats_;
+  }
+
+ private:
+  friend class EasyCurl;
+
+  std::string body_;
+  ResponseHeaders headers_;
+  TransferStats stats_;
+};
+
+// Aborts the requests of the EasyCurl instances watching it, from any thread,
+// e.g. once the caller they were for has gone away, or a hedged request won.
+//
+// Example:
+//   CancellationToken token;
+//   curl.set_cancellation_token(&token);
+//   // On another thread, while curl.FetchURL() runs:
+//   token.Cancel();
+//
+// Requests watching a cancelled token fail with kAborted: those in flight
+// within about a second, sooner if data is flowing, and those started
+// afterwards right away.
+//
+// This class is thread-safe.
+class CancellationToken {
+ public:
+  CancellationToken() = default;
+
+  CancellationToken(const CancellationToken& that) = delete;
+  CancellationToken& operator=(const CancellationToken& that) = delete;
+
+  void Cancel() {
+    cancelled_.store(true, std::memory_order_relaxed);
+  }
+
+  bool cancelled() const {
+    return cancelled_.load(std::memory_order_relaxed);
+  }
+
+  // Make the token usable for new requests again.
+  void Reset() {
+    cancelled_.store(false, std::memory_order_relaxed);
+  }
+
+ private:
+  std::atomic<bool> cancelled_{false};
+};
+
 // Simple wrapper around curl's "easy" interface, allowing the user to
 // fetch web pages into memory using a blocking API.
 //
+// To drive many transfers concurrently from a single thread, see
+// EasyCurlMulti in easy_curl_multi.h.
+//
 // This is not thread-safe.
 class EasyCurl {
  public:
+  // Receives response data as it arrives, in chunks of arbitrary size.
+  // Returns the number of bytes consumed: anything other than 'len' aborts
+  // the transfer, except kPauseTransfer which pauses it (see Unpause()).
+  typedef std::function<size_t(const char* data, size_t len)> WriteSink;
+
+  // Supplies the body of a streaming upload: fills up to 'len' bytes of
+  // 'buf' and returns how many it wrote, or 0 once the body is complete.
+  // It may also return kAbortUpload to fail the transfer, or kPauseTransfer
+  // to pause it (see Unpause()).
+  typedef std::function<size_t(char* buf, size_t len)> ReadSource;
+
+  // Value a WriteSink or ReadSource returns to pause the transfer
+  // (CURL_WRITEFUNC_PAUSE / CURL_READFUNC_PAUSE).
+  static const constexpr size_t kPauseTransfer = 0x10000001;
+
+  // Value a ReadSource returns to abort the transfer (CURL_READFUNC_ABORT).
+  static const constexpr size_t kAbortUpload = 0x10000000;
+
   EasyCurl();
   ~EasyCurl();
 
   EasyCurl(const EasyCurl& that) = delete;
   EasyCurl& operator=(const EasyCurl& that) = delete;
 
+  // Have libcurl allocate memory through 'allocator' from now on. Must be
+  // called before the first EasyCurl, EasyCurlMulti or EasyCurlShare is
+  // created, as libcurl is initialized for the process by then; returns
+  // kIllegalState afterwards. Has no effect if the application initializes
+  // libcurl itself before that.
+  static Error set_global_allocator(const CurlAllocator& allocator);
+
+  // Sets 'host' and 'port' to those 'url' refers to, without any user info,
+  // or the brackets of an IPv6 address. Unless the URL has one, the port is
+  // that of the scheme for HTTP(S), taken by default like curl does, and 0
+  // for other schemes. Returns false if 'url' has no valid host and port.
+  static bool ParseHost(std::string_view url, std::string_view* host, int* port);
+
+  // Sets 'key' to the host of 'url' as "host:port", lowercased and with the
+  // port filled in as by ParseHost(), or to "" if it has none. This is what
+  // EasyCurlMulti, EasyCurlLimiter and EasyCurlMetrics tell hosts apart by.
+  static void HostKey(std::string_view url, std::string* key);
+
   // Fetch the given URL into the provided buffer.
-  // Any existing data in the buffer is replaced.
+  // Any existing data in the buffer is replaced. The capacity of the buffer
+  // is kept, so passing the same buffer to successive calls avoids
+  // reallocating it. If the server announces the length of the response,
+  // capacity for it is reserved before the body arrives (see
+  // set_max_preallocate_bytes()).
   // The optional param 'headers' holds additional headers.
-  // e.g. {"Accept-Encoding: gzip"}
+  // e.g. {"Accept: application/json"}
+  // To receive compressed responses, use set_accept_encoding() rather than
+  // an Accept-Encoding header, which would hand over the compressed bytes.
   Error FetchURL(const std::string& url,
                  string* dst,
                  const std::vector<std::string>& headers = {});
 
+  // Fetch the given URL, handing the response to 'sink' chunk by chunk as
+  // it arrives instead of buffering the whole body in memory.
+  Error FetchURL(const std::string& url,
+                 const WriteSink& sink,
+                 const std::vector<std::string>& headers = {});
+
+  // Fetch the given URL into the file at 'path', created if needed, writing
+  // the response out as it arrives rather than holding it in memory. Unless
+  // resuming, the file is truncated first. On failure, it holds whatever
+  // was received, so the download can be resumed. See FileFetchOptions.
+  Error FetchToFile(const std::string& url,
+                    const std::string& path,
+                    const FileFetchOptions& options = FileFetchOptions(),
+                    const std::vector<std::string>& headers = {});
+
+  // As above, writing to 'fd': after its current end if resuming, else
+  // after truncating it. If 'fd' is not a regular file, e.g. a pipe, the
+  // response is written to it as is, and resuming and preallocation don't
+  // apply. 'fd' is left open.
+  Error FetchToFile(const std::string& url,
+                    int fd,
+                    const FileFetchOptions& options = FileFetchOptions(),
+                    const std::vector<std::string>& headers = {});
+
+  // Perform 'request', setting 'response' to its outcome. As with
+  // FetchURL(), responses other than 2xx are reported as kRemoteError, with
+  // 'response' set all the same, e.g. to read the error page. The response
+  // headers are captured into 'response' whatever set_capture_headers()
+  // says, and response_headers() is left empty.
+  Error Perform(const Request& request, Response* response);
+
+  // Issue an HTTP HEAD request for the given URL, e.g. to learn the length
+  // of a resource (see TransferStats::content_length) without fetching it.
+  Error HeadURL(const std::string& url,
+                const std::vector<std::string>& headers = {});
+
   // Issue an HTTP POST to the given URL with the given data.
+  // The data is sent as-is with its explicit length, so it may be binary
+  // and contain NUL bytes; it is not copied.
   // Returns results in 'dst' as above.
   // The optional param 'headers' holds additional headers.
-  // e.g. {"Accept-Encoding: gzip"}
+  // e.g. {"Accept: application/json"}
+  Error PostToURL(const std::string& url,
+                  std::string_view post_data,
+                  string* dst,
+                  const std::vector<std::string>& headers = {});
+
+  // Issue an HTTP POST to the given URL with the given data.
+  // Hands the response to 'sink' as above.
+  Error PostToURL(const std::string& url,
+                  std::string_view post_data,
+                  const WriteSink& sink,
+                  const std::vector<std::string>& headers = {});
+
+  // Issue an HTTP POST to the given URL, streaming the body from 'source'
+  // as the transfer proceeds rather than holding it all in memory.
+  // 'post_size' is the size of the body in bytes, or -1 if unknown, in which
+  // case it is sent with chunked transfer encoding.
+  // Returns results in 'dst' as above.
   Error PostToURL(const std::string& url,
-                  const std::string& post_data,
+                  const ReadSource& source,
+                  int64_t post_size,
                   string* dst,
                   const std::vector<std::string>& headers = {});
 
+  // Fetch 'path' relative to the base URL of 'tmpl' into 'dst', using the
+  // headers and credentials of the template. 'path' is appended verbatim,
+  // e.g. "status?verbose=1".
+  Error FetchURL(const RequestTemplate& tmpl,
+                 const std::string& path,
+                 string* dst);
+
+  // As above, handing the response to 'sink' as it arrives.
+  Error FetchURL(const RequestTemplate& tmpl,
+                 const std::string& path,
+                 const WriteSink& sink);
+
+  // Issue an HTTP POST of 'post_data' to 'path' relative to the base URL of
+  // 'tmpl', using the headers and credentials of the template.
+  Error PostToURL(const RequestTemplate& tmpl,
+                  const std::string& path,
+                  std::string_view post_data,
+                  string* dst);
+
+  // Resume a transfer paused by its WriteSink returning kPauseTransfer.
+  // The sink may be invoked with pending data before this returns.
+  //
+  // A paused transfer only makes progress again once this is called, so
+  // pausing is only useful for transfers driven by EasyCurlMulti, where
+  // Unpause() can be called between calls to EasyCurlMulti::Poll().
+  Error Unpause();
+
+  // Prepend the headers of the response to the body handed to the
+  // destination buffer or sink. To look at the headers, prefer
+  // set_capture_headers(), which keeps the body as it is.
   void set_return_headers(bool v) {
     return_headers_ = v;
+    options_dirty_ = true;
+  }
+
+  // Keep the headers of each response, available from response_headers()
+  // once the request completed. Off by default, which saves copying them.
+  void set_capture_headers(bool v) {
+    capture_headers_ = v;
+  }
+
+  // Returns the headers of the previous response, if captured (see
+  // set_capture_headers()). Invalidated by the next request.
+  const ResponseHeaders& response_headers() const {
+    return response_headers_;
+  }
+
+  // Configure TLS for HTTPS requests. See TlsOptions.
+  void set_tls_options(TlsOptions options) {
+    tls_options_ = std::move(options);
+    options_dirty_ = true;
+  }
+
+  // Enable TCP keepalive probes on the connections of this instance, so idle
+  // connections kept for reuse are not silently dropped by middleboxes.
+  // 'idle_secs' is how long a connection is idle before the first probe,
+  // 'interval_secs' the time between probes.
+  void set_tcp_keepalive(bool enable, int idle_secs = 60, int interval_secs = 60) {
+    tcp_keepalive_ = enable;
+    tcp_keepidle_secs_ = idle_secs;
+    tcp_keepintvl_secs_ = interval_secs;
+    options_dirty_ = true;
+  }
+
+  // Limits on how long connections are kept for reuse: connections idle for
+  // longer than 'idle_secs', or opened more than 'age_secs' ago, are closed
+  // rather than reused. The libcurl defaults are 118 seconds idle and no age
+  // limit, also set by an age of 0; negative values restore them. Set the
+  // idle limit below the keep-alive timeout of the servers, which otherwise
+  // may close a connection just as a request goes out on it, and the age
+  // limit to spread load over servers added behind a load balancer. See
+  // 'man CURLOPT_MAXAGE_CONN' and 'man CURLOPT_MAXLIFETIME_CONN'.
+  void set_max_connection_idle_secs(int idle_secs) {
+    max_connection_idle_secs_ = idle_secs;
+    options_dirty_ = true;
+  }
+  void set_max_connection_age_secs(int age_secs) {
+    max_connection_age_secs_ = age_secs;
+    options_dirty_ = true;
+  }
+
+  // Select the HTTP version used for requests.
+  void set_http_version(CurlHttpVersion version) {
+    http_version_ = version;
+    options_dirty_ = true;
+  }
+
+  // Whether a transfer driven by EasyCurlMulti waits for a connection being
+  // set up to the same host to find out whether it supports multiplexing,
+  // rather than opening a new connection right away. Enabling this (along
+  // with HTTP/2) lets many concurrent requests share a few connections.
+  // See 'man CURLOPT_PIPEWAIT' for details.
+  void set_wait_for_multiplexing(bool v) {
+    wait_for_multiplexing_ = v;
+    options_dirty_ = true;
+  }
+
+  // Whether to ask for compressed responses and decompress them on the fly
+  // as they arrive, so the destination only ever sees the decoded body.
+  // 'encodings' is the Accept-Encoding to send, e.g. "gzip, zstd"; empty
+  // asks for every encoding libcurl was built with (among deflate, gzip, br
+  // and zstd). See TransferStats for the bytes saved on the wire.
+  void set_accept_encoding(bool enable, std::string encodings = "") {
+    accept_encoding_ = enable;
+    accept_encodings_ = std::move(encodings);
+    options_dirty_ = true;
+  }
+
+  // Upper bound on the capacity reserved in a destination buffer based on
+  // the Content-Length announced by the server, so a bogus length can't make
+  // us allocate arbitrary amounts of memory up front. Responses larger than
+  // this still work, the buffer just grows as data arrives. 0 disables
+  // preallocation.
+  void set_max_preallocate_bytes(size_t bytes) {
+    max_preallocate_bytes_ = bytes;
   }
 
+  // Maximum time the whole transfer may take, in seconds. A value <= 0
+  // means no limit, the default.
   void set_timeout(int secs) {
-    timeout_secs_ = secs;
+    set_timeout_ms(secs > 0 ? static_cast<int64_t>(secs) * 1000 : 0);
+  }
+
+  // As above, in milliseconds, for latency budgets below a second.
+  void set_timeout_ms(int64_t ms) {
+    timeout_ms_ = ms;
+    options_dirty_ = true;
+  }
+
+  // Maximum time to establish a connection, including name resolution and
+  // the TLS handshake, in milliseconds. A value <= 0 keeps the libcurl
+  // default of 300 seconds.
+  void set_connect_timeout_ms(int64_t ms) {
+    connect_timeout_ms_ = ms;
+    options_dirty_ = true;
+  }
+
+  // Abort the transfer if it is slower than 'bytes_per_sec' for 'secs'
+  // seconds in a row. Catches stalled transfers long before an overall
+  // timeout would. A value <= 0 for either disables the check, the default.
+  void set_low_speed_limit(int64_t bytes_per_sec, int secs) {
+    low_speed_bytes_per_sec_ = bytes_per_sec;
+    low_speed_secs_ = secs;
+    options_dirty_ = true;
   }
 
   // Set the list of DNS servers to be used instead of the system default.
@@ -102,20 +809,79 @@ class EasyCurl {
   //   host[:port][,host[:port]]...
   void set_dns_servers(std::string dns_servers) {
     dns_servers_ = std::move(dns_servers);
+    options_dirty_ = true;
   }
 
   Error set_auth(CurlAuthType auth_type, std::string username = "", std::string password = "") {
     auth_type_ = auth_type;
     username_ = std::move(username);
     password_ = std::move(password);
+    options_dirty_ = true;
 
     return kOk;
   }
 
+  // Attach this instance to the given shared DNS/TLS session (and optionally
+  // connection) caches, or detach it if 'share' is nullptr. See
+  // easy_curl_share.h. The share must outlive this instance.
+  Error set_share(EasyCurlShare* share);
+
+  // Resolve host names through the given cache, or stop using it if 'cache'
+  // is nullptr. See easy_curl_dns.h. The cache must outlive this instance.
+  void set_dns_cache(EasyCurlDnsCache* cache) {
+    dns_cache_ = cache;
+    applied_dns_versions_.clear();
+    options_dirty_ = true;
+  }
+
+  // Record every transfer of this instance into the given registry, or stop
+  // recording if 'metrics' is nullptr. See easy_curl_metrics.h. The registry
+  // must outlive this instance.
+  void set_metrics(EasyCurlMetrics* metrics) {
+    metrics_ = metrics;
+  }
+
+  // The priority class of the transfers of this instance when they are
+  // queued by an EasyCurlMulti. See EasyCurlMulti::set_max_transfers().
+  void set_priority(TransferPriority priority) {
+    priority_ = priority;
+  }
+
+  // Abort the requests of this instance with kAborted once 'token' is
+  // cancelled, or stop watching a token if nullptr. The token must outlive
+  // the requests. An aborted HTTP/1 transfer closes its connection, as the
+  // rest of the response would otherwise have to be read; an HTTP/2
+  // transfer only resets its stream and leaves the connection for reuse.
+  void set_cancellation_token(const CancellationToken* token) {
+    if (token != cancellation_token_) {
+      cancellation_token_ = token;
+      options_dirty_ = true;
+    }
+  }
+
+  // Fail the requests of this instance with kTimedOut once 'deadline' has
+  // passed, e.g. the deadline of the call they are made for, or clear it
+  // with time_point::max(). Unlike set_timeout(), which limits each request
+  // on its own, this bounds them all together; the earlier of the two
+  // applies. Requests started after the deadline fail right away.
+  void set_deadline(std::chrono::steady_clock::time_point deadline) {
+    deadline_ = deadline;
+  }
+
+  // Start requests only as 'limiter' allows, or regardless if nullptr. See
+  // easy_curl_limiter.h. Blocking requests wait until they may start, or
+  // fail if past the deadline or cancelled meanwhile. The limiter must
+  // outlive this instance.
+  void set_limiter(EasyCurlLimiter* limiter) {
+    limiter_ = limiter;
+    limiter_host_ = nullptr;
+  }
+
   // Enable verbose mode for curl. This dumps debugging output to stderr, so
   // is only really useful in the context of tests.
   void set_verbose(bool v) {
     verbose_ = v;
+    options_dirty_ = true;
   }
 
   // Whether to return an error if server responds with HTTP code >= 400.
@@ -124,38 +890,249 @@ class EasyCurl {
   // 401 and 407. See 'man CURLOPT_FAILONERROR' for details.
   void set_fail_on_http_error(bool fail_on_http_error) {
     fail_on_http_error_ = fail_on_http_error;
+    options_dirty_ = true;
   }
 
   // Returns the number of new connections created to achieve the previous transfer.
   int num_connects() const {
-    return num_connects_;
+    return stats_.num_connects;
+  }
+
+  // Returns the response code of the transfer in progress, e.g. from the
+  // write sink of a request. 0 until the response headers have arrived.
+  int current_response_code() const;
+
+  // Returns the first byte of the object which the response in progress
+  // holds, according to its Content-Range header, or -1 if it has none.
+  int64_t current_range_start() const {
+    return response_range_start_;
+  }
+
+  // Returns details about the previous transfer. Also filled in when the
+  // transfer failed, e.g. to tell where a timed out request spent its time.
+  const TransferStats& transfer_stats() const {
+    return stats_;
   }
 
  private:
+  friend class EasyCurlMulti;
+  friend class EasyCurlShare;
+
   static const constexpr size_t kErrBufSize = 256;
 
+  static const constexpr size_t kDefaultMaxPreallocateBytes = 256 * 1024 * 1024;
+
+  // Initialize libcurl for the process. Safe to call any number of times.
+  static void GlobalInit();
+
+  // The body of a POST request: either 'data', or whatever 'source'
+  // supplies if it is non-NULL.
+  struct PostBody {
+    std::string_view data;
+    const ReadSource* source = nullptr;
+    // Size of the body supplied by 'source', or -1 if unknown.
+    int64_t source_size = -1;
+  };
+
   // Do a request. If 'post_data' is non-NULL, does a POST.
-  // Otherwise, does a GET.
+  // Otherwise, does a GET. The response goes to 'dst' if non-NULL,
+  // else to 'sink'.
   Error DoRequest(const std::string& url,
-                  const std::string* post_data,
+                  const PostBody* post_data,
                   string* dst,
+                  const WriteSink* sink,
                   const std::vector<std::string>& headers = {});
 
+  // Do a request built from 'tmpl'. Arguments are otherwise as above.
+  Error DoTemplateRequest(const RequestTemplate& tmpl,
+                          const std::string& path,
+                          const PostBody* post_data,
+                          string* dst,
+                          const WriteSink* sink);
+
+  // Configure the handle for a request without performing it. Arguments are
+  // as for DoRequest(); if 'tmpl' is non-NULL its headers and credentials
+  // are used instead of 'headers' and those of this instance, and if
+  // 'request' is non-NULL its headers are used instead of 'headers'.
+  // The data of 'post_data', its source, 'dst', 'sink', 'tmpl' and 'request'
+  // must remain valid until FinishRequest() is called.
+  Error PrepareRequest(const std::string& url,
+                       const PostBody* post_data,
+                       string* dst,
+                       const WriteSink* sink,
+                       const std::vector<std::string>& headers,
+                       const RequestTemplate* tmpl = nullptr,
+                       const Request* request = nullptr);
+
+  Error ApplyTlsOptions();
+
+  // Wait until 'limiter_' lets a request to the host of 'url' start.
+  Error WaitForLimiter(const std::string& url);
+
+  // Returns the state 'limiter_' keeps for 'host', looked up only if the
+  // previous request was to another host.
+  LimiterHost* FindLimiterHost(std::string_view host);
+
+  // Hand back what the request in progress took from its limiter, if
+  // anything, reporting 'error' and 'response_code' as its outcome.
+  void ReleaseLimiter(const Error& error, int response_code);
+
+  // Hand curl the addresses 'dns_cache_' has for the host of 'url', if
+  // they changed since they were last handed to it.
+  Error ApplyDnsCache(const std::string& url);
+
+  Error ApplyAuth(CurlAuthType auth_type,
+                  const std::string& username,
+                  const std::string& password);
+
+  // CURLOPT_WRITEFUNCTION callbacks appending to 'dst_', or handing the data
+  // to 'sink_'; 'user_ptr' is the EasyCurl instance.
+  static size_t WriteCallback(char* buffer, size_t size, size_t nmemb, void* user_ptr);
+  static size_t SinkWriteCallback(char* buffer, size_t size, size_t nmemb, void* user_ptr);
+
+  // State of a FetchToFile() in progress.
+  struct FileFetch;
+
+  // Fetch 'url' into 'file', once. Sets 'range_ignored' if resuming failed
+  // because the server doesn't support ranges.
+  Error DoFileFetch(const std::string& url,
+                    FileFetch* file,
+                    const std::vector<std::string>& headers,
+                    bool* range_ignored);
+
+  // CURLOPT_HEADERFUNCTION callback; 'user_ptr' is the EasyCurl instance.
+  static size_t HeaderCallback(char* buffer, size_t size, size_t nmemb, void* user_ptr);
+
+  // Fill 'stats_' from the handle, after a transfer.
+  void CollectTransferStats();
+
+  // Collect the outcome of a transfer set up by PrepareRequest().
+  // 'curl_code' is the CURLcode the transfer completed with.
+  Error FinishRequest(int curl_code);
+
+  // Undo PrepareRequest() for a transfer which won't run after all, e.g.
+  // as it failed halfway or couldn't be added to a multi handle.
+  void AbandonRequest();
+
+  // Drop what the request in progress held on to, once it is done.
+  void ResetRequest();
+
+  // Returns the outcome of the transfer FinishRequest() is collecting.
+  Error CheckTransferResult(int curl_code);
+
   CURL* curl_;
 
+  // Holds what the in-flight request needs until it completes, e.g. its
+  // additional headers, and is reset by FinishRequest(). As it keeps its
+  // memory across requests, building those doesn't allocate in the steady
+  // state.
+  EasyCurlArena request_arena_;
+
+  // Destination buffer of the in-flight request, if not using a sink.
+  string* dst_ = nullptr;
+
+  // Sink of the in-flight request, if not using a buffer.
+  const WriteSink* sink_ = nullptr;
+
+  // The buffer of the last FetchToFile(), kept for the next one.
+  std::unique_ptr<char, void (*)(void*)> file_buffer_{nullptr, free};
+  size_t file_buffer_size_ = 0;
+
+  // URL of the last request built from a RequestTemplate.
+  std::string url_buf_;
+
+  // Whether any of the settings below changed since they were last applied
+  // to 'curl_'.
+  bool options_dirty_ = true;
+
+  // Id of the RequestTemplate whose credentials are applied to 'curl_', or
+  // 0 for the credentials of this instance.
+  uint64_t applied_auth_source_ = 0;
+
+  // Whether CURLOPT_DNS_SERVERS is currently set on 'curl_'.
+  bool dns_servers_set_ = false;
+
+  size_t max_preallocate_bytes_ = kDefaultMaxPreallocateBytes;
+
   // Whether to return the HTTP headers with the response.
   bool return_headers_ = false;
 
+  // Whether to keep the HTTP headers in 'response_headers_'.
+  bool capture_headers_ = false;
+  ResponseHeaders response_headers_;
+
+  // The first byte and the size of the object according to the
+  // Content-Range header of the response, or -1.
+  int64_t response_range_start_ = -1;
+  int64_t response_range_total_ = -1;
+
   bool verbose_ = false;
 
   // The default setting for CURLOPT_FAILONERROR in libcurl is 0 (false).
   bool fail_on_http_error_ = false;
 
-  int timeout_secs_;
+  CurlHttpVersion http_version_ = CurlHttpVersion::DEFAULT;
+
+  TlsOptions tls_options_;
+
+  bool tcp_keepalive_ = false;
+  int tcp_keepidle_secs_ = 60;
+  int tcp_keepintvl_secs_ = 60;
+
+  int max_connection_idle_secs_ = -1;
+  int max_connection_age_secs_ = -1;
+
+  bool wait_for_multiplexing_ = false;
+
+  bool accept_encoding_ = false;
+  std::string accept_encodings_;
+
+  int64_t timeout_ms_ = 0;
+
+  int64_t connect_timeout_ms_ = 0;
+
+  int64_t low_speed_bytes_per_sec_ = 0;
+  int low_speed_secs_ = 0;
 
   std::string dns_servers_;
 
-  int num_connects_ = 0;
+  EasyCurlDnsCache* dns_cache_ = nullptr;
+
+  // Versions of the addresses from 'dns_cache_' handed to curl, by
+  // "host:port", and scratch space to look them up.
+  std::unordered_map<std::string, uint64_t> applied_dns_versions_;
+  std::string dns_key_;
+  std::string dns_resolve_;
+
+  // Whether CURLOPT_RESOLVE is set for the in-flight request.
+  bool resolve_set_ = false;
+
+  TransferStats stats_;
+
+  EasyCurlMetrics* metrics_ = nullptr;
+
+  TransferPriority priority_ = TransferPriority::NORMAL;
+
+  const CancellationToken* cancellation_token_ = nullptr;
+
+  std::chrono::steady_clock::time_point deadline_ = std::chrono::steady_clock::time_point::max();
+  // Whether CURLOPT_TIMEOUT_MS was last set from 'deadline_', rather than
+  // from 'timeout_ms_'.
+  bool deadline_applied_ = false;
+
+  EasyCurlLimiter* limiter_ = nullptr;
+  // The state of 'limiter_' for the host of the latest request, named
+  // 'limiter_host_name_', or nullptr if not looked up yet.
+  LimiterHost* limiter_host_ = nullptr;
+  std::string limiter_host_name_;
+  // Scratch space for HostKey().
+  std::string host_key_;
+  // The limiter which let the request in progress start, for
+  // 'limiter_host_', to release it once done.
+  EasyCurlLimiter* acquired_limiter_ = nullptr;
+
+  // Time the transfer in progress spent queued, set by EasyCurlMulti.
+  int64_t queue_us_ = 0;
 
   char errbuf_[kErrBufSize];
 
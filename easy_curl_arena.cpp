@@ -0,0 +1,73 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_arena.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+EasyCurlArena::EasyCurlArena(size_t initial_block_size) {
+  AddBlock(std::max<size_t>(initial_block_size, 64));
+}
+
+void* EasyCurlArena::Allocate(size_t size, size_t align) {
+  assert(align != 0 && (align & (align - 1)) == 0);
+  assert(align <= alignof(std::max_align_t));
+  Block* block = &blocks_.back();
+  // Blocks come from new char[], which is only aligned for types of
+  // fundamental alignment; up to that, aligning the offset aligns the
+  // address.
+  size_t start = (pos_ + align - 1) & ~(align - 1);
+  if (start + size > block->size) {
+    // Grow geometrically so a large request needs few blocks.
+    AddBlock(std::max(size + align, block->size * 2));
+    block = &blocks_.back();
+    start = 0;
+  }
+  pos_ = start + size;
+  return block->data.get() + start;
+}
+
+char* EasyCurlArena::AddString(std::string_view s) {
+  char* copy = static_cast<char*>(Allocate(s.size() + 1, 1));
+  memcpy(copy, s.data(), s.size());
+  copy[s.size()] = '\0';
+  return copy;
+}
+
+void EasyCurlArena::Reset() {
+  if (blocks_.size() > 1) {
+    // The last block is the largest: keep it, so the next round of
+    // allocations of the same size fits in one block.
+    Block last = std::move(blocks_.back());
+    blocks_.clear();
+    blocks_.push_back(std::move(last));
+    footprint_ = blocks_.back().size;
+  }
+  pos_ = 0;
+}
+
+void EasyCurlArena::AddBlock(size_t min_size) {
+  Block block;
+  block.data.reset(new char[min_size]);
+  block.size = min_size;
+  blocks_.push_back(std::move(block));
+  footprint_ += min_size;
+  pos_ = 0;
+}
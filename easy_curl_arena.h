@@ -0,0 +1,95 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_ARENA_H
+#define EASY_CURL_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// A bump allocator for short-lived data, e.g. what one request needs while
+// in flight. Allocations are carved from a few large blocks and only
+// released all at once by Reset(), which keeps the largest block around, so
+// an arena reused for requests of similar shape stops touching the heap
+// after the first one.
+//
+// Example:
+//   EasyCurlArena arena;
+//   char* s = arena.AddString("Accept: application/json");
+//   ...
+//   arena.Reset();  // 's' is gone.
+//
+// Only trivially destructible objects can live in an arena: destructors
+// are never run.
+//
+// This is not thread-safe.
+class EasyCurlArena {
+ public:
+  explicit EasyCurlArena(size_t initial_block_size = 4096);
+
+  EasyCurlArena(const EasyCurlArena& that) = delete;
+  EasyCurlArena& operator=(const EasyCurlArena& that) = delete;
+
+  // Returns 'size' bytes aligned to 'align', which must be a power of two
+  // no greater than alignof(std::max_align_t). Valid until the next Reset().
+  void* Allocate(size_t size, size_t align = alignof(std::max_align_t));
+
+  // Returns a NUL-terminated copy of 's'.
+  char* AddString(std::string_view s);
+
+  // Constructs a T in the arena.
+  template<typename T, typename... Args>
+  T* New(Args&&... args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena objects are never destroyed");
+    static_assert(alignof(T) <= alignof(std::max_align_t),
+                  "arena objects can't be over-aligned");
+    return new (Allocate(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+  }
+
+  // Release everything allocated so far at once.
+  void Reset();
+
+  // Bytes of heap memory held by the arena.
+  size_t memory_footprint() const {
+    return footprint_;
+  }
+
+ private:
+  struct Block {
+    std::unique_ptr<char[]> data;
+    size_t size;
+  };
+
+  // Start a new block with room for at least 'min_size' bytes.
+  void AddBlock(size_t min_size);
+
+  // Blocks in allocation order; allocations come from the last one.
+  std::vector<Block> blocks_;
+
+  // Offset of the first free byte of the last block.
+  size_t pos_ = 0;
+
+  size_t footprint_ = 0;
+};
+
+#endif //EASY_CURL_ARENA_H
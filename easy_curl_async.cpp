@@ -0,0 +1,229 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_async.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+
+EasyCurlAsync::EasyCurlAsync(size_t max_concurrency, InitCallback init, Executor executor)
+    : max_concurrency_(std::max<size_t>(max_concurrency, 1)),
+      init_(std::move(init)),
+      executor_(std::move(executor)) {
+  thread_ = std::thread(&EasyCurlAsync::Loop, this);
+}
+
+EasyCurlAsync::~EasyCurlAsync() {
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    stopping_ = true;
+  }
+  cond_.notify_one();
+  multi_.Wakeup();
+  thread_.join();
+}
+
+EasyCurlAsync::RequestId EasyCurlAsync::Fetch(string url,
+                                              Callback done,
+                                              vector<string> headers) {
+  std::unique_ptr<Request> request(new Request());
+  request->url = std::move(url);
+  request->headers = std::move(headers);
+  request->done = std::move(done);
+  return Submit(std::move(request));
+}
+
+EasyCurlAsync::RequestId EasyCurlAsync::Post(string url,
+                                             string post_data,
+                                             Callback done,
+                                             vector<string> headers) {
+  std::unique_ptr<Request> request(new Request());
+  request->url = std::move(url);
+  request->headers = std::move(headers);
+  request->post = true;
+  request->post_data = std::move(post_data);
+  request->done = std::move(done);
+  return Submit(std::move(request));
+}
+
+void EasyCurlAsync::Cancel(RequestId id) {
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    cancelled_.push_back(id);
+  }
+  cond_.notify_one();
+  multi_.Wakeup();
+}
+
+EasyCurlAsync::RequestId EasyCurlAsync::Submit(std::unique_ptr<Request> request) {
+  RequestId id;
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    id = next_id_++;
+    request->id = id;
+    submitted_.emplace_back(std::move(request));
+  }
+  // The background thread either waits for requests on 'cond_', or for
+  // network activity in Poll().
+  cond_.notify_one();
+  multi_.Wakeup();
+  return id;
+}
+
+void EasyCurlAsync::Loop() {
+  vector<std::unique_ptr<Request>> submitted;
+  vector<RequestId> cancelled;
+  while (true) {
+    {
+      std::unique_lock<std::mutex> l(lock_);
+      if (in_flight_.empty() && queued_.empty()) {
+        cond_.wait(l, [&]() {
+          return stopping_ || !submitted_.empty() || !cancelled_.empty();
+        });
+      }
+      if (stopping_) {
+        break;
+      }
+      submitted.swap(submitted_);
+      cancelled.swap(cancelled_);
+    }
+
+    for (auto& request : submitted) {
+      queued_.emplace_back(std::move(request));
+    }
+    submitted.clear();
+    for (RequestId id : cancelled) {
+      auto it = in_flight_.find(id);
+      if (it != in_flight_.end()) {
+        // The callback of the transfer completes the request.
+        multi_.Cancel(it->second.first);
+        continue;
+      }
+      auto queued = std::find_if(queued_.begin(), queued_.end(),
+                                 [&](const std::unique_ptr<Request>& r) { return r->id == id; });
+      if (queued != queued_.end()) {
+        auto request = std::move(*queued);
+        queued_.erase(queued);
+        Complete(std::move(request), Error(kAborted, "request cancelled"));
+      }
+    }
+    cancelled.clear();
+
+    StartQueued();
+    if (!in_flight_.empty()) {
+      auto error = multi_.Poll(1000);
+      if (error.code != kOk) {
+        // The multi handle is unusable; fail what it was driving rather
+        // than spinning on it.
+        cerr << "EasyCurlAsync: " << error.msg << endl;
+        vector<EasyCurl*> curls;
+        for (const auto& entry : in_flight_) {
+          curls.push_back(entry.second.first);
+        }
+        for (EasyCurl* curl : curls) {
+          multi_.Cancel(curl);
+        }
+      }
+    }
+  }
+
+  // Shutting down: abort everything still outstanding.
+  vector<EasyCurl*> curls;
+  for (const auto& entry : in_flight_) {
+    curls.push_back(entry.second.first);
+  }
+  for (EasyCurl* curl : curls) {
+    multi_.Cancel(curl);
+  }
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    submitted.swap(submitted_);
+  }
+  for (auto& request : submitted) {
+    queued_.emplace_back(std::move(request));
+  }
+  while (!queued_.empty()) {
+    auto request = std::move(queued_.front());
+    queued_.pop_front();
+    Complete(std::move(request), Error(kAborted, "EasyCurlAsync shutting down"));
+  }
+}
+
+void EasyCurlAsync::StartQueued() {
+  while (!queued_.empty() && (!free_curls_.empty() || curls_.size() < max_concurrency_)) {
+    auto request = std::move(queued_.front());
+    queued_.pop_front();
+    Start(std::move(request));
+  }
+}
+
+void EasyCurlAsync::Start(std::unique_ptr<Request> request) {
+  EasyCurl* curl;
+  if (!free_curls_.empty()) {
+    curl = free_curls_.back();
+    free_curls_.pop_back();
+  } else {
+    curls_.emplace_back(new EasyCurl());
+    curl = curls_.back().get();
+    if (init_) {
+      init_(curl);
+    }
+  }
+
+  // The request stays in 'in_flight_' while the transfer uses its URL, body
+  // and buffer.
+  Request* r = request.get();
+  RequestId id = r->id;
+  in_flight_.emplace(id, std::make_pair(curl, std::move(request)));
+  auto done = [this, id](EasyCurl* curl, const Error& error) {
+    auto it = in_flight_.find(id);
+    assert(it != in_flight_.end());
+    auto request = std::move(it->second.second);
+    in_flight_.erase(it);
+    request->result.stats = curl->transfer_stats();
+    free_curls_.push_back(curl);
+    Complete(std::move(request), error);
+  };
+  auto error = r->post ?
+      multi_.AddPost(curl, r->url, r->post_data, &r->result.body, std::move(done), r->headers) :
+      multi_.AddFetch(curl, r->url, &r->result.body, std::move(done), r->headers);
+  if (error.code != kOk) {
+    auto it = in_flight_.find(id);
+    auto failed = std::move(it->second.second);
+    in_flight_.erase(it);
+    free_curls_.push_back(curl);
+    Complete(std::move(failed), error);
+  }
+}
+
+void EasyCurlAsync::Complete(std::unique_ptr<Request> request, const Error& error) {
+  request->result.error = error;
+  if (!executor_) {
+    request->done(std::move(request->result));
+    return;
+  }
+  // Executor tasks must be copyable.
+  std::shared_ptr<Request> shared(std::move(request));
+  executor_([shared]() {
+    shared->done(std::move(shared->result));
+  });
+}
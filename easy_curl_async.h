@@ -0,0 +1,162 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_ASYNC_H
+#define EASY_CURL_ASYNC_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "easy_curl.h"
+#include "easy_curl_multi.h"
+
+// A thread-safe, non-blocking HTTP client: requests are handed to a
+// background thread which drives them all through an EasyCurlMulti, and
+// their callbacks are invoked once they complete.
+//
+// The transfers are driven by up to 'max_concurrency' EasyCurl handles,
+// which are reused from one request to the next and share the connections
+// of the multi handle. Requests beyond that are queued in submission order.
+//
+// Callbacks are handed to the executor given at construction, e.g. to run
+// them on the threads of an application's own thread pool. Without one,
+// they run on the background thread and must not block.
+//
+// Example:
+//   EasyCurlAsync client(64);
+//   client.Fetch("http://localhost:40080/sample_get",
+//                [](EasyCurlAsync::Result result) { ... });
+//
+// For C++20 coroutines, see the awaitables in easy_curl_coro.h.
+class EasyCurlAsync {
+ public:
+  // The outcome of a request.
+  struct Result {
+    Error error = Error(kOk);
+    std::string body;
+    TransferStats stats;
+  };
+
+  typedef std::function<void(Result result)> Callback;
+
+  // Runs 'task', now or later, on some thread.
+  typedef std::function<void(std::function<void()> task)> Executor;
+
+  // Invoked once on each handle the client creates, on the background
+  // thread.
+  typedef std::function<void(EasyCurl* curl)> InitCallback;
+
+  // Identifies a request, e.g. to cancel it. Never 0.
+  typedef uint64_t RequestId;
+
+  explicit EasyCurlAsync(size_t max_concurrency = 64,
+                         InitCallback init = nullptr,
+                         Executor executor = nullptr);
+
+  // Cancels all outstanding requests, whose callbacks are invoked with
+  // kAborted, and stops the background thread.
+  ~EasyCurlAsync();
+
+  EasyCurlAsync(const EasyCurlAsync& that) = delete;
+  EasyCurlAsync& operator=(const EasyCurlAsync& that) = delete;
+
+  // Fetch the given URL, invoking 'done' with the response once complete.
+  // See EasyCurl::FetchURL() for details.
+  RequestId Fetch(std::string url,
+                  Callback done,
+                  std::vector<std::string> headers = {});
+
+  // Issue an HTTP POST of 'post_data' to the given URL, invoking 'done'
+  // with the response once complete. See EasyCurl::PostToURL() for details.
+  RequestId Post(std::string url,
+                 std::string post_data,
+                 Callback done,
+                 std::vector<std::string> headers = {});
+
+  // Abort the given request if it hasn't completed yet, in which case its
+  // callback is invoked with kAborted. Does nothing otherwise.
+  void Cancel(RequestId id);
+
+ private:
+  struct Request {
+    RequestId id;
+    std::string url;
+    std::vector<std::string> headers;
+    bool post = false;
+    std::string post_data;
+    Callback done;
+    // Filled in by the transfer.
+    Result result;
+  };
+
+  // Hand 'request' to the background thread, and return its id.
+  RequestId Submit(std::unique_ptr<Request> request);
+
+  // Body of the background thread.
+  void Loop();
+
+  // Start as many queued requests as there are handles for.
+  void StartQueued();
+
+  // Start 'request' on a free handle, or complete it if that fails.
+  void Start(std::unique_ptr<Request> request);
+
+  // Hand the result of 'request' to its callback.
+  void Complete(std::unique_ptr<Request> request, const Error& error);
+
+  const size_t max_concurrency_;
+
+  const InitCallback init_;
+
+  const Executor executor_;
+
+  // Protects the members below it, which are shared with the submitting
+  // threads.
+  std::mutex lock_;
+  std::condition_variable cond_;
+  bool stopping_ = false;
+  RequestId next_id_ = 1;
+  std::vector<std::unique_ptr<Request>> submitted_;
+  std::vector<RequestId> cancelled_;
+
+  // The members below are only used by the background thread.
+
+  // Requests waiting for a free handle.
+  std::deque<std::unique_ptr<Request>> queued_;
+
+  // Requests in flight, by id, and the handles driving them.
+  std::unordered_map<RequestId, std::pair<EasyCurl*, std::unique_ptr<Request>>> in_flight_;
+
+  std::vector<std::unique_ptr<EasyCurl>> curls_;
+  std::vector<EasyCurl*> free_curls_;
+
+  // Declared after the handles so it is destroyed first.
+  EasyCurlMulti multi_;
+
+  std::thread thread_;
+};
+
+#endif //EASY_CURL_ASYNC_H
@@ -0,0 +1,102 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_batch.h"
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+
+EasyCurlBatch::EasyCurlBatch(size_t max_concurrency, InitCallback init)
+    : max_concurrency_(std::max<size_t>(max_concurrency, 1)),
+      init_(std::move(init)) {
+}
+
+EasyCurlBatch::~EasyCurlBatch() = default;
+
+Error EasyCurlBatch::FetchURLs(const vector<string>& urls,
+                               vector<BatchResult>* results,
+                               const CompletionCallback& on_complete,
+                               const vector<string>& headers) {
+  assert(results != nullptr);
+  results->clear();
+  // Sized up front: transfers write into the bodies in place.
+  results->resize(urls.size());
+
+  Batch batch;
+  batch.urls = &urls;
+  batch.headers = &headers;
+  batch.results = results;
+  batch.on_complete = &on_complete;
+
+  size_t concurrency = std::min(max_concurrency_, urls.size());
+  while (curls_.size() < concurrency) {
+    curls_.emplace_back(new EasyCurl());
+    if (init_) {
+      init_(curls_.back().get());
+    }
+  }
+  for (size_t i = 0; i < concurrency; i++) {
+    StartNext(curls_[i].get(), &batch);
+  }
+
+  auto error = multi_.Run();
+  if (error.code != kOk) {
+    batch.aborted = true;
+    for (size_t i = 0; i < concurrency; i++) {
+      // Not in flight is fine.
+      multi_.Cancel(curls_[i].get());
+    }
+    for (size_t i = batch.next; i < urls.size(); i++) {
+      (*results)[i].error = Error(kAborted, "batch aborted: " + error.msg);
+    }
+  }
+  return error;
+}
+
+void EasyCurlBatch::StartNext(EasyCurl* curl, Batch* batch) {
+  while (!batch->aborted && batch->next < batch->urls->size()) {
+    size_t index = batch->next++;
+    auto done = [this, index, batch](EasyCurl* curl, const Error& error) {
+      Complete(index, error, curl->transfer_stats(), batch);
+      StartNext(curl, batch);
+    };
+    auto error = multi_.AddFetch(curl, (*batch->urls)[index], &(*batch->results)[index].body,
+                                 std::move(done), *batch->headers);
+    if (error.code == kOk) {
+      return;
+    }
+    // The request couldn't be started, e.g. because of a malformed URL:
+    // it fails on its own and the handle moves on to the next one.
+    Complete(index, error, TransferStats(), batch);
+  }
+}
+
+void EasyCurlBatch::Complete(size_t index,
+                             const Error& error,
+                             const TransferStats& stats,
+                             Batch* batch) {
+  BatchResult* result = &(*batch->results)[index];
+  result->error = error;
+  result->stats = stats;
+  if (*batch->on_complete) {
+    (*batch->on_complete)(index, result);
+  }
+}
@@ -0,0 +1,120 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_BATCH_H
+#define EASY_CURL_BATCH_H
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "easy_curl.h"
+#include "easy_curl_multi.h"
+
+// The outcome of one request of a batch.
+struct BatchResult {
+  Error error = Error(kOk);
+  std::string body;
+  TransferStats stats;
+};
+
+// Fetches many URLs concurrently from the calling thread, and hands back
+// all the responses.
+//
+// At most 'max_concurrency' transfers are in flight at a time, each driven
+// by one of a set of EasyCurl handles which are reused from one URL to the
+// next, and from one batch to the next. Transfers share the connections of
+// the underlying EasyCurlMulti, so a batch to a few hosts only opens a few
+// connections per host.
+//
+// Example:
+//   EasyCurlBatch batch(32, [](EasyCurl* curl) { curl->set_timeout(5); });
+//   std::vector<BatchResult> results;
+//   auto e = batch.FetchURLs(urls, &results);
+//   for (size_t i = 0; i < urls.size(); i++) {
+//     if (results[i].error.code == kOk) { ... results[i].body ... }
+//   }
+//
+// Like EasyCurl, this is not thread-safe.
+class EasyCurlBatch {
+ public:
+  // Invoked once on each handle the batch creates.
+  typedef std::function<void(EasyCurl* curl)> InitCallback;
+
+  // Invoked as soon as the request for urls[index] completed, while the
+  // rest of the batch is still in progress. The callback may consume the
+  // result, e.g. move the body out of it.
+  typedef std::function<void(size_t index, BatchResult* result)> CompletionCallback;
+
+  explicit EasyCurlBatch(size_t max_concurrency, InitCallback init = nullptr);
+  ~EasyCurlBatch();
+
+  EasyCurlBatch(const EasyCurlBatch& that) = delete;
+  EasyCurlBatch& operator=(const EasyCurlBatch& that) = delete;
+
+  // Fetch all of 'urls', sending 'headers' with each request, and store the
+  // outcome of urls[i] in (*results)[i]. URLs are started in order. Each
+  // request succeeds or fails on its own: the returned error only reports
+  // failures of the batch as a whole, in which case the requests which
+  // didn't complete are reported as kAborted.
+  Error FetchURLs(const std::vector<std::string>& urls,
+                  std::vector<BatchResult>* results,
+                  const CompletionCallback& on_complete = nullptr,
+                  const std::vector<std::string>& headers = {});
+
+  // Returns the underlying multi handle, e.g. to enable multiplexing.
+  EasyCurlMulti* multi() {
+    return &multi_;
+  }
+
+ private:
+  // The batch FetchURLs() is working through.
+  struct Batch {
+    const std::vector<std::string>* urls;
+    const std::vector<std::string>* headers;
+    std::vector<BatchResult>* results;
+    const CompletionCallback* on_complete;
+    // Index of the next URL to start.
+    size_t next = 0;
+    // Whether the batch failed, so no more URLs are to be started.
+    bool aborted = false;
+  };
+
+  // Start the next URLs of 'batch' on 'curl', until one is successfully in
+  // flight or none are left.
+  void StartNext(EasyCurl* curl, Batch* batch);
+
+  // Record the outcome of urls[index] and run the completion callback.
+  void Complete(size_t index,
+                const Error& error,
+                const TransferStats& stats,
+                Batch* batch);
+
+  const size_t max_concurrency_;
+
+  const InitCallback init_;
+
+  // Created on demand, up to 'max_concurrency_'.
+  std::vector<std::unique_ptr<EasyCurl>> curls_;
+
+  // Declared after the handles so it is destroyed first.
+  EasyCurlMulti multi_;
+};
+
+#endif //EASY_CURL_BATCH_H
@@ -0,0 +1,477 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_cache.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+#include <curl/curl.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+
+// Tells files written by this version of the cache.
+const char kDiskMagic[] = "easy_curl cache 1\n";
+
+// Distinguishes the temporary files of concurrent writers.
+std::atomic<uint64_t> next_temp_id(1);
+
+int64_t WallNowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+string_view Trim(string_view s) {
+  size_t start = s.find_first_not_of(" \t");
+  if (start == string_view::npos) {
+    return string_view();
+  }
+  size_t end = s.find_last_not_of(" \t");
+  return s.substr(start, end - start + 1);
+}
+
+bool EqualsIgnoreCase(string_view a, const char* b) {
+  return a.size() == strlen(b) && strncasecmp(a.data(), b, a.size()) == 0;
+}
+
+// Returns the seconds since the epoch of an HTTP date, or -1.
+int64_t ParseHttpDate(string_view date) {
+  string copy(date);
+  return curl_getdate(copy.c_str(), nullptr);
+}
+
+// What the headers of a response say about caching it.
+struct Freshness {
+  bool no_store = false;
+  bool no_cache = false;
+  // Whether the response says how long it is fresh for, and if so, for how
+  // long from now.
+  bool has_ttl = false;
+  int64_t ttl_ms = 0;
+};
+
+Freshness ParseFreshness(const ResponseHeaders& headers) {
+  Freshness freshness;
+  vector<string_view> values;
+  headers.GetAll("Cache-Control", &values);
+  for (string_view value : values) {
+    while (!value.empty()) {
+      size_t comma = value.find(',');
+      string_view directive = Trim(value.substr(0, comma));
+      value = comma == string_view::npos ? string_view() : value.substr(comma + 1);
+      size_t eq = directive.find('=');
+      string_view name = Trim(directive.substr(0, eq));
+      string_view arg = eq == string_view::npos ? string_view() : Trim(directive.substr(eq + 1));
+      if (arg.size() >= 2 && arg.front() == '"' && arg.back() == '"') {
+        arg = arg.substr(1, arg.size() - 2);
+      }
+      if (EqualsIgnoreCase(name, "no-store")) {
+        freshness.no_store = true;
+      } else if (EqualsIgnoreCase(name, "no-cache")) {
+        // Also with a list of fields, which are kept anyway.
+        freshness.no_cache = true;
+      } else if (EqualsIgnoreCase(name, "max-age") && !freshness.has_ttl) {
+        freshness.has_ttl = true;
+        freshness.ttl_ms = strtoll(string(arg).c_str(), nullptr, 10) * 1000;
+      }
+    }
+  }
+
+  string_view value;
+  if (freshness.has_ttl) {
+    // max-age counts from when the response was generated.
+    if (headers.Get("Age", &value)) {
+      freshness.ttl_ms -= strtoll(string(value).c_str(), nullptr, 10) * 1000;
+    }
+  } else if (headers.Get("Expires", &value)) {
+    // Relative to the server's clock. Invalid dates, e.g. "0", mean the
+    // response is stale already.
+    int64_t expires = ParseHttpDate(value);
+    int64_t date = -1;
+    if (headers.Get("Date", &value)) {
+      date = ParseHttpDate(value);
+    }
+    if (date < 0) {
+      date = WallNowMs() / 1000;
+    }
+    freshness.has_ttl = true;
+    freshness.ttl_ms = expires < 0 ? 0 : (expires - date) * 1000;
+  }
+  freshness.ttl_ms = std::max<int64_t>(freshness.ttl_ms, 0);
+  return freshness;
+}
+
+void AppendField(string_view field, string* out) {
+  out->append(std::to_string(field.size()));
+  out->push_back('\n');
+  out->append(field);
+}
+
+// Reads a field written by AppendField() at 'pos' of 'data', advancing
+// 'pos'. Returns false if the data is cut short.
+bool ReadField(const string& data, size_t* pos, string* field) {
+  size_t eol = data.find('\n', *pos);
+  if (eol == string::npos) {
+    return false;
+  }
+  size_t len = strtoull(data.c_str() + *pos, nullptr, 10);
+  if (len > data.size() - eol - 1) {
+    return false;
+  }
+  field->assign(data, eol + 1, len);
+  *pos = eol + 1 + len;
+  return true;
+}
+
+} // anonymous namespace
+
+EasyCurlResponseCache::EasyCurlResponseCache(ResponseCacheOptions options)
+    : options_(std::move(options)) {
+}
+
+EasyCurlResponseCache::~EasyCurlResponseCache() = default;
+
+Error EasyCurlResponseCache::FetchURL(EasyCurl* curl,
+                                      const string& url,
+                                      std::shared_ptr<const string>* body,
+                                      const vector<string>& headers) {
+  assert(curl != nullptr);
+  assert(body != nullptr);
+  string key;
+  MakeKey(url, headers, &key);
+  std::shared_ptr<const Entry> entry = Lookup(key);
+  if (entry && WallNowMs() < entry->fresh_until_ms) {
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    *body = entry->body;
+    return kOk;
+  }
+  if (!options_.coalesce) {
+    return Refresh(curl, url, key, headers, body);
+  }
+  bool shared = false;
+  auto error = flights_.Do(key, [&](std::shared_ptr<const string>* result) {
+    return Refresh(curl, url, key, headers, result);
+  }, body, &shared);
+  if (shared) {
+    coalesced_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return error;
+}
+
+Error EasyCurlResponseCache::Refresh(EasyCurl* curl,
+                                     const string& url,
+                                     const string& key,
+                                     const vector<string>& headers,
+                                     std::shared_ptr<const string>* body) {
+  std::shared_ptr<const Entry> entry = Lookup(key);
+  int64_t now_ms = WallNowMs();
+  if (entry && now_ms < entry->fresh_until_ms) {
+    hits_.fetch_add(1, std::memory_order_relaxed);
+    *body = entry->body;
+    return kOk;
+  }
+
+  vector<string> request_headers = headers;
+  if (entry && (!entry->etag.empty() || !entry->last_modified.empty())) {
+    revalidations_.fetch_add(1, std::memory_order_relaxed);
+    if (!entry->etag.empty()) {
+      request_headers.push_back("If-None-Match: " + entry->etag);
+    }
+    if (!entry->last_modified.empty()) {
+      request_headers.push_back("If-Modified-Since: " + entry->last_modified);
+    }
+  } else {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+    // Stale, and no way to revalidate it.
+    entry = nullptr;
+  }
+
+  curl->set_capture_headers(true);
+  auto fetched = std::make_shared<string>();
+  auto error = curl->FetchURL(url, fetched.get(), request_headers);
+  const ResponseHeaders& response = curl->response_headers();
+  Freshness freshness = ParseFreshness(response);
+  string_view value;
+
+  if (entry && curl->transfer_stats().response_code == 304) {
+    not_modified_.fetch_add(1, std::memory_order_relaxed);
+    *body = entry->body;
+    if (freshness.no_store) {
+      Remove(key);
+      return kOk;
+    }
+    auto updated = std::make_shared<Entry>(*entry);
+    if (freshness.has_ttl) {
+      updated->ttl_ms = freshness.ttl_ms;
+    }
+    updated->fresh_until_ms = freshness.no_cache ? 0 : now_ms + updated->ttl_ms;
+    if (response.Get("ETag", &value)) {
+      updated->etag.assign(value);
+    }
+    if (response.Get("Last-Modified", &value)) {
+      updated->last_modified.assign(value);
+    }
+    // The file on disk keeps its freshness: rewriting the body for it isn't
+    // worth it, as after a restart it only costs a revalidation.
+    Store(std::move(updated), false);
+    return kOk;
+  }
+  if (error.code != kOk) {
+    *body = std::move(fetched);
+    return error;
+  }
+
+  bool vary_all = response.Get("Vary", &value) && Trim(value) == "*";
+  auto stored = std::make_shared<Entry>();
+  if (response.Get("ETag", &value)) {
+    stored->etag.assign(value);
+  }
+  if (response.Get("Last-Modified", &value)) {
+    stored->last_modified.assign(value);
+  }
+  stored->ttl_ms = freshness.has_ttl ? freshness.ttl_ms : options_.default_ttl_ms;
+  stored->fresh_until_ms = freshness.no_cache ? 0 : now_ms + stored->ttl_ms;
+  bool usable = stored->fresh_until_ms > now_ms ||
+      !stored->etag.empty() || !stored->last_modified.empty();
+  if (freshness.no_store || vary_all || !usable) {
+    Remove(key);
+  } else {
+    stored->key = key;
+    stored->body = fetched;
+    Store(std::move(stored), true);
+  }
+  *body = std::move(fetched);
+  return kOk;
+}
+
+void EasyCurlResponseCache::Invalidate(const string& url, const vector<string>& headers) {
+  string key;
+  MakeKey(url, headers, &key);
+  Remove(key);
+}
+
+void EasyCurlResponseCache::Clear() {
+  std::lock_guard<std::mutex> l(lock_);
+  entries_.clear();
+  lru_.clear();
+  bytes_ = 0;
+}
+
+EasyCurlResponseCache::Counters EasyCurlResponseCache::counters() const {
+  Counters counters;
+  counters.hits = hits_.load(std::memory_order_relaxed);
+  counters.revalidations = revalidations_.load(std::memory_order_relaxed);
+  counters.not_modified = not_modified_.load(std::memory_order_relaxed);
+  counters.coalesced = coalesced_.load(std::memory_order_relaxed);
+  counters.misses = misses_.load(std::memory_order_relaxed);
+  counters.disk_reads = disk_reads_.load(std::memory_order_relaxed);
+  counters.evictions = evictions_.load(std::memory_order_relaxed);
+  return counters;
+}
+
+size_t EasyCurlResponseCache::memory_bytes() const {
+  std::lock_guard<std::mutex> l(lock_);
+  return bytes_;
+}
+
+void EasyCurlResponseCache::MakeKey(const string& url,
+                                    const vector<string>& headers,
+                                    string* key) {
+  // Neither URLs nor headers contain newlines.
+  key->assign(url);
+  for (const auto& header : headers) {
+    key->push_back('\n');
+    key->append(header);
+  }
+}
+
+std::shared_ptr<const EasyCurlResponseCache::Entry> EasyCurlResponseCache::Lookup(
+    const string& key) {
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      lru_.splice(lru_.begin(), lru_, it->second.lru_pos);
+      return it->second.entry;
+    }
+  }
+  if (options_.disk_dir.empty()) {
+    return nullptr;
+  }
+  auto entry = ReadFromDisk(key);
+  if (entry) {
+    disk_reads_.fetch_add(1, std::memory_order_relaxed);
+    Store(entry, false);
+  }
+  return entry;
+}
+
+void EasyCurlResponseCache::Store(std::shared_ptr<const Entry> entry, bool to_disk) {
+  size_t bytes = EntryBytes(*entry);
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    auto it = entries_.find(entry->key);
+    if (it != entries_.end()) {
+      bytes_ -= EntryBytes(*it->second.entry);
+      lru_.erase(it->second.lru_pos);
+      entries_.erase(it);
+    }
+    // Responses larger than the whole cache only go to disk.
+    if (bytes <= options_.max_bytes) {
+      MakeRoom(bytes);
+      lru_.push_front(entry->key);
+      Slot& slot = entries_[entry->key];
+      slot.entry = entry;
+      slot.lru_pos = lru_.begin();
+      bytes_ += bytes;
+    }
+  }
+  if (to_disk && !options_.disk_dir.empty()) {
+    WriteToDisk(*entry);
+  }
+}
+
+void EasyCurlResponseCache::Remove(const string& key) {
+  {
+    std::lock_guard<std::mutex> l(lock_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      bytes_ -= EntryBytes(*it->second.entry);
+      lru_.erase(it->second.lru_pos);
+      entries_.erase(it);
+    }
+  }
+  if (!options_.disk_dir.empty()) {
+    unlink(DiskPath(key).c_str());
+  }
+}
+
+void EasyCurlResponseCache::MakeRoom(size_t bytes) {
+  while (bytes_ + bytes > options_.max_bytes && !lru_.empty()) {
+    auto it = entries_.find(lru_.back());
+    bytes_ -= EntryBytes(*it->second.entry);
+    entries_.erase(it);
+    lru_.pop_back();
+    evictions_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+size_t EasyCurlResponseCache::EntryBytes(const Entry& entry) {
+  return entry.key.size() + entry.body->size() + entry.etag.size() + entry.last_modified.size();
+}
+
+string EasyCurlResponseCache::DiskPath(const string& key) const {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016" PRIx64 ".cache",
+           static_cast<uint64_t>(std::hash<string>()(key)));
+  return options_.disk_dir + name;
+}
+
+std::shared_ptr<const EasyCurlResponseCache::Entry> EasyCurlResponseCache::ReadFromDisk(
+    const string& key) {
+  int fd = open(DiskPath(key).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return nullptr;
+  }
+  string data;
+  struct stat st;
+  bool ok = fstat(fd, &st) == 0;
+  if (ok) {
+    data.resize(st.st_size);
+    size_t pos = 0;
+    while (ok && pos < data.size()) {
+      ssize_t n = read(fd, &data[pos], data.size() - pos);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      ok = n > 0;
+      pos += ok ? n : 0;
+    }
+  }
+  close(fd);
+
+  static const size_t kMagicLen = sizeof(kDiskMagic) - 1;
+  if (!ok || data.compare(0, kMagicLen, kDiskMagic) != 0) {
+    return nullptr;
+  }
+  auto entry = std::make_shared<Entry>();
+  size_t pos = kMagicLen;
+  string times;
+  // Another key with the same hash may have overwritten the file.
+  if (!ReadField(data, &pos, &entry->key) || entry->key != key ||
+      !ReadField(data, &pos, &entry->etag) ||
+      !ReadField(data, &pos, &entry->last_modified) ||
+      !ReadField(data, &pos, &times) ||
+      sscanf(times.c_str(), "%" SCNd64 " %" SCNd64,
+             &entry->fresh_until_ms, &entry->ttl_ms) != 2) {
+    return nullptr;
+  }
+  // The body is the rest of the file; moving it to the front saves copying
+  // it into a buffer of its own.
+  data.erase(0, pos);
+  entry->body = std::make_shared<const string>(std::move(data));
+  return entry;
+}
+
+void EasyCurlResponseCache::WriteToDisk(const Entry& entry) {
+  string header(kDiskMagic);
+  AppendField(entry.key, &header);
+  AppendField(entry.etag, &header);
+  AppendField(entry.last_modified, &header);
+  AppendField(std::to_string(entry.fresh_until_ms) + " " + std::to_string(entry.ttl_ms),
+              &header);
+
+  // Written aside and renamed into place, so readers never see half a file.
+  string path = DiskPath(entry.key);
+  string temp_path = path + ".tmp." + std::to_string(getpid()) + "." +
+      std::to_string(next_temp_id.fetch_add(1, std::memory_order_relaxed));
+  int fd = open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return;
+  }
+  bool ok = true;
+  for (string_view data : {string_view(header), string_view(*entry.body)}) {
+    while (ok && !data.empty()) {
+      ssize_t n = write(fd, data.data(), data.size());
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      ok = n > 0;
+      data.remove_prefix(ok ? n : 0);
+    }
+  }
+  ok = close(fd) == 0 && ok;
+  // The cache is best effort: a response which couldn't be written is
+  // fetched again after a restart.
+  if (!ok || rename(temp_path.c_str(), path.c_str()) != 0) {
+    unlink(temp_path.c_str());
+  }
+}
@@ -0,0 +1,215 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_CACHE_H
+#define EASY_CURL_CACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "easy_curl.h"
+#include "easy_curl_single_flight.h"
+
+struct ResponseCacheOptions {
+  // Bytes of responses kept in memory, bodies and keys. The least recently
+  // used responses are dropped to make room for new ones.
+  size_t max_bytes = 64 * 1024 * 1024;
+
+  // How long responses which don't say how long they are fresh for, with
+  // Cache-Control or Expires, are used without asking the server, in
+  // milliseconds. 0 revalidates them every time.
+  int64_t default_ttl_ms = 0;
+
+  // If set, responses are also stored as files in this directory, which
+  // must exist, and survive the process. Responses dropped from memory are
+  // read back from there. The files are never trimmed, so the directory
+  // should be cleaned up otherwise.
+  std::string disk_dir;
+
+  // Whether concurrent requests which miss or revalidate the same response
+  // wait for one of them to do so, rather than all going to the server. See
+  // EasyCurlSingleFlight.
+  bool coalesce = true;
+};
+
+// An HTTP cache for GET requests, e.g. in front of endpoints which are
+// polled for configuration or metadata that rarely changes.
+//
+// Responses are used as they are while fresh according to their
+// Cache-Control max-age or Expires headers. Once stale, they are revalidated
+// with a conditional request (If-None-Match, If-Modified-Since) from their
+// ETag or Last-Modified headers, so an unchanged response costs a 304
+// without a body. Responses with Cache-Control: no-store aren't kept, and
+// those with no-cache are revalidated every time.
+//
+// Bodies are handed out as shared buffers: a hit or a 304 costs no copy of
+// the body, and a body stays valid for as long as it is referenced, even if
+// the cache drops or replaces it in the meantime.
+//
+// Example:
+//   EasyCurlResponseCache cache;
+//   EasyCurl curl;
+//   std::shared_ptr<const std::string> body;
+//   auto e = cache.FetchURL(&curl, "http://config.internal/flags", &body);
+//
+// Responses are cached per URL and list of request headers. Vary is not
+// implemented, so responses which vary by anything else shouldn't be
+// fetched through the cache; "Vary: *" responses aren't stored.
+//
+// The cache can be shared by requests on different threads, each with an
+// EasyCurl instance of its own. Concurrent misses of the same response are
+// coalesced into one request, unless disabled with 'coalesce'.
+//
+// This class is thread-safe.
+class EasyCurlResponseCache {
+ public:
+  explicit EasyCurlResponseCache(ResponseCacheOptions options = ResponseCacheOptions());
+  ~EasyCurlResponseCache();
+
+  EasyCurlResponseCache(const EasyCurlResponseCache& that) = delete;
+  EasyCurlResponseCache& operator=(const EasyCurlResponseCache& that) = delete;
+
+  // Fetch 'url' with 'curl', sending 'headers', unless a fresh response is
+  // cached, and set 'body' to the response body. As with
+  // EasyCurl::FetchURL(), responses other than 2xx are reported as errors,
+  // with the body of the error page, and aren't cached; a 304 to a
+  // revalidation counts as the cached response.
+  //
+  // Header capture is turned on on 'curl' (see
+  // EasyCurl::set_capture_headers()), which must not have
+  // set_return_headers() on. After a hit, or if another request fetched the
+  // response, curl->transfer_stats() are those of its previous request.
+  Error FetchURL(EasyCurl* curl,
+                 const std::string& url,
+                 std::shared_ptr<const std::string>* body,
+                 const std::vector<std::string>& headers = {});
+
+  // Drop the cached response for 'url' and 'headers', from disk too.
+  void Invalidate(const std::string& url, const std::vector<std::string>& headers = {});
+
+  // Drop all the responses kept in memory. Files on disk are left alone.
+  void Clear();
+
+  struct Counters {
+    // Requests answered from the cache without asking the server.
+    int64_t hits = 0;
+    // Requests which revalidated a stale response, and how many of those
+    // got a 304.
+    int64_t revalidations = 0;
+    int64_t not_modified = 0;
+    // Requests which found nothing usable, including on disk.
+    int64_t misses = 0;
+    // Requests which waited for another one to miss or revalidate the same
+    // response, rather than asking the server themselves.
+    int64_t coalesced = 0;
+    // Responses read back from disk.
+    int64_t disk_reads = 0;
+    // Responses dropped from memory to make room.
+    int64_t evictions = 0;
+  };
+  Counters counters() const;
+
+  // Bytes of responses held in memory.
+  size_t memory_bytes() const;
+
+ private:
+  // A cached response. Immutable once stored, so it can be used without
+  // holding 'lock_'; a revalidation stores a new one sharing the body.
+  struct Entry {
+    std::string key;
+    std::shared_ptr<const std::string> body;
+    std::string etag;
+    std::string last_modified;
+    // Until when the response is fresh, in milliseconds since the epoch, as
+    // it may come back from disk after a restart.
+    int64_t fresh_until_ms = 0;
+    // How long the response is fresh for from when it was received or
+    // revalidated.
+    int64_t ttl_ms = 0;
+  };
+
+  struct Slot {
+    std::shared_ptr<const Entry> entry;
+    // Position in 'lru_'.
+    std::list<std::string>::iterator lru_pos;
+  };
+
+  // Sets 'key' to the cache key of a request of 'url' with 'headers'.
+  static void MakeKey(const std::string& url,
+                      const std::vector<std::string>& headers,
+                      std::string* key);
+
+  // Fetch or revalidate the response under 'key', unless another request
+  // stored a fresh one in the meantime.
+  Error Refresh(EasyCurl* curl,
+                const std::string& url,
+                const std::string& key,
+                const std::vector<std::string>& headers,
+                std::shared_ptr<const std::string>* body);
+
+  // Returns the entry under 'key' from memory, or else from disk, or
+  // nullptr.
+  std::shared_ptr<const Entry> Lookup(const std::string& key);
+
+  // Store 'entry', replacing any previous one, in memory and on disk if
+  // 'to_disk'.
+  void Store(std::shared_ptr<const Entry> entry, bool to_disk);
+
+  // Drop the entry under 'key' from memory, and from disk if configured.
+  void Remove(const std::string& key);
+
+  // Drop the least recently used entries until there is room for 'bytes'.
+  // Requires 'lock_' to be held.
+  void MakeRoom(size_t bytes);
+
+  // Memory accounted to 'entry'.
+  static size_t EntryBytes(const Entry& entry);
+
+  // The file holding the entry under 'key'.
+  std::string DiskPath(const std::string& key) const;
+
+  std::shared_ptr<const Entry> ReadFromDisk(const std::string& key);
+  void WriteToDisk(const Entry& entry);
+
+  const ResponseCacheOptions options_;
+
+  mutable std::mutex lock_;
+  std::unordered_map<std::string, Slot> entries_;
+  // Keys of 'entries_', most recently used first.
+  std::list<std::string> lru_;
+  size_t bytes_ = 0;
+
+  EasyCurlSingleFlight flights_;
+
+  std::atomic<int64_t> hits_{0};
+  std::atomic<int64_t> revalidations_{0};
+  std::atomic<int64_t> not_modified_{0};
+  std::atomic<int64_t> coalesced_{0};
+  std::atomic<int64_t> misses_{0};
+  std::atomic<int64_t> disk_reads_{0};
+  std::atomic<int64_t> evictions_{0};
+};
+
+#endif //EASY_CURL_CACHE_H
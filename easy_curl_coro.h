@@ -0,0 +1,153 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_CORO_H
+#define EASY_CURL_CORO_H
+
+#if __cplusplus < 202002L
+#error "easy_curl_coro.h requires C++20"
+#endif
+
+#include <atomic>
+#include <coroutine>
+#include <memory>
+#include <stop_token>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "easy_curl_async.h"
+
+// Awaitables around EasyCurlAsync, so coroutines can issue requests
+// without blocking the thread they run on:
+//
+//   Task<void> Handle(EasyCurlAsync* client, std::stop_token stop) {
+//     EasyCurlAsync::Result resp = co_await AsyncFetch(client, url, {}, stop);
+//     if (resp.error.code != kOk) { ... }
+//   }
+//
+// The coroutine is suspended until the request completes, and resumed on
+// whichever thread the executor of the client runs callbacks on (the
+// background thread of the client if it has none). Requesting a stop on
+// the given token cancels the request, which then completes with kAborted.
+//
+// These work with any coroutine type; the awaitable must be awaited right
+// away, and at most once.
+
+class EasyCurlAwaitable {
+ public:
+  EasyCurlAwaitable(EasyCurlAsync* client,
+                    std::string url,
+                    bool post,
+                    std::string post_data,
+                    std::vector<std::string> headers,
+                    std::stop_token stop)
+      : state_(new State()) {
+    state_->client = client;
+    state_->url = std::move(url);
+    state_->post = post;
+    state_->post_data = std::move(post_data);
+    state_->headers = std::move(headers);
+    state_->stop = std::move(stop);
+  }
+
+  bool await_ready() const noexcept {
+    return false;
+  }
+
+  // Returns false, letting the coroutine go on right away, if the request
+  // completed before this returned.
+  bool await_suspend(std::coroutine_handle<> coroutine) {
+    State* state = state_.get();
+    state->coroutine = coroutine;
+    auto done = [state](EasyCurlAsync::Result result) {
+      state->result = std::move(result);
+      // Whichever of the callback and await_suspend() comes second resumes
+      // the coroutine.
+      if (state->completed.exchange(true, std::memory_order_acq_rel)) {
+        state->coroutine.resume();
+      }
+    };
+    if (state->post) {
+      state->id = state->client->Post(std::move(state->url), std::move(state->post_data),
+                                      std::move(done), std::move(state->headers));
+    } else {
+      state->id = state->client->Fetch(std::move(state->url), std::move(done),
+                                       std::move(state->headers));
+    }
+    if (state->stop.stop_possible()) {
+      EasyCurlAsync* client = state->client;
+      EasyCurlAsync::RequestId id = state->id;
+      state->on_stop.reset(new std::stop_callback<StopCallback>(
+          state->stop, StopCallback{client, id}));
+    }
+    return !state->completed.exchange(true, std::memory_order_acq_rel);
+  }
+
+  EasyCurlAsync::Result await_resume() {
+    // Waits for a concurrent stop request to finish cancelling.
+    state_->on_stop.reset();
+    return std::move(state_->result);
+  }
+
+ private:
+  struct StopCallback {
+    EasyCurlAsync* client;
+    EasyCurlAsync::RequestId id;
+    void operator()() const {
+      client->Cancel(id);
+    }
+  };
+
+  // Kept on the heap so the awaitable can be moved before it is awaited.
+  struct State {
+    EasyCurlAsync* client;
+    std::string url;
+    bool post;
+    std::string post_data;
+    std::vector<std::string> headers;
+    std::stop_token stop;
+    std::coroutine_handle<> coroutine;
+    EasyCurlAsync::RequestId id = 0;
+    std::unique_ptr<std::stop_callback<StopCallback>> on_stop;
+    std::atomic<bool> completed{false};
+    EasyCurlAsync::Result result;
+  };
+
+  std::unique_ptr<State> state_;
+};
+
+// Fetch the given URL through 'client'. See EasyCurlAsync::Fetch().
+inline EasyCurlAwaitable AsyncFetch(EasyCurlAsync* client,
+                                    std::string url,
+                                    std::vector<std::string> headers = {},
+                                    std::stop_token stop = {}) {
+  return EasyCurlAwaitable(client, std::move(url), false, "", std::move(headers),
+                           std::move(stop));
+}
+
+// Issue an HTTP POST through 'client'. See EasyCurlAsync::Post().
+inline EasyCurlAwaitable AsyncPost(EasyCurlAsync* client,
+                                   std::string url,
+                                   std::string post_data,
+                                   std::vector<std::string> headers = {},
+                                   std::stop_token stop = {}) {
+  return EasyCurlAwaitable(client, std::move(url), true, std::move(post_data),
+                           std::move(headers), std::move(stop));
+}
+
+#endif //EASY_CURL_CORO_H
@@ -0,0 +1,404 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_dns.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/socket.h>
+
+namespace {
+
+// Versions of the addresses of all entries, so an EasyCurl instance can
+// tell whether the ones it applied are current, whichever cache they came
+// from.
+std::atomic<uint64_t> next_version(1);
+
+int64_t NowMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Returns the address in the form CURLOPT_RESOLVE takes, or an empty
+// string if it is not a numeric IPv4 or IPv6 address.
+std::string ResolveAddress(const std::string& address) {
+  unsigned char buf[sizeof(struct in6_addr)];
+  if (inet_pton(AF_INET, address.c_str(), buf) == 1) {
+    return address;
+  }
+  if (inet_pton(AF_INET6, address.c_str(), buf) == 1) {
+    return "[" + address + "]";
+  }
+  return "";
+}
+
+Error GetAddrInfo(const std::string& host, std::vector<std::string>* addresses) {
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  struct addrinfo* result = nullptr;
+  int res = getaddrinfo(host.c_str(), nullptr, &hints, &result);
+  if (res != 0) {
+    return Error(kNetworkError, "could not resolve " + host + ": " + gai_strerror(res));
+  }
+  addresses->clear();
+  char buf[INET6_ADDRSTRLEN];
+  for (struct addrinfo* ai = result; ai != nullptr; ai = ai->ai_next) {
+    const void* addr;
+    if (ai->ai_family == AF_INET) {
+      addr = &reinterpret_cast<struct sockaddr_in*>(ai->ai_addr)->sin_addr;
+    } else if (ai->ai_family == AF_INET6) {
+      addr = &reinterpret_cast<struct sockaddr_in6*>(ai->ai_addr)->sin6_addr;
+    } else {
+      continue;
+    }
+    if (inet_ntop(ai->ai_family, addr, buf, sizeof(buf)) != nullptr &&
+        std::find(addresses->begin(), addresses->end(), buf) == addresses->end()) {
+      addresses->emplace_back(buf);
+    }
+  }
+  freeaddrinfo(result);
+  if (addresses->empty()) {
+    return Error(kNetworkError, "no addresses for " + host);
+  }
+  return kOk;
+}
+
+} // anonymous namespace
+
+EasyCurlDnsCache::EasyCurlDnsCache(DnsCacheOptions options)
+    : options_(std::move(options)) {
+  if (options_.ttl_ms <= 0 || options_.stale_ms < 0 || options_.refresh_ahead_ms < 0 ||
+      options_.refresh_ahead_ms >= options_.ttl_ms || options_.resolver_threads <= 0) {
+    cerr << "Invalid DnsCacheOptions";
+    exit(1);
+  }
+  next_sweep_ms_ = NowMs();
+  for (int i = 0; i < options_.resolver_threads; i++) {
+    threads_.emplace_back([this]() { ResolverLoop(); });
+  }
+}
+
+EasyCurlDnsCache::~EasyCurlDnsCache() {
+  {
+    std::lock_guard<std::mutex> l(queue_lock_);
+    shutdown_ = true;
+  }
+  queue_cond_.notify_all();
+  for (auto& thread : threads_) {
+    thread.join();
+  }
+}
+
+void EasyCurlDnsCache::MakeKey(std::string_view host, int port, std::string* key) {
+  key->clear();
+  for (char c : host) {
+    key->push_back(static_cast<char>(tolower(static_cast<unsigned char>(c))));
+  }
+  // Formatted by hand as this runs for every request.
+  char buf[16];
+  int len = snprintf(buf, sizeof(buf), ":%d", port);
+  key->append(buf, static_cast<size_t>(len));
+}
+
+void EasyCurlDnsCache::Prefetch(const std::string& host, int port) {
+  std::string key;
+  MakeKey(host, port, &key);
+  std::unique_lock<std::shared_mutex> l(lock_);
+  Entry* entry = GetOrAddEntry(key);
+  if (entry == nullptr) {
+    return;
+  }
+  entry->prefetch = true;
+  if (entry->version == 0) {
+    ScheduleResolution(key, entry);
+  }
+}
+
+Error EasyCurlDnsCache::Resolve(const std::string& host,
+                                int port,
+                                std::vector<std::string>* addresses) {
+  std::string key;
+  MakeKey(host, port, &key);
+  {
+    std::shared_lock<std::shared_mutex> l(lock_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      Entry* entry = it->second.get();
+      if (entry->version != 0 && (entry->pinned || NowMs() < entry->expires_ms)) {
+        *addresses = entry->addresses;
+        return kOk;
+      }
+    }
+  }
+  {
+    std::unique_lock<std::shared_mutex> l(lock_);
+    if (GetOrAddEntry(key) == nullptr) {
+      return Error(kServiceUnavailable, "DNS cache is full");
+    }
+  }
+  auto error = ResolveEntry(key);
+  if (error.code != kOk) {
+    return error;
+  }
+  std::shared_lock<std::shared_mutex> l(lock_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return Error(kAborted, "DNS cache entry dropped while resolving " + host);
+  }
+  *addresses = it->second->addresses;
+  return kOk;
+}
+
+Error EasyCurlDnsCache::Pin(const std::string& host,
+                            int port,
+                            const std::vector<std::string>& addresses) {
+  if (addresses.empty()) {
+    return Error(kInvalidArgument, "no addresses to pin " + host + " to");
+  }
+  for (const auto& address : addresses) {
+    if (ResolveAddress(address).empty()) {
+      return Error(kInvalidArgument, "not an IP address: " + address);
+    }
+  }
+  std::string key;
+  MakeKey(host, port, &key);
+  std::unique_lock<std::shared_mutex> l(lock_);
+  // Pinned addresses don't count towards the limit: there is no other
+  // place to keep them.
+  auto& slot = entries_[key];
+  if (!slot) {
+    slot.reset(new Entry());
+    slot->host = key.substr(0, key.rfind(':'));
+    slot->port = port;
+  }
+  slot->pinned = true;
+  StoreAddresses(slot.get(), addresses, NowMs());
+  return kOk;
+}
+
+void EasyCurlDnsCache::Unpin(const std::string& host, int port) {
+  std::string key;
+  MakeKey(host, port, &key);
+  std::unique_lock<std::shared_mutex> l(lock_);
+  auto it = entries_.find(key);
+  if (it != entries_.end() && it->second->pinned) {
+    // A lookup may still be pending, which finds the entry gone.
+    entries_.erase(it);
+  }
+}
+
+EasyCurlDnsCache::Counters EasyCurlDnsCache::counters() const {
+  Counters counters;
+  counters.hits = hits_.load(std::memory_order_relaxed);
+  counters.stale_hits = stale_hits_.load(std::memory_order_relaxed);
+  counters.misses = misses_.load(std::memory_order_relaxed);
+  counters.resolutions = resolutions_.load(std::memory_order_relaxed);
+  counters.failures = failures_.load(std::memory_order_relaxed);
+  return counters;
+}
+
+bool EasyCurlDnsCache::Lookup(const std::string& key,
+                              uint64_t applied_version,
+                              uint64_t* version,
+                              std::string* resolve) {
+  {
+    std::shared_lock<std::shared_mutex> l(lock_);
+    auto it = entries_.find(key);
+    if (it != entries_.end()) {
+      Entry* entry = it->second.get();
+      int64_t now = NowMs();
+      if (entry->version == 0 || (!entry->pinned && now >= entry->stale_until_ms)) {
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        ScheduleResolution(key, entry);
+        return false;
+      }
+      if (!entry->pinned) {
+        // Only written when it flips, so hot entries aren't written to by
+        // every request.
+        if (!entry->used.load(std::memory_order_relaxed)) {
+          entry->used.store(true, std::memory_order_relaxed);
+        }
+        if (now >= entry->expires_ms) {
+          stale_hits_.fetch_add(1, std::memory_order_relaxed);
+          ScheduleResolution(key, entry);
+        } else {
+          hits_.fetch_add(1, std::memory_order_relaxed);
+        }
+      } else {
+        hits_.fetch_add(1, std::memory_order_relaxed);
+      }
+      *version = entry->version;
+      if (entry->version != applied_version) {
+        resolve->assign(entry->resolve);
+      }
+      return true;
+    }
+  }
+
+  // The first request for the host is left to curl, which resolves it
+  // while we do too, for the next requests.
+  misses_.fetch_add(1, std::memory_order_relaxed);
+  std::unique_lock<std::shared_mutex> l(lock_);
+  Entry* entry = GetOrAddEntry(key);
+  if (entry != nullptr) {
+    ScheduleResolution(key, entry);
+  }
+  return false;
+}
+
+void EasyCurlDnsCache::ScheduleResolution(const std::string& key, Entry* entry) {
+  if (entry->pinned || entry->resolving.exchange(true, std::memory_order_relaxed)) {
+    return;
+  }
+  {
+    std::lock_guard<std::mutex> l(queue_lock_);
+    queue_.push_back(key);
+  }
+  queue_cond_.notify_one();
+}
+
+EasyCurlDnsCache::Entry* EasyCurlDnsCache::GetOrAddEntry(const std::string& key) {
+  auto it = entries_.find(key);
+  if (it != entries_.end()) {
+    return it->second.get();
+  }
+  if (entries_.size() >= options_.max_entries) {
+    return nullptr;
+  }
+  size_t colon = key.rfind(':');
+  std::unique_ptr<Entry> entry(new Entry());
+  entry->host = key.substr(0, colon);
+  entry->port = std::stoi(key.substr(colon + 1));
+  return entries_.emplace(key, std::move(entry)).first->second.get();
+}
+
+Error EasyCurlDnsCache::ResolveEntry(const std::string& key) {
+  std::string host;
+  {
+    std::shared_lock<std::shared_mutex> l(lock_);
+    auto it = entries_.find(key);
+    if (it == entries_.end()) {
+      return Error(kAborted, "DNS cache entry dropped before resolving " + key);
+    }
+    host = it->second->host;
+  }
+
+  std::vector<std::string> addresses;
+  auto error = GetAddrInfo(host, &addresses);
+  (error.code == kOk ? resolutions_ : failures_).fetch_add(1, std::memory_order_relaxed);
+
+  std::unique_lock<std::shared_mutex> l(lock_);
+  auto it = entries_.find(key);
+  if (it == entries_.end()) {
+    return error;
+  }
+  Entry* entry = it->second.get();
+  entry->resolving.store(false, std::memory_order_relaxed);
+  // Addresses which can't be refreshed are used until they are too stale,
+  // and the lookup retried by the next sweeps.
+  if (error.code == kOk && !entry->pinned) {
+    StoreAddresses(entry, std::move(addresses), NowMs());
+  }
+  return error;
+}
+
+void EasyCurlDnsCache::StoreAddresses(Entry* entry,
+                                      std::vector<std::string> addresses,
+                                      int64_t now_ms) {
+  if (entry->pinned) {
+    entry->expires_ms = std::numeric_limits<int64_t>::max();
+    entry->stale_until_ms = std::numeric_limits<int64_t>::max();
+  } else {
+    entry->expires_ms = now_ms + options_.ttl_ms;
+    entry->stale_until_ms = entry->expires_ms + options_.stale_ms;
+  }
+  entry->used.store(false, std::memory_order_relaxed);
+  // Handles only need to pick up addresses which changed.
+  if (entry->version != 0 && addresses == entry->addresses) {
+    return;
+  }
+  entry->addresses = std::move(addresses);
+  entry->resolve = entry->host + ":" + to_string(entry->port) + ":";
+  for (size_t i = 0; i < entry->addresses.size(); i++) {
+    if (i > 0) {
+      entry->resolve.push_back(',');
+    }
+    entry->resolve.append(ResolveAddress(entry->addresses[i]));
+  }
+  entry->version = next_version.fetch_add(1, std::memory_order_relaxed);
+}
+
+void EasyCurlDnsCache::ResolverLoop() {
+  // Sweep often enough for refreshes to start well within their window.
+  const int64_t sweep_interval_ms = std::max<int64_t>(
+      10, std::min<int64_t>(1000, (options_.refresh_ahead_ms > 0 ?
+                                   options_.refresh_ahead_ms : options_.ttl_ms) / 4));
+  std::unique_lock<std::mutex> l(queue_lock_);
+  while (!shutdown_) {
+    if (!queue_.empty()) {
+      std::string key = std::move(queue_.front());
+      queue_.pop_front();
+      l.unlock();
+      ResolveEntry(key);
+      l.lock();
+      continue;
+    }
+    int64_t now = NowMs();
+    if (now >= next_sweep_ms_) {
+      // Whichever thread is idle when a sweep is due does it.
+      next_sweep_ms_ = now + sweep_interval_ms;
+      l.unlock();
+      Sweep();
+      l.lock();
+      continue;
+    }
+    queue_cond_.wait_for(l, std::chrono::milliseconds(next_sweep_ms_ - now));
+  }
+}
+
+void EasyCurlDnsCache::Sweep() {
+  int64_t now = NowMs();
+  std::unique_lock<std::shared_mutex> l(lock_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    Entry* entry = it->second.get();
+    if (entry->pinned) {
+      ++it;
+      continue;
+    }
+    bool in_use = entry->prefetch || entry->used.load(std::memory_order_relaxed);
+    if (in_use && now >= entry->expires_ms - options_.refresh_ahead_ms) {
+      ScheduleResolution(it->first, entry);
+    } else if (!in_use && now >= entry->stale_until_ms &&
+               !entry->resolving.load(std::memory_order_relaxed)) {
+      it = entries_.erase(it);
+      continue;
+    }
+    ++it;
+  }
+}
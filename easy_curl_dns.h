@@ -0,0 +1,210 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_DNS_H
+#define EASY_CURL_DNS_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "easy_curl.h"
+
+struct DnsCacheOptions {
+  // How long resolved addresses are used as they are, in milliseconds.
+  int64_t ttl_ms = 60 * 1000;
+
+  // How long past their TTL addresses are still used while they are being
+  // resolved again in the background, or if resolving them again fails. 0
+  // leaves expired hosts to curl until they are resolved again.
+  int64_t stale_ms = 5 * 60 * 1000;
+
+  // Hosts which were looked up since they were last resolved, or passed to
+  // Prefetch(), are resolved again this long before their TTL runs out, so
+  // hosts in regular use never go stale. Must be below 'ttl_ms'; 0
+  // disables refreshing ahead of time.
+  int64_t refresh_ahead_ms = 5 * 1000;
+
+  // Number of hosts kept. Further hosts are resolved by curl on its own.
+  size_t max_entries = 10000;
+
+  // Number of background threads resolving host names, so one slow lookup
+  // doesn't hold up the others.
+  int resolver_threads = 2;
+};
+
+// A process-wide DNS cache which EasyCurl instances, possibly on different
+// threads, resolve host names through. It outlives the handles, and keeps
+// the hosts in use fresh in the background, so requests never wait for
+// lookups after the first one to a host.
+//
+// Host names are resolved with getaddrinfo() on background threads, and the
+// addresses are handed to the handles like CURLOPT_RESOLVE entries. Until a
+// host is resolved for the first time, curl resolves it on its own, keeping
+// the result for 'ttl_ms' as well. Expired addresses are used for up to
+// 'stale_ms' more while they are resolved again (stale-while-revalidate).
+//
+// Addresses can also be pinned, e.g. for hosts known up front or not in
+// DNS at all, overriding lookups until unpinned.
+//
+// Example:
+//   EasyCurlDnsCache dns;
+//   dns.Prefetch("api.example.com", 443);
+//   dns.Pin("backend.internal", 8080, {"10.0.0.7", "10.0.0.8"});
+//   EasyCurl curl;
+//   curl.set_dns_cache(&dns);
+//
+// Note that the addresses handed to a handle land in its DNS cache, which
+// is the one of its EasyCurlMulti if driven by one, or of its EasyCurlShare
+// if attached to one, sharing them with the other handles using that
+// cache. As the system resolver is used, EasyCurl::set_dns_servers() has
+// no effect on the hosts resolved here.
+//
+// The cache must outlive every EasyCurl instance using it.
+//
+// This class is thread-safe.
+class EasyCurlDnsCache {
+ public:
+  explicit EasyCurlDnsCache(DnsCacheOptions options = DnsCacheOptions());
+  ~EasyCurlDnsCache();
+
+  EasyCurlDnsCache(const EasyCurlDnsCache& that) = delete;
+  EasyCurlDnsCache& operator=(const EasyCurlDnsCache& that) = delete;
+
+  // Resolve 'host' in the background if it isn't yet, and keep it fresh
+  // from now on, whether or not it is in use.
+  void Prefetch(const std::string& host, int port);
+
+  // Resolve 'host' if it isn't cached yet or is stale, waiting for the
+  // lookup, and return its addresses. Useful to warm up the cache before
+  // serving traffic.
+  Error Resolve(const std::string& host, int port, std::vector<std::string>* addresses);
+
+  // Use 'addresses' (IPv4 or IPv6, without brackets) for requests to 'host'
+  // on 'port' until Unpin() is called, instead of resolving it.
+  Error Pin(const std::string& host, int port, const std::vector<std::string>& addresses);
+
+  // Resolve 'host' on 'port' again.
+  void Unpin(const std::string& host, int port);
+
+  struct Counters {
+    // Lookups of requests which found fresh, stale or no addresses.
+    int64_t hits = 0;
+    int64_t stale_hits = 0;
+    int64_t misses = 0;
+    // Host names resolved in the background, and failed attempts at it.
+    int64_t resolutions = 0;
+    int64_t failures = 0;
+  };
+  Counters counters() const;
+
+ private:
+  friend class EasyCurl;
+
+  struct Entry {
+    std::string host;
+    int port = 0;
+
+    std::vector<std::string> addresses;
+
+    // The CURLOPT_RESOLVE entry for the addresses, "host:port:addr,...",
+    // and its version, unique across all caches; 0 until resolved.
+    std::string resolve;
+    uint64_t version = 0;
+
+    // Until when the addresses are fresh, and then usable at all, in
+    // milliseconds of the steady clock.
+    int64_t expires_ms = 0;
+    int64_t stale_until_ms = 0;
+
+    bool pinned = false;
+    bool prefetch = false;
+
+    // Whether the entry was looked up since it was last resolved.
+    std::atomic<bool> used{false};
+    // Whether a lookup of the host is queued or in progress.
+    std::atomic<bool> resolving{false};
+  };
+
+  // Sets 'key' to the key of the entry for 'host' on 'port': "host:port",
+  // in lower case.
+  static void MakeKey(std::string_view host, int port, std::string* key);
+
+  // Look up the addresses of the entry under 'key' for a request. Returns
+  // false if there are none to use. If their version differs from
+  // 'applied_version', sets 'version' and copies the CURLOPT_RESOLVE entry
+  // to 'resolve'.
+  bool Lookup(const std::string& key,
+              uint64_t applied_version,
+              uint64_t* version,
+              std::string* resolve);
+
+  // Queue a lookup of the entry under 'key', unless one is pending already.
+  void ScheduleResolution(const std::string& key, Entry* entry);
+
+  // Returns the entry under 'key', or nullptr if there is none and no room
+  // for one. Requires 'lock_' to be held exclusively.
+  Entry* GetOrAddEntry(const std::string& key);
+
+  // Resolve the host of the entry under 'key' in the calling thread, and
+  // store the result. Pinned entries are left alone.
+  Error ResolveEntry(const std::string& key);
+
+  // Replace the addresses of 'entry', fresh as of 'now_ms'. Requires
+  // 'lock_' to be held exclusively.
+  void StoreAddresses(Entry* entry, std::vector<std::string> addresses, int64_t now_ms);
+
+  // Body of the resolver threads.
+  void ResolverLoop();
+
+  // Queue refreshes of the entries about to expire, and drop the unused
+  // ones which expired.
+  void Sweep();
+
+  const DnsCacheOptions options_;
+
+  mutable std::shared_mutex lock_;
+  std::unordered_map<std::string, std::unique_ptr<Entry>> entries_;
+
+  // Keys of the entries to resolve.
+  std::mutex queue_lock_;
+  std::condition_variable queue_cond_;
+  std::deque<std::string> queue_;
+  // When the cache is swept next, in milliseconds of the steady clock.
+  int64_t next_sweep_ms_ = 0;
+  bool shutdown_ = false;
+
+  std::atomic<int64_t> hits_{0};
+  std::atomic<int64_t> stale_hits_{0};
+  std::atomic<int64_t> misses_{0};
+  std::atomic<int64_t> resolutions_{0};
+  std::atomic<int64_t> failures_{0};
+
+  std::vector<std::thread> threads_;
+};
+
+#endif //EASY_CURL_DNS_H
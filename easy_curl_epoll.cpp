@@ -0,0 +1,209 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_epoll.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <ctime>
+#include <string>
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+namespace {
+
+inline Error ErrnoError(const char* what) {
+  return Error(kIOError, string(what) + ": " + strerror(errno));
+}
+
+} // anonymous namespace
+
+#define RETURN_NOT_OK(expr)  { \
+    auto error = (expr); \
+    if (error.code != kOk) { \
+      return error; \
+    } \
+  }
+
+EasyCurlEpoll::EasyCurlEpoll(EasyCurlMulti* multi)
+    : multi_(multi) {
+  epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+  timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (epoll_fd_ < 0 || timer_fd_ < 0) {
+    cerr << "Could not create epoll instance: " << strerror(errno);
+    exit(1);
+  }
+  struct epoll_event event = {};
+  event.events = EPOLLIN;
+  event.data.fd = timer_fd_;
+  if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, timer_fd_, &event) != 0) {
+    cerr << "Could not watch timerfd: " << strerror(errno);
+    exit(1);
+  }
+  auto error = multi_->set_event_loop(this);
+  if (error.code != kOk) {
+    cerr << "Could not drive EasyCurlMulti with epoll: " << error.msg;
+    exit(1);
+  }
+}
+
+EasyCurlEpoll::~EasyCurlEpoll() {
+  multi_->set_event_loop(nullptr);
+  close(timer_fd_);
+  close(epoll_fd_);
+}
+
+Error EasyCurlEpoll::WatchSocket(int fd, int events) {
+  Socket& socket = sockets_[fd];
+  if (socket.events == socket.applied_events) {
+    changed_sockets_.push_back(fd);
+  }
+  socket.events = events;
+  return dispatching_ ? Error(kOk) : ApplySocketChanges();
+}
+
+Error EasyCurlEpoll::ApplySocketChanges() {
+  for (int fd : changed_sockets_) {
+    auto it = sockets_.find(fd);
+    if (it == sockets_.end() || it->second.events == it->second.applied_events) {
+      continue;
+    }
+    Socket& socket = it->second;
+    if (socket.events == 0) {
+      // The socket may be closed already, which removes it from the epoll
+      // set too.
+      if (epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr) != 0 &&
+          errno != EBADF && errno != ENOENT) {
+        return ErrnoError("epoll_ctl(EPOLL_CTL_DEL)");
+      }
+      sockets_.erase(it);
+      continue;
+    }
+    struct epoll_event event = {};
+    if (socket.events & kRead) {
+      event.events |= EPOLLIN;
+    }
+    if (socket.events & kWrite) {
+      event.events |= EPOLLOUT;
+    }
+    event.data.fd = fd;
+    // If the descriptor was closed and reused for a new socket since it was
+    // added, it is no longer in the epoll set, whatever 'applied_events'
+    // says.
+    int op = socket.applied_events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    int res = epoll_ctl(epoll_fd_, op, fd, &event);
+    if (res != 0 && op == EPOLL_CTL_MOD && errno == ENOENT) {
+      res = epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event);
+    } else if (res != 0 && op == EPOLL_CTL_ADD && errno == EEXIST) {
+      res = epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &event);
+    }
+    if (res != 0) {
+      return ErrnoError("epoll_ctl");
+    }
+    socket.applied_events = socket.events;
+  }
+  changed_sockets_.clear();
+  return kOk;
+}
+
+Error EasyCurlEpoll::SetTimer(int64_t timeout_ms) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  int64_t now_ms = static_cast<int64_t>(now.tv_sec) * 1000 + now.tv_nsec / 1000000;
+  int64_t deadline_ms = timeout_ms < 0 ? -1 : now_ms + timeout_ms;
+  // curl re-arms the timer all the time, mostly with the same deadline.
+  if (deadline_ms == timer_deadline_ms_ && timeout_ms != 0) {
+    return kOk;
+  }
+
+  // An all-zero expiration disarms a timerfd, so "now" is 1ns from now.
+  struct itimerspec spec = {};
+  if (timeout_ms == 0) {
+    spec.it_value.tv_nsec = 1;
+  } else if (timeout_ms > 0) {
+    spec.it_value.tv_sec = timeout_ms / 1000;
+    spec.it_value.tv_nsec = (timeout_ms % 1000) * 1000000;
+  }
+  if (timerfd_settime(timer_fd_, 0, &spec, nullptr) != 0) {
+    return ErrnoError("timerfd_settime");
+  }
+  timer_deadline_ms_ = deadline_ms;
+  return kOk;
+}
+
+Error EasyCurlEpoll::RunOnce(int timeout_ms) {
+  RETURN_NOT_OK(ApplySocketChanges());
+  struct epoll_event events[kMaxEvents];
+  int n = epoll_wait(epoll_fd_, events, kMaxEvents, timeout_ms);
+  if (n < 0) {
+    return errno == EINTR ? Error(kOk) : ErrnoError("epoll_wait");
+  }
+  dispatching_ = true;
+  auto error = DispatchEvents(events, n);
+  dispatching_ = false;
+  // Before returning, as the sockets curl added may be what makes fd()
+  // readable next.
+  auto apply_error = ApplySocketChanges();
+  return error.code != kOk ? error : apply_error;
+}
+
+Error EasyCurlEpoll::DispatchEvents(const struct epoll_event* events, int n) {
+  for (int i = 0; i < n; i++) {
+    int fd = events[i].data.fd;
+    if (fd == timer_fd_) {
+      uint64_t expirations;
+      // The timer may have been re-armed since it fired, in which case
+      // there is nothing to read, and nothing to do yet.
+      if (read(timer_fd_, &expirations, sizeof(expirations)) > 0) {
+        timer_deadline_ms_ = -1;
+        RETURN_NOT_OK(multi_->OnTimeout());
+      }
+      continue;
+    }
+    // An earlier event of this batch may have made curl drop the socket.
+    auto it = sockets_.find(fd);
+    if (it == sockets_.end() || it->second.events == 0) {
+      continue;
+    }
+    int ready = 0;
+    if (events[i].events & EPOLLIN) {
+      ready |= kRead;
+    }
+    if (events[i].events & EPOLLOUT) {
+      ready |= kWrite;
+    }
+    if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+      ready |= kError;
+    }
+    RETURN_NOT_OK(multi_->OnSocketReady(fd, ready));
+  }
+  return kOk;
+}
+
+Error EasyCurlEpoll::Run() {
+  while (multi_->num_transfers() > 0) {
+    auto error = RunOnce(1000);
+    if (error.code != kOk) {
+      return error;
+    }
+  }
+  return kOk;
+}
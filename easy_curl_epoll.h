@@ -0,0 +1,105 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_EPOLL_H
+#define EASY_CURL_EPOLL_H
+
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "easy_curl.h"
+#include "easy_curl_multi.h"
+
+// Drives the transfers of an EasyCurlMulti with epoll, on Linux.
+//
+// The sockets of the transfers and a timerfd for their timeouts are
+// watched by an epoll instance of their own. Its descriptor, fd(), becomes
+// readable whenever there is something to do, so it can be added to the
+// epoll set (or poll/select loop) of an existing reactor, which then calls
+// RunOnce(0) whenever it is readable:
+//
+//   EasyCurlMulti multi;
+//   EasyCurlEpoll curl_loop(&multi);
+//   reactor.AddReadable(curl_loop.fd(), [&]() { curl_loop.RunOnce(0); });
+//   multi.AddFetch(...);
+//
+// Alternatively, RunOnce() and Run() wait for events themselves.
+//
+// Like EasyCurlMulti, this is not thread-safe.
+class EasyCurlEpoll : public EasyCurlEventLoop {
+ public:
+  // Becomes the event loop of 'multi', which must have no transfer in
+  // flight and outlive this instance.
+  explicit EasyCurlEpoll(EasyCurlMulti* multi);
+  ~EasyCurlEpoll() override;
+
+  EasyCurlEpoll(const EasyCurlEpoll& that) = delete;
+  EasyCurlEpoll& operator=(const EasyCurlEpoll& that) = delete;
+
+  // The epoll descriptor, readable whenever RunOnce() has events to
+  // dispatch.
+  int fd() const {
+    return epoll_fd_;
+  }
+
+  // Wait at most 'timeout_ms' for events, 0 not to wait at all, and hand
+  // them to the multi handle.
+  Error RunOnce(int timeout_ms);
+
+  // Call RunOnce() until the multi handle has no transfer in flight.
+  Error Run();
+
+  Error WatchSocket(int fd, int events) override;
+  Error SetTimer(int64_t timeout_ms) override;
+
+ private:
+  static const constexpr int kMaxEvents = 64;
+
+  // Bring the epoll set in line with 'sockets_'.
+  Error ApplySocketChanges();
+
+  // Hand the 'n' events of 'events' to the multi handle.
+  Error DispatchEvents(const struct epoll_event* events, int n);
+
+  EasyCurlMulti* const multi_;
+
+  int epoll_fd_;
+  int timer_fd_;
+
+  // The events each socket is to be watched for, and those it is watched
+  // for in the epoll set. curl often changes its mind about a socket
+  // several times while handling one event, e.g. when a transfer completes
+  // and the next one starts on the same connection, so while RunOnce()
+  // dispatches events, the epoll set is only updated once done. Changes
+  // made otherwise, e.g. by EasyCurlMulti::AddFetch(), are applied right
+  // away: a reactor only calls RunOnce() again once fd() is readable, which
+  // may take the very sockets not watched yet.
+  struct Socket {
+    int events = 0;
+    int applied_events = 0;
+  };
+  std::unordered_map<int, Socket> sockets_;
+  std::vector<int> changed_sockets_;
+  bool dispatching_ = false;
+
+  // When the timer expires, in milliseconds of CLOCK_MONOTONIC, or -1 if
+  // disarmed.
+  int64_t timer_deadline_ms_ = -1;
+};
+
+#endif //EASY_CURL_EPOLL_H
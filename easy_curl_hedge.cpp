@@ -0,0 +1,215 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_hedge.h"
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <curl/curl.h>
+#include <cassert>
+
+EasyCurlHedger::EasyCurlHedger(RetryPolicy policy, InitCallback init)
+    : policy_(std::move(policy)),
+      hedge_delay_ms_(policy_.initial_hedge_delay_ms),
+      rng_(std::random_device()()) {
+  for (auto& curl : curls_) {
+    curl.reset(new EasyCurl());
+    if (init) {
+      init(curl.get());
+    }
+  }
+  stats_ = &curls_[0]->transfer_stats();
+  latencies_us_.reserve(kLatencyWindow);
+}
+
+EasyCurlHedger::~EasyCurlHedger() = default;
+
+Error EasyCurlHedger::FetchURL(const string& url,
+                               string* dst,
+                               const vector<string>& headers) {
+  assert(dst != nullptr);
+  counters_.requests++;
+  for (int attempt = 1; ; attempt++) {
+    auto error = RunAttempt(url, headers);
+    if (winner_ < 0) {
+      // The request couldn't even be started; retrying won't help.
+      stats_ = &curls_[0]->transfer_stats();
+      dst->clear();
+      return error;
+    }
+    const TransferStats& stats = curls_[winner_]->transfer_stats();
+    if (error.code == kOk ||
+        attempt >= policy_.max_attempts ||
+        !IsRetryable(error, stats)) {
+      // Hand over the body without copying it; 'dst' lends its capacity to
+      // the next request in return.
+      dst->swap(bodies_[winner_]);
+      stats_ = &stats;
+      return error;
+    }
+    counters_.retries++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(BackoffMs(attempt)));
+  }
+}
+
+Error EasyCurlHedger::RunAttempt(const string& url, const vector<string>& headers) {
+  using Clock = std::chrono::steady_clock;
+
+  // The outcome of each of the racing transfers. The callbacks below only
+  // run within this function: any transfer still in flight is cancelled
+  // before returning.
+  bool in_flight[2] = {false, false};
+  Error errors[2] = {Error(kOk), Error(kOk)};
+  int first_ok = -1;
+
+  auto start = [&](int i) {
+    counters_.attempts++;
+    auto done = [&, i](EasyCurl* /* curl */, const Error& error) {
+      in_flight[i] = false;
+      errors[i] = error;
+      if (error.code == kOk && first_ok < 0) {
+        first_ok = i;
+      }
+    };
+    auto error = multi_.AddFetch(curls_[i].get(), url, &bodies_[i], std::move(done), headers);
+    in_flight[i] = error.code == kOk;
+    return error;
+  };
+  auto cancel_in_flight = [&]() {
+    for (int i = 0; i < 2; i++) {
+      if (in_flight[i]) {
+        multi_.Cancel(curls_[i].get());
+      }
+    }
+  };
+
+  winner_ = -1;
+  auto error = start(0);
+  if (error.code != kOk) {
+    return error;
+  }
+  const auto start_time = Clock::now();
+  const auto hedge_time = start_time + std::chrono::milliseconds(hedge_delay_ms_);
+  bool hedge_pending = policy_.hedge && CanHedge();
+
+  // Drive the transfers until one succeeded or all of them failed, sending
+  // the backup request once the first one is late.
+  while (first_ok < 0 && multi_.num_transfers() > 0) {
+    int timeout_ms = 1000;
+    if (hedge_pending) {
+      auto now = Clock::now();
+      if (now >= hedge_time) {
+        hedge_pending = false;
+        counters_.hedges++;
+        // If the backup request can't be started, keep waiting for the
+        // first one.
+        start(1);
+        continue;
+      }
+      auto until_hedge = std::chrono::ceil<std::chrono::milliseconds>(hedge_time - now);
+      timeout_ms = std::min<int>(timeout_ms, static_cast<int>(until_hedge.count()));
+    }
+    error = multi_.Poll(timeout_ms);
+    if (error.code != kOk) {
+      cancel_in_flight();
+      return error;
+    }
+  }
+  // The loser is cancelled after Poll() rather than from the callback of
+  // the winner, while the multi handle is still reporting completions.
+  cancel_in_flight();
+
+  if (first_ok >= 0) {
+    winner_ = first_ok;
+    if (first_ok == 1) {
+      counters_.hedge_wins++;
+    }
+    RecordLatency(std::chrono::duration_cast<std::chrono::microseconds>(
+        Clock::now() - start_time).count());
+  } else {
+    // Everything failed: report the outcome of the first request.
+    winner_ = 0;
+  }
+  return errors[winner_];
+}
+
+bool EasyCurlHedger::IsRetryable(const Error& error, const TransferStats& stats) const {
+  switch (stats.curl_code) {
+    case CURLE_OK:
+    case CURLE_HTTP_RETURNED_ERROR:
+      // The server responded, which only calls for a retry if it asked for
+      // one.
+      return error.code != kOk &&
+          std::find(policy_.retryable_http_codes.begin(), policy_.retryable_http_codes.end(),
+                    stats.response_code) != policy_.retryable_http_codes.end();
+    case CURLE_COULDNT_CONNECT:
+    case CURLE_OPERATION_TIMEDOUT:
+    case CURLE_SEND_ERROR:
+    case CURLE_RECV_ERROR:
+    case CURLE_GOT_NOTHING:
+    case CURLE_PARTIAL_FILE:
+    case CURLE_HTTP2:
+    case CURLE_HTTP2_STREAM:
+      return true;
+    default:
+      // Anything else -- a malformed URL, a name which doesn't resolve, a
+      // certificate which doesn't verify, an aborted transfer -- would fail
+      // the same way again.
+      return false;
+  }
+}
+
+int64_t EasyCurlHedger::BackoffMs(int retry) {
+  int64_t cap = std::max<int64_t>(policy_.initial_backoff_ms, 0);
+  for (int i = 1; i < retry && cap < policy_.max_backoff_ms; i++) {
+    cap *= 2;
+  }
+  cap = std::min(cap, policy_.max_backoff_ms);
+  if (cap <= 0) {
+    return 0;
+  }
+  return std::uniform_int_distribution<int64_t>(0, cap)(rng_);
+}
+
+bool EasyCurlHedger::CanHedge() const {
+  return static_cast<double>(counters_.hedges) <
+      policy_.max_hedge_fraction * static_cast<double>(counters_.requests);
+}
+
+void EasyCurlHedger::RecordLatency(int64_t latency_us) {
+  if (latencies_us_.size() < kLatencyWindow) {
+    latencies_us_.push_back(latency_us);
+  } else {
+    latencies_us_[next_latency_] = latency_us;
+    next_latency_ = (next_latency_ + 1) % kLatencyWindow;
+  }
+  if (++latencies_since_refresh_ < kHedgeDelayRefreshInterval) {
+    return;
+  }
+  latencies_since_refresh_ = 0;
+
+  std::vector<int64_t> sorted(latencies_us_);
+  double percentile = std::min(std::max(policy_.hedge_percentile, 0.0), 1.0);
+  auto nth = sorted.begin() + static_cast<ptrdiff_t>(percentile * (sorted.size() - 1));
+  std::nth_element(sorted.begin(), nth, sorted.end());
+  hedge_delay_ms_ = std::max(policy_.min_hedge_delay_ms, (*nth + 999) / 1000);
+}
@@ -0,0 +1,186 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_HEDGE_H
+#define EASY_CURL_HEDGE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "easy_curl.h"
+#include "easy_curl_multi.h"
+
+// How EasyCurlHedger retries and hedges requests.
+struct RetryPolicy {
+  // Total number of attempts of a request, including the first one. 1
+  // disables retries.
+  int max_attempts = 3;
+
+  // Retries wait for a random time between 0 and a cap starting at
+  // 'initial_backoff_ms' and doubling with every retry, up to
+  // 'max_backoff_ms' ("full jitter"), so that clients which failed together
+  // don't retry in lockstep.
+  int64_t initial_backoff_ms = 10;
+  int64_t max_backoff_ms = 1000;
+
+  // HTTP response codes which are retried as well, in addition to transient
+  // network failures.
+  std::vector<int> retryable_http_codes = {502, 503, 504};
+
+  // Whether to send a backup request when the first one hasn't completed
+  // after the 'hedge_percentile' latency of recent requests, and use
+  // whichever response arrives first.
+  bool hedge = false;
+
+  // Percentile of the recent request latencies after which to send the
+  // backup request, between 0 and 1.
+  double hedge_percentile = 0.95;
+
+  // Delay before the backup request until enough latencies were observed to
+  // derive it from 'hedge_percentile', and lower bound of the delay
+  // afterwards.
+  int64_t initial_hedge_delay_ms = 50;
+  int64_t min_hedge_delay_ms = 1;
+
+  // Maximum fraction of requests which get a backup request, bounding the
+  // extra load hedging puts on the servers when they are slow across the
+  // board.
+  double max_hedge_fraction = 0.1;
+};
+
+// Issues idempotent GET requests with retries and, optionally, hedging
+// according to a RetryPolicy, to cut the tail latency caused by the
+// occasional slow or failed transfer.
+//
+// Each attempt can race a backup request sent after a delay derived from
+// the latencies of recent requests: the first successful response wins and
+// the other transfer is cancelled. Failed attempts are retried with
+// jittered backoff, but only if they failed in a way which is likely to be
+// transient, such as a timeout, a refused or reset connection or an HTTP
+// 503.
+//
+// Example:
+//   RetryPolicy policy;
+//   policy.hedge = true;
+//   EasyCurlHedger hedger(policy, [](EasyCurl* curl) { curl->set_timeout_ms(200); });
+//   auto e = hedger.FetchURL(url, &resp);
+//
+// The hedger owns the two EasyCurl handles it races, configured by the
+// given callback. Like EasyCurl, this is not thread-safe.
+class EasyCurlHedger {
+ public:
+  // Invoked once on each handle the hedger creates.
+  typedef std::function<void(EasyCurl* curl)> InitCallback;
+
+  // Counts of what the hedger did since it was created.
+  struct Counters {
+    int64_t requests = 0;
+    // Transfers started, including retries and backup requests.
+    int64_t attempts = 0;
+    int64_t retries = 0;
+    int64_t hedges = 0;
+    // Requests answered by the backup request rather than the first one.
+    int64_t hedge_wins = 0;
+  };
+
+  explicit EasyCurlHedger(RetryPolicy policy, InitCallback init = nullptr);
+  ~EasyCurlHedger();
+
+  EasyCurlHedger(const EasyCurlHedger& that) = delete;
+  EasyCurlHedger& operator=(const EasyCurlHedger& that) = delete;
+
+  // Fetch the given URL into 'dst', as EasyCurl::FetchURL() does, retrying
+  // and hedging according to the policy. Returns the result of the last
+  // attempt.
+  Error FetchURL(const std::string& url,
+                 string* dst,
+                 const std::vector<std::string>& headers = {});
+
+  // Returns the details of the transfer which produced the result of the
+  // previous FetchURL().
+  const TransferStats& transfer_stats() const {
+    return *stats_;
+  }
+
+  // Returns the current delay before a backup request is sent.
+  int64_t hedge_delay_ms() const {
+    return hedge_delay_ms_;
+  }
+
+  const Counters& counters() const {
+    return counters_;
+  }
+
+ private:
+  // Number of recent latencies the hedge delay is derived from.
+  static const constexpr size_t kLatencyWindow = 256;
+
+  // Number of new latencies after which the hedge delay is recomputed.
+  static const constexpr size_t kHedgeDelayRefreshInterval = 16;
+
+  // Run one attempt of the request, racing a backup request if hedging is
+  // enabled. On return 'winner_' is the index of the handle whose result is
+  // returned.
+  Error RunAttempt(const std::string& url, const std::vector<std::string>& headers);
+
+  // Returns whether a request which completed with 'error' is worth
+  // retrying.
+  bool IsRetryable(const Error& error, const TransferStats& stats) const;
+
+  // Returns how long to wait before the given retry (1 for the first one).
+  int64_t BackoffMs(int retry);
+
+  // Whether the hedging budget allows one more backup request.
+  bool CanHedge() const;
+
+  // Add the latency of a successful request to the window.
+  void RecordLatency(int64_t latency_us);
+
+  const RetryPolicy policy_;
+
+  // The handles racing each other, the first one sending the initial
+  // request, and the buffers they receive into.
+  std::unique_ptr<EasyCurl> curls_[2];
+  string bodies_[2];
+
+  // Declared after the handles so it is destroyed first.
+  EasyCurlMulti multi_;
+
+  // Index of the handle whose result the previous attempt returned.
+  int winner_ = 0;
+
+  const TransferStats* stats_;
+
+  // Ring buffer of the latencies of recent successful requests, in
+  // microseconds.
+  std::vector<int64_t> latencies_us_;
+  size_t next_latency_ = 0;
+  size_t latencies_since_refresh_ = 0;
+
+  int64_t hedge_delay_ms_;
+
+  Counters counters_;
+
+  std::mt19937_64 rng_;
+};
+
+#endif //EASY_CURL_HEDGE_H
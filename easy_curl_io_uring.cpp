@@ -0,0 +1,255 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_io_uring.h"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+
+#include <poll.h>
+
+namespace {
+
+inline Error UringError(const char* what, int res) {
+  return Error(kIOError, string(what) + ": " + strerror(-res));
+}
+
+} // anonymous namespace
+
+#define RETURN_NOT_OK(expr)  { \
+    auto error = (expr); \
+    if (error.code != kOk) { \
+      return error; \
+    } \
+  }
+
+EasyCurlIoUring::EasyCurlIoUring(EasyCurlMulti* multi, unsigned queue_depth)
+    : multi_(multi) {
+  int res = io_uring_queue_init(queue_depth, &ring_, 0);
+  if (res < 0) {
+    cerr << "Could not create io_uring: " << strerror(-res);
+    exit(1);
+  }
+  auto error = multi_->set_event_loop(this);
+  if (error.code != kOk) {
+    cerr << "Could not drive EasyCurlMulti with io_uring: " << error.msg;
+    exit(1);
+  }
+}
+
+EasyCurlIoUring::~EasyCurlIoUring() {
+  multi_->set_event_loop(nullptr);
+  io_uring_queue_exit(&ring_);
+}
+
+Error EasyCurlIoUring::GetSqe(struct io_uring_sqe** sqe) {
+  *sqe = io_uring_get_sqe(&ring_);
+  if (*sqe == nullptr) {
+    int res = io_uring_submit(&ring_);
+    if (res < 0) {
+      return UringError("io_uring_submit", res);
+    }
+    *sqe = io_uring_get_sqe(&ring_);
+    if (*sqe == nullptr) {
+      return Error(kRuntimeError, "io_uring submission queue full");
+    }
+  }
+  return kOk;
+}
+
+Error EasyCurlIoUring::Arm(int fd, Watch* watch) {
+  struct io_uring_sqe* sqe;
+  RETURN_NOT_OK(GetSqe(&sqe));
+  unsigned mask = ((watch->events & kRead) ? POLLIN : 0) |
+      ((watch->events & kWrite) ? POLLOUT : 0);
+  io_uring_prep_poll_add(sqe, fd, mask);
+  io_uring_sqe_set_data64(sqe, PollData(fd, watch->generation));
+  watch->armed = true;
+  return kOk;
+}
+
+Error EasyCurlIoUring::WatchSocket(int fd, int events) {
+  RETURN_NOT_OK(QueueWatch(fd, events));
+  return SubmitQueued();
+}
+
+Error EasyCurlIoUring::SetTimer(int64_t timeout_ms) {
+  RETURN_NOT_OK(QueueTimer(timeout_ms));
+  return SubmitQueued();
+}
+
+Error EasyCurlIoUring::SubmitQueued() {
+  if (dispatching_ || io_uring_sq_ready(&ring_) == 0) {
+    return kOk;
+  }
+  int res = io_uring_submit(&ring_);
+  if (res < 0) {
+    return UringError("io_uring_submit", res);
+  }
+  return kOk;
+}
+
+Error EasyCurlIoUring::QueueWatch(int fd, int events) {
+  auto it = watches_.find(fd);
+  if (it != watches_.end() && it->second.events == events) {
+    return kOk;
+  }
+  if (it != watches_.end() && it->second.armed) {
+    // Its completion, with -ECANCELED or an outdated generation, is
+    // ignored.
+    struct io_uring_sqe* sqe;
+    RETURN_NOT_OK(GetSqe(&sqe));
+    io_uring_prep_poll_remove(sqe, PollData(fd, it->second.generation));
+    io_uring_sqe_set_data64(sqe, 0);
+  }
+  if (events == 0) {
+    if (it != watches_.end()) {
+      watches_.erase(it);
+    }
+    return kOk;
+  }
+  if (it == watches_.end()) {
+    it = watches_.emplace(fd, Watch{events, ++generation_, false}).first;
+  } else {
+    it->second.events = events;
+    it->second.generation = ++generation_;
+  }
+  return Arm(fd, &it->second);
+}
+
+Error EasyCurlIoUring::QueueTimer(int64_t timeout_ms) {
+  if (timer_armed_) {
+    struct io_uring_sqe* sqe;
+    RETURN_NOT_OK(GetSqe(&sqe));
+    io_uring_prep_timeout_remove(sqe, kTimerTag | timer_generation_, 0);
+    io_uring_sqe_set_data64(sqe, 0);
+    timer_armed_ = false;
+  }
+  timer_generation_ = ++generation_;
+  if (timeout_ms < 0) {
+    return kOk;
+  }
+  timer_spec_.tv_sec = timeout_ms / 1000;
+  timer_spec_.tv_nsec = (timeout_ms % 1000) * 1000000;
+  struct io_uring_sqe* sqe;
+  RETURN_NOT_OK(GetSqe(&sqe));
+  io_uring_prep_timeout(sqe, &timer_spec_, 0, 0);
+  io_uring_sqe_set_data64(sqe, kTimerTag | timer_generation_);
+  timer_armed_ = true;
+  return kOk;
+}
+
+Error EasyCurlIoUring::Dispatch(uint64_t data, int res) {
+  if (data == 0) {
+    // The completion of a removal.
+    return kOk;
+  }
+  if (data & kTimerTag) {
+    // A removed timeout completes with -ECANCELED, an expired one with
+    // -ETIME.
+    if (res != -ETIME || static_cast<uint32_t>(data) != timer_generation_ || !timer_armed_) {
+      return kOk;
+    }
+    timer_armed_ = false;
+    return multi_->OnTimeout();
+  }
+
+  int fd = static_cast<int>(static_cast<uint32_t>(data));
+  uint32_t generation = static_cast<uint32_t>(data >> 32);
+  auto it = watches_.find(fd);
+  if (it == watches_.end() || it->second.generation != generation) {
+    return kOk;
+  }
+  // Poll requests are one-shot.
+  it->second.armed = false;
+  if (res < 0) {
+    if (res == -ECANCELED) {
+      return kOk;
+    }
+    return UringError("io_uring poll", res);
+  }
+  int ready = 0;
+  if (res & POLLIN) {
+    ready |= kRead;
+  }
+  if (res & POLLOUT) {
+    ready |= kWrite;
+  }
+  if (res & (POLLERR | POLLHUP)) {
+    ready |= kError;
+  }
+  RETURN_NOT_OK(multi_->OnSocketReady(fd, ready));
+
+  // Keep watching the socket, unless curl changed or dropped the watch in
+  // the meantime, which armed a new request already.
+  it = watches_.find(fd);
+  if (it != watches_.end() && it->second.generation == generation && !it->second.armed) {
+    return Arm(fd, &it->second);
+  }
+  return kOk;
+}
+
+Error EasyCurlIoUring::RunOnce(int timeout_ms) {
+  struct io_uring_cqe* cqe;
+  int res;
+  if (timeout_ms == 0) {
+    res = io_uring_submit(&ring_);
+  } else {
+    struct __kernel_timespec ts;
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+    res = io_uring_submit_and_wait_timeout(&ring_, &cqe, 1, timeout_ms > 0 ? &ts : nullptr,
+                                           nullptr);
+  }
+  if (res < 0 && res != -ETIME && res != -EINTR) {
+    return UringError("io_uring_submit", res);
+  }
+
+  dispatching_ = true;
+  auto error = DispatchCompletions();
+  dispatching_ = false;
+  // Before returning, as the requests curl asked for may be what makes fd()
+  // readable next.
+  auto submit_error = SubmitQueued();
+  return error.code != kOk ? error : submit_error;
+}
+
+Error EasyCurlIoUring::DispatchCompletions() {
+  // Dispatching queues new requests, but doesn't reap completions, so the
+  // completion queue can be drained as we go.
+  struct io_uring_cqe* cqe;
+  while (io_uring_peek_cqe(&ring_, &cqe) == 0) {
+    uint64_t data = io_uring_cqe_get_data64(cqe);
+    int cqe_res = cqe->res;
+    io_uring_cqe_seen(&ring_, cqe);
+    RETURN_NOT_OK(Dispatch(data, cqe_res));
+  }
+  return kOk;
+}
+
+Error EasyCurlIoUring::Run() {
+  while (multi_->num_transfers() > 0) {
+    auto error = RunOnce(1000);
+    if (error.code != kOk) {
+      return error;
+    }
+  }
+  return kOk;
+}
@@ -0,0 +1,130 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_IO_URING_H
+#define EASY_CURL_IO_URING_H
+
+#include <cstdint>
+#include <unordered_map>
+
+#include <liburing.h>
+
+#include "easy_curl.h"
+#include "easy_curl_multi.h"
+
+// Drives the transfers of an EasyCurlMulti with io_uring, on Linux. Only
+// built with -DEASY_CURL_IO_URING=ON, as it needs liburing 2.2 or later.
+//
+// Socket readiness is watched with poll requests, and the timeouts of the
+// transfers with a timeout request, on a ring of its own. Like with
+// EasyCurlEpoll, the ring descriptor, fd(), can be watched by an existing
+// reactor, which calls RunOnce(0) whenever it is readable:
+//
+//   EasyCurlMulti multi;
+//   EasyCurlIoUring curl_loop(&multi);
+//   reactor.AddReadable(curl_loop.fd(), [&]() { curl_loop.RunOnce(0); });
+//
+// Requests curl asks for while RunOnce() dispatches completions are queued
+// on the ring, and submitted in bulk before it returns, so an iteration of
+// the loop takes the same system calls however many sockets changed.
+// Requests asked for otherwise, e.g. by EasyCurlMulti::AddFetch(), are
+// submitted right away: a reactor only calls RunOnce() again once fd() is
+// readable, which needs them submitted.
+//
+// Like EasyCurlMulti, this is not thread-safe.
+class EasyCurlIoUring : public EasyCurlEventLoop {
+ public:
+  // Becomes the event loop of 'multi', which must have no transfer in
+  // flight and outlive this instance.
+  explicit EasyCurlIoUring(EasyCurlMulti* multi, unsigned queue_depth = 256);
+  ~EasyCurlIoUring() override;
+
+  EasyCurlIoUring(const EasyCurlIoUring& that) = delete;
+  EasyCurlIoUring& operator=(const EasyCurlIoUring& that) = delete;
+
+  // The ring descriptor, readable whenever completions are pending.
+  int fd() const {
+    return ring_.ring_fd;
+  }
+
+  // Submit the queued requests, wait at most 'timeout_ms' for completions,
+  // 0 not to wait at all, and hand them to the multi handle.
+  Error RunOnce(int timeout_ms);
+
+  // Call RunOnce() until the multi handle has no transfer in flight.
+  Error Run();
+
+  Error WatchSocket(int fd, int events) override;
+  Error SetTimer(int64_t timeout_ms) override;
+
+ private:
+  // Tags the user data of timeout requests; the user data of poll requests
+  // is the socket and the generation of its watch.
+  static const constexpr uint64_t kTimerTag = 1ULL << 63;
+
+  struct Watch {
+    int events;
+    // Renewed whenever the watch changes, so completions of requests for
+    // earlier versions of it, or earlier watches of the same descriptor,
+    // can be told apart and ignored.
+    uint32_t generation;
+    // Whether a poll request for the current generation is outstanding.
+    bool armed;
+  };
+
+  static uint64_t PollData(int fd, uint32_t generation) {
+    return (static_cast<uint64_t>(generation) << 32) | static_cast<uint32_t>(fd);
+  }
+
+  // Returns a submission queue entry, flushing the queue if it is full.
+  Error GetSqe(struct io_uring_sqe** sqe);
+
+  // Queue a poll request for the current generation of the watch of 'fd'.
+  Error Arm(int fd, Watch* watch);
+
+  // Hand a completion to the multi handle.
+  Error Dispatch(uint64_t data, int res);
+
+  // Hand all the completions pending to the multi handle.
+  Error DispatchCompletions();
+
+  // The bodies of WatchSocket() and SetTimer(), queuing their requests.
+  Error QueueWatch(int fd, int events);
+  Error QueueTimer(int64_t timeout_ms);
+
+  // Submit the queued requests, unless completions are being dispatched.
+  Error SubmitQueued();
+
+  EasyCurlMulti* const multi_;
+
+  struct io_uring ring_;
+
+  std::unordered_map<int, Watch> watches_;
+
+  // Source of the generations of the watches and of the timer.
+  uint32_t generation_ = 0;
+
+  // The timeout request, if outstanding, and the timespec it refers to,
+  // which must stay valid until it is submitted.
+  uint32_t timer_generation_ = 0;
+  bool timer_armed_ = false;
+
+  bool dispatching_ = false;
+  struct __kernel_timespec timer_spec_ = {};
+};
+
+#endif //EASY_CURL_IO_URING_H
@@ -0,0 +1,199 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_limiter.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+} // anonymous namespace
+
+struct LimiterHost {
+  std::string name;
+
+  // The token bucket, as the time at which it would be full again, in
+  // nanoseconds of the steady clock: each request pushes it 'interval_ns'
+  // further, and a request may start unless that puts it more than
+  // 'tolerance_ns' into the future. No rate limit if 'interval_ns' is 0.
+  std::atomic<int64_t> full_at_ns{0};
+  std::atomic<int64_t> interval_ns{0};
+  std::atomic<int64_t> tolerance_ns{0};
+
+  std::atomic<int> in_flight{0};
+  std::atomic<double> concurrency_limit{0};
+  std::atomic<int64_t> last_backoff_ns{0};
+
+  std::atomic<int64_t> acquired{0};
+  std::atomic<int64_t> rate_limited{0};
+  std::atomic<int64_t> concurrency_limited{0};
+  std::atomic<int64_t> backoffs{0};
+};
+
+EasyCurlLimiter::EasyCurlLimiter(LimiterOptions options)
+    : options_(std::move(options)) {
+}
+
+EasyCurlLimiter::~EasyCurlLimiter() = default;
+
+void EasyCurlLimiter::SetRate(LimiterHost* host, double requests_per_sec, double burst) {
+  int64_t interval_ns = requests_per_sec > 0 ? static_cast<int64_t>(1e9 / requests_per_sec) : 0;
+  host->interval_ns.store(interval_ns, std::memory_order_relaxed);
+  host->tolerance_ns.store(
+      static_cast<int64_t>(std::max(burst - 1, 0.0) * interval_ns), std::memory_order_relaxed);
+}
+
+void EasyCurlLimiter::set_host_rate(string_view host, double requests_per_sec, double burst) {
+  SetRate(FindHost(host), requests_per_sec, burst);
+}
+
+LimiterHost* EasyCurlLimiter::FindHost(string_view host) {
+  // Reused so that looking up a host doesn't allocate.
+  thread_local string key;
+  key.assign(host.data(), host.size());
+  {
+    std::shared_lock<std::shared_mutex> l(hosts_lock_);
+    auto it = hosts_.find(key);
+    if (it != hosts_.end()) {
+      return it->second.get();
+    }
+  }
+  std::lock_guard<std::shared_mutex> l(hosts_lock_);
+  auto& slot = hosts_[key];
+  if (!slot) {
+    slot.reset(new LimiterHost());
+    slot->name = key;
+    SetRate(slot.get(), options_.requests_per_sec, options_.burst);
+    slot->concurrency_limit.store(options_.initial_concurrency, std::memory_order_relaxed);
+  }
+  return slot.get();
+}
+
+int64_t EasyCurlLimiter::TryAcquire(LimiterHost* host) {
+  // The concurrency limit goes first, so a request turned down by it doesn't
+  // use up the rate.
+  int in_flight = host->in_flight.fetch_add(1, std::memory_order_acq_rel);
+  if (options_.adaptive_concurrency &&
+      in_flight >= static_cast<int>(host->concurrency_limit.load(std::memory_order_relaxed))) {
+    host->in_flight.fetch_sub(1, std::memory_order_acq_rel);
+    host->concurrency_limited.fetch_add(1, std::memory_order_relaxed);
+    return kWaitForRelease;
+  }
+
+  int64_t interval_ns = host->interval_ns.load(std::memory_order_relaxed);
+  if (interval_ns > 0) {
+    int64_t tolerance_ns = host->tolerance_ns.load(std::memory_order_relaxed);
+    int64_t now_ns = NowNs();
+    int64_t full_at_ns = host->full_at_ns.load(std::memory_order_relaxed);
+    while (true) {
+      int64_t start_ns = std::max(full_at_ns, now_ns);
+      if (start_ns - now_ns > tolerance_ns) {
+        host->in_flight.fetch_sub(1, std::memory_order_acq_rel);
+        host->rate_limited.fetch_add(1, std::memory_order_relaxed);
+        // Rounded up, so that waiting as long is enough.
+        return (start_ns - tolerance_ns - now_ns + 999) / 1000;
+      }
+      if (host->full_at_ns.compare_exchange_weak(full_at_ns, start_ns + interval_ns,
+                                                 std::memory_order_relaxed)) {
+        break;
+      }
+    }
+  }
+  host->acquired.fetch_add(1, std::memory_order_relaxed);
+  return 0;
+}
+
+void EasyCurlLimiter::Release(LimiterHost* host, const Error& error, int response_code) {
+  host->in_flight.fetch_sub(1, std::memory_order_acq_rel);
+
+  if (options_.adaptive_concurrency) {
+    bool overloaded = error.code == kTimedOut || response_code == 429 || response_code == 503;
+    if (overloaded) {
+      int64_t now_ns = NowNs();
+      int64_t last_ns = host->last_backoff_ns.load(std::memory_order_relaxed);
+      if (now_ns - last_ns >= options_.backoff_interval_ms * 1000000 &&
+          host->last_backoff_ns.compare_exchange_strong(last_ns, now_ns,
+                                                        std::memory_order_relaxed)) {
+        double limit = host->concurrency_limit.load(std::memory_order_relaxed);
+        double cut;
+        do {
+          cut = std::max<double>(options_.min_concurrency, limit * options_.backoff);
+        } while (!host->concurrency_limit.compare_exchange_weak(limit, cut,
+                                                                std::memory_order_relaxed));
+        if (cut < limit) {
+          host->backoffs.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+    } else if (error.code == kOk) {
+      double limit = host->concurrency_limit.load(std::memory_order_relaxed);
+      while (!host->concurrency_limit.compare_exchange_weak(
+                 limit, std::min<double>(options_.max_concurrency, limit + 1 / limit),
+                 std::memory_order_relaxed)) {
+      }
+    }
+  }
+
+  num_releases_.fetch_add(1);
+  if (num_waiters_.load() > 0) {
+    // Under the lock, so a waiter which hasn't seen the release yet is
+    // asleep by now.
+    std::lock_guard<std::mutex> l(release_lock_);
+    release_cond_.notify_all();
+  }
+}
+
+void EasyCurlLimiter::WaitForRelease(uint64_t num_releases, int64_t timeout_us) {
+  std::unique_lock<std::mutex> l(release_lock_);
+  num_waiters_.fetch_add(1);
+  release_cond_.wait_for(l, std::chrono::microseconds(timeout_us),
+                         [&]() { return num_releases_.load() != num_releases; });
+  num_waiters_.fetch_sub(1);
+}
+
+vector<EasyCurlLimiter::HostStats> EasyCurlLimiter::host_stats() const {
+  vector<HostStats> stats;
+  std::shared_lock<std::shared_mutex> l(hosts_lock_);
+  for (const auto& entry : hosts_) {
+    const LimiterHost& host = *entry.second;
+    HostStats s;
+    s.host = host.name;
+    if (options_.adaptive_concurrency) {
+      s.concurrency_limit = host.concurrency_limit.load(std::memory_order_relaxed);
+    }
+    s.in_flight = host.in_flight.load(std::memory_order_relaxed);
+    s.acquired = host.acquired.load(std::memory_order_relaxed);
+    s.rate_limited = host.rate_limited.load(std::memory_order_relaxed);
+    s.concurrency_limited = host.concurrency_limited.load(std::memory_order_relaxed);
+    s.backoffs = host.backoffs.load(std::memory_order_relaxed);
+    stats.emplace_back(std::move(s));
+  }
+  std::sort(stats.begin(), stats.end(),
+            [](const HostStats& a, const HostStats& b) { return a.host < b.host; });
+  return stats;
+}
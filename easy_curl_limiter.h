@@ -0,0 +1,163 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_LIMITER_H
+#define EASY_CURL_LIMITER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "easy_curl.h"
+
+// The state an EasyCurlLimiter keeps for one host, see
+// EasyCurlLimiter::FindHost().
+struct LimiterHost;
+
+struct LimiterOptions {
+  // Requests started per second to each host, or 0 for no limit. See
+  // EasyCurlLimiter::set_host_rate() for limits of individual hosts.
+  double requests_per_sec = 0;
+
+  // How many requests may start back to back after an idle spell, before
+  // they are spaced out to the rate above.
+  double burst = 1;
+
+  // Whether to limit the requests in flight to each host to what it keeps
+  // up with. The limit starts at 'initial_concurrency' and grows by one for
+  // every 'limit' requests which succeed. It is cut by 'backoff' when a
+  // request times out or gets HTTP 429 or 503, at most once per
+  // 'backoff_interval_ms' so a burst of failures counts once.
+  bool adaptive_concurrency = false;
+  int initial_concurrency = 16;
+  int min_concurrency = 1;
+  int max_concurrency = 256;
+  double backoff = 0.5;
+  int64_t backoff_interval_ms = 100;
+};
+
+// Keeps the requests to each host (see EasyCurl::HostKey()) under a rate,
+// e.g. a QPS quota, and optionally under a concurrency limit which adapts to
+// how the host copes, backing off when it times out or sheds load.
+//
+// Attach it to EasyCurl instances with EasyCurl::set_limiter(). Blocking
+// requests then wait until the limiter lets them start; requests of an
+// EasyCurlMulti wait in its queue instead, see
+// EasyCurlMulti::set_max_transfers().
+//
+// Example:
+//   LimiterOptions options;
+//   options.requests_per_sec = 100;
+//   options.adaptive_concurrency = true;
+//   EasyCurlLimiter limiter(options);
+//   EasyCurlPool pool(32, [&](EasyCurl* curl) { curl->set_limiter(&limiter); });
+//
+// The rate is a token bucket kept as the time it is next due, updated with a
+// compare-and-swap, and the concurrency limit is a counter, so TryAcquire()
+// and Release() take no lock. FindHost() takes a shared one: EasyCurl looks
+// the host up once per request, or not at all while it keeps requesting the
+// same host.
+//
+// This class is thread-safe.
+class EasyCurlLimiter {
+ public:
+  // Returned by TryAcquire() when the host is at its concurrency limit.
+  static const constexpr int64_t kWaitForRelease = -1;
+
+  explicit EasyCurlLimiter(LimiterOptions options = LimiterOptions());
+  ~EasyCurlLimiter();
+
+  EasyCurlLimiter(const EasyCurlLimiter& that) = delete;
+  EasyCurlLimiter& operator=(const EasyCurlLimiter& that) = delete;
+
+  // Limit the requests to 'host', e.g. "api.example.com:443", to
+  // 'requests_per_sec', or not at all if 0, rather than to the rate of the
+  // options.
+  void set_host_rate(std::string_view host, double requests_per_sec, double burst = 1);
+
+  // Returns the state of 'host', created on first use, to pass to
+  // TryAcquire() and Release(). It stays valid for as long as the limiter.
+  LimiterHost* FindHost(std::string_view host);
+
+  // Take the permission to start a request to 'host'. Returns 0 if taken,
+  // in which case Release() must be called once the request completes.
+  // Otherwise returns how many microseconds until the rate allows a
+  // request, or kWaitForRelease if some request to the host must complete
+  // first.
+  int64_t TryAcquire(LimiterHost* host);
+
+  // Report the outcome of a request which TryAcquire() let start. Successes
+  // grow the concurrency limit; kTimedOut and HTTP 429 and 503 shrink it;
+  // other errors, e.g. kAborted for a request which didn't start after all,
+  // leave it alone.
+  void Release(LimiterHost* host, const Error& error, int response_code);
+
+  // The number of Release() calls so far. Take it before TryAcquire(), and
+  // pass it to WaitForRelease() if that returns kWaitForRelease, so that a
+  // release in between isn't missed.
+  uint64_t num_releases() const {
+    return num_releases_.load();
+  }
+
+  // Wait until some request is released after num_releases() returned
+  // 'num_releases', or for at most 'timeout_us'.
+  void WaitForRelease(uint64_t num_releases, int64_t timeout_us);
+
+  struct HostStats {
+    std::string host;
+    // The current concurrency limit, or 0 if not adaptive.
+    double concurrency_limit = 0;
+    int in_flight = 0;
+    // Requests let start, and calls of TryAcquire() turned down because of
+    // the rate and because of the concurrency limit.
+    int64_t acquired = 0;
+    int64_t rate_limited = 0;
+    int64_t concurrency_limited = 0;
+    // Times the concurrency limit was cut.
+    int64_t backoffs = 0;
+  };
+
+  // Returns the state of all the hosts requested so far.
+  std::vector<HostStats> host_stats() const;
+
+ private:
+  // Sets the rate limit of 'host'.
+  static void SetRate(LimiterHost* host, double requests_per_sec, double burst);
+
+  const LimiterOptions options_;
+
+  mutable std::shared_mutex hosts_lock_;
+  // The hosts are never removed, so the pointers stay valid.
+  std::unordered_map<std::string, std::unique_ptr<LimiterHost>> hosts_;
+
+  // Release() only takes 'release_lock_' while some thread waits. Both
+  // counters are sequentially consistent: a waiter either sees the release
+  // or is seen by it.
+  std::atomic<uint64_t> num_releases_{0};
+  std::atomic<int> num_waiters_{0};
+  std::mutex release_lock_;
+  std::condition_variable release_cond_;
+};
+
+#endif //EASY_CURL_LIMITER_H
@@ -0,0 +1,287 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+namespace {
+
+std::atomic<uint64_t> next_registry_id(1);
+
+// Bumped whenever a registry is destroyed, for threads to drop their shards
+// of it from their map the next time they look one up.
+std::atomic<uint64_t> num_registries_destroyed(0);
+
+// The ids of the registries alive. Never destroyed, so registries with
+// static storage duration can use it in any order.
+struct LiveRegistries {
+  std::mutex lock;
+  std::unordered_set<uint64_t> ids;
+};
+
+LiveRegistries* live_registries() {
+  static auto* live = new LiveRegistries();
+  return live;
+}
+
+// Counters are only ever written by the thread owning them, so a plain
+// load and store is enough and avoids the cost of an atomic increment.
+inline void Add(std::atomic<uint64_t>* counter, uint64_t delta) {
+  counter->store(counter->load(std::memory_order_relaxed) + delta, std::memory_order_relaxed);
+}
+
+} // anonymous namespace
+
+// The counters of one thread for one (host, status class) pair.
+struct EasyCurlMetrics::Cell {
+  std::string host;
+  int status_class;
+
+  std::atomic<uint64_t> num_transfers{0};
+  std::atomic<uint64_t> num_connects{0};
+  std::atomic<uint64_t> bytes_uploaded{0};
+  std::atomic<uint64_t> bytes_downloaded{0};
+  std::atomic<uint64_t> bytes_decoded{0};
+  std::atomic<uint64_t> num_queued{0};
+  std::atomic<uint64_t> queue_us{0};
+  std::atomic<uint64_t> num_cancelled{0};
+  std::atomic<uint64_t> latency_buckets[kNumLatencyBuckets] = {};
+};
+
+// The counters of one thread.
+struct EasyCurlMetrics::ThreadShard {
+  // Protects the structure of 'cells' against concurrent readers. The
+  // owning thread, being the only writer, only takes it to insert.
+  std::mutex lock;
+  // Keyed by host, a NUL byte and the status class digit.
+  std::unordered_map<std::string, std::unique_ptr<Cell>> cells;
+
+  std::atomic<uint64_t> errors[kNumErrorCodes] = {};
+
+  // Scratch space to build lookup keys in without allocating.
+  std::string key_buf;
+  std::string host_buf;
+
+  // The cell updated last, skipping the lookup when a thread keeps talking
+  // to the same host.
+  Cell* last_cell = nullptr;
+};
+
+EasyCurlMetrics::EasyCurlMetrics()
+    : id_(next_registry_id.fetch_add(1, std::memory_order_relaxed)) {
+  LiveRegistries* live = live_registries();
+  std::lock_guard<std::mutex> l(live->lock);
+  live->ids.insert(id_);
+}
+
+EasyCurlMetrics::~EasyCurlMetrics() {
+  LiveRegistries* live = live_registries();
+  {
+    std::lock_guard<std::mutex> l(live->lock);
+    live->ids.erase(id_);
+  }
+  num_registries_destroyed.fetch_add(1, std::memory_order_release);
+}
+
+int EasyCurlMetrics::LatencyBucket(int64_t us) {
+  if (us < 16) {
+    return us < 0 ? 0 : static_cast<int>(us);
+  }
+  int msb = 63 - __builtin_clzll(static_cast<uint64_t>(us));
+  int bucket = 16 + (msb - 4) * 8 + static_cast<int>((us >> (msb - 3)) & 7);
+  return std::min(bucket, kNumLatencyBuckets - 1);
+}
+
+int64_t EasyCurlMetrics::LatencyBucketUpperBound(int bucket) {
+  if (bucket < 16) {
+    return bucket;
+  }
+  int msb = (bucket - 16) / 8 + 4;
+  int64_t sub = (bucket - 16) % 8;
+  return ((8 + sub + 1) << (msb - 3)) - 1;
+}
+
+int64_t EasyCurlMetrics::HostMetrics::LatencyPercentileUs(double percentile) const {
+  uint64_t total = 0;
+  for (auto count : latency_buckets) {
+    total += count;
+  }
+  if (total == 0) {
+    return 0;
+  }
+  auto rank = static_cast<uint64_t>(percentile / 100 * static_cast<double>(total));
+  rank = std::max<uint64_t>(1, std::min(rank, total));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < latency_buckets.size(); i++) {
+    seen += latency_buckets[i];
+    if (seen >= rank) {
+      return LatencyBucketUpperBound(static_cast<int>(i));
+    }
+  }
+  return LatencyBucketUpperBound(kNumLatencyBuckets - 1);
+}
+
+EasyCurlMetrics::ThreadShard* EasyCurlMetrics::GetThreadShard() {
+  // Registries are identified by id rather than by address, so a registry
+  // created where a destroyed one used to live doesn't pick up its shards.
+  struct ThreadState {
+    uint64_t last_id = 0;
+    ThreadShard* last_shard = nullptr;
+    std::unordered_map<uint64_t, ThreadShard*> shards_by_registry;
+    // The value of 'num_registries_destroyed' 'shards_by_registry' was last
+    // pruned at.
+    uint64_t num_destroyed = 0;
+  };
+  thread_local ThreadState state;
+  if (state.last_id == id_) {
+    return state.last_shard;
+  }
+  auto& shards_by_registry = state.shards_by_registry;
+  uint64_t num_destroyed = num_registries_destroyed.load(std::memory_order_acquire);
+  if (state.num_destroyed != num_destroyed) {
+    // The shards of destroyed registries are gone with them; only the
+    // entries pointing to them are left to drop.
+    state.num_destroyed = num_destroyed;
+    LiveRegistries* live = live_registries();
+    std::lock_guard<std::mutex> l(live->lock);
+    for (auto entry = shards_by_registry.begin(); entry != shards_by_registry.end();) {
+      if (live->ids.count(entry->first) == 0) {
+        entry = shards_by_registry.erase(entry);
+      } else {
+        ++entry;
+      }
+    }
+  }
+  auto it = shards_by_registry.find(id_);
+  if (it != shards_by_registry.end()) {
+    state.last_id = id_;
+    state.last_shard = it->second;
+    return it->second;
+  }
+  std::unique_ptr<ThreadShard> shard(new ThreadShard());
+  ThreadShard* ret = shard.get();
+  {
+    std::lock_guard<std::mutex> l(shards_lock_);
+    shards_.emplace_back(std::move(shard));
+  }
+  shards_by_registry.emplace(id_, ret);
+  state.last_id = id_;
+  state.last_shard = ret;
+  return ret;
+}
+
+EasyCurlMetrics::Cell* EasyCurlMetrics::FindOrCreateCell(ThreadShard* shard,
+                                                          std::string_view host,
+                                                          int status_class) {
+  shard->key_buf.assign(host.data(), host.size());
+  shard->key_buf.push_back('\0');
+  shard->key_buf.push_back(static_cast<char>('0' + status_class % 10));
+  auto it = shard->cells.find(shard->key_buf);
+  if (it != shard->cells.end()) {
+    return it->second.get();
+  }
+
+  std::unique_ptr<Cell> cell(new Cell());
+  cell->host.assign(host.data(), host.size());
+  cell->status_class = status_class;
+  Cell* ret = cell.get();
+  std::lock_guard<std::mutex> l(shard->lock);
+  shard->cells.emplace(shard->key_buf, std::move(cell));
+  return ret;
+}
+
+void EasyCurlMetrics::Record(const TransferStats& stats, const Error& error) {
+  ThreadShard* shard = GetThreadShard();
+  int code = error.code >= 0 && error.code < kNumErrorCodes ? error.code : kRuntimeError;
+  Add(&shard->errors[code], 1);
+
+  EasyCurl::HostKey(stats.effective_url, &shard->host_buf);
+  const std::string& host = shard->host_buf;
+  int status_class = stats.response_code / 100;
+  Cell* cell = shard->last_cell;
+  if (cell == nullptr || cell->status_class != status_class || cell->host != host) {
+    cell = FindOrCreateCell(shard, host, status_class);
+    shard->last_cell = cell;
+  }
+
+  Add(&cell->num_transfers, 1);
+  Add(&cell->num_connects, static_cast<uint64_t>(std::max(stats.num_connects, 0)));
+  Add(&cell->bytes_uploaded, static_cast<uint64_t>(std::max<int64_t>(stats.bytes_uploaded, 0)));
+  Add(&cell->bytes_downloaded,
+      static_cast<uint64_t>(std::max<int64_t>(stats.bytes_downloaded, 0)));
+  Add(&cell->bytes_decoded, static_cast<uint64_t>(std::max<int64_t>(stats.bytes_decoded, 0)));
+  if (stats.queue_us > 0) {
+    Add(&cell->num_queued, 1);
+    Add(&cell->queue_us, static_cast<uint64_t>(stats.queue_us));
+  }
+  if (error.code == kAborted) {
+    Add(&cell->num_cancelled, 1);
+  }
+  Add(&cell->latency_buckets[LatencyBucket(stats.total_us)], 1);
+}
+
+EasyCurlMetrics::Snapshot EasyCurlMetrics::GetSnapshot() const {
+  Snapshot snapshot;
+  std::map<std::pair<std::string, int>, HostMetrics> hosts;
+
+  std::lock_guard<std::mutex> l(shards_lock_);
+  for (const auto& shard : shards_) {
+    for (int i = 0; i < kNumErrorCodes; i++) {
+      snapshot.errors[i] += shard->errors[i].load(std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> shard_lock(shard->lock);
+    for (const auto& entry : shard->cells) {
+      const Cell& cell = *entry.second;
+      HostMetrics& m = hosts[std::make_pair(cell.host, cell.status_class)];
+      if (m.latency_buckets.empty()) {
+        m.host = cell.host;
+        m.status_class = cell.status_class;
+        m.latency_buckets.resize(kNumLatencyBuckets);
+      }
+      m.num_transfers += cell.num_transfers.load(std::memory_order_relaxed);
+      m.num_connects += cell.num_connects.load(std::memory_order_relaxed);
+      m.bytes_uploaded += cell.bytes_uploaded.load(std::memory_order_relaxed);
+      m.bytes_downloaded += cell.bytes_downloaded.load(std::memory_order_relaxed);
+      m.bytes_decoded += cell.bytes_decoded.load(std::memory_order_relaxed);
+      m.num_queued += cell.num_queued.load(std::memory_order_relaxed);
+      m.queue_us += cell.queue_us.load(std::memory_order_relaxed);
+      m.num_cancelled += cell.num_cancelled.load(std::memory_order_relaxed);
+      for (int i = 0; i < kNumLatencyBuckets; i++) {
+        m.latency_buckets[i] += cell.latency_buckets[i].load(std::memory_order_relaxed);
+      }
+    }
+  }
+
+  for (auto& entry : hosts) {
+    snapshot.num_transfers += entry.second.num_transfers;
+    snapshot.num_connects += entry.second.num_connects;
+    snapshot.hosts.emplace_back(std::move(entry.second));
+  }
+  return snapshot;
+}
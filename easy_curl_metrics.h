@@ -0,0 +1,139 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_METRICS_H
+#define EASY_CURL_METRICS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "easy_curl.h"
+
+// Process-wide aggregated metrics about the traffic of any number of EasyCurl
+// instances, attached with EasyCurl::set_metrics(). Transfers driven by
+// EasyCurlMulti, or by handles of an EasyCurlPool, are recorded like any
+// other.
+//
+// Recording is meant to stay enabled in production: each thread records into
+// its own set of counters, so the hot path takes no locks and touches no
+// cache lines shared with other threads. Reading the metrics with
+// GetSnapshot() merges the counters of all the threads.
+//
+// Latencies are kept in log-linear histograms with 8 buckets per power of
+// two, i.e. with a relative error of at most 12.5%, up to about 25 days.
+//
+// This class is thread-safe. It must outlive the instances attached to it.
+class EasyCurlMetrics {
+ public:
+  static const constexpr int kNumLatencyBuckets = 312;
+  static const constexpr int kNumErrorCodes = kEndOfFile + 1;
+
+  // Metrics about the transfers to one host which got a response code of
+  // the same class.
+  struct HostMetrics {
+    // Host name and port of the effective URL of the transfers, as given by
+    // EasyCurl::HostKey().
+    std::string host;
+    // The first digit of the response codes (e.g. 2 for 2xx), or 0 for
+    // transfers which got no response at all.
+    int status_class = 0;
+
+    uint64_t num_transfers = 0;
+    uint64_t num_connects = 0;
+    uint64_t bytes_uploaded = 0;
+    uint64_t bytes_downloaded = 0;
+    // Received body bytes after decompression, see TransferStats.
+    uint64_t bytes_decoded = 0;
+    // Transfers which waited in an EasyCurlMulti queue, and their total
+    // wait in microseconds, which the latencies below don't include.
+    uint64_t num_queued = 0;
+    uint64_t queue_us = 0;
+    // Transfers aborted while in flight, by a CancellationToken or
+    // EasyCurlMulti::Cancel().
+    uint64_t num_cancelled = 0;
+
+    // Number of transfers per latency bucket, see LatencyBucketUpperBound().
+    std::vector<uint64_t> latency_buckets;
+
+    // Returns an upper bound of the given percentile (in [0, 100]) of the
+    // total transfer time, in microseconds.
+    int64_t LatencyPercentileUs(double percentile) const;
+  };
+
+  struct Snapshot {
+    std::vector<HostMetrics> hosts;
+
+    // Number of transfers which failed with each ErrorCode, indexed by code.
+    // errors[kOk] counts the successful transfers.
+    uint64_t errors[kNumErrorCodes] = {};
+
+    uint64_t num_transfers = 0;
+    uint64_t num_connects = 0;
+
+    // Fraction of the transfers which reused an existing connection.
+    double connection_reuse_ratio() const {
+      if (num_transfers == 0) {
+        return 0;
+      }
+      return num_transfers > num_connects
+          ? static_cast<double>(num_transfers - num_connects) / num_transfers : 0;
+    }
+  };
+
+  EasyCurlMetrics();
+  ~EasyCurlMetrics();
+
+  EasyCurlMetrics(const EasyCurlMetrics& that) = delete;
+  EasyCurlMetrics& operator=(const EasyCurlMetrics& that) = delete;
+
+  // Record a finished transfer which ended with 'error'.
+  void Record(const TransferStats& stats, const Error& error);
+
+  // Returns the metrics recorded so far by all the threads.
+  Snapshot GetSnapshot() const;
+
+  // Returns the bucket a latency of 'us' microseconds is counted in.
+  static int LatencyBucket(int64_t us);
+
+  // Returns the largest latency, in microseconds, counted in 'bucket'.
+  static int64_t LatencyBucketUpperBound(int bucket);
+
+ private:
+  struct Cell;
+  struct ThreadShard;
+
+  // Returns the shard of the calling thread, creating it if needed.
+  ThreadShard* GetThreadShard();
+
+  // Returns the cell of 'shard' for the given host and status class,
+  // creating it if needed. Only called by the thread owning 'shard'.
+  static Cell* FindOrCreateCell(ThreadShard* shard, std::string_view host, int status_class);
+
+  // Unique across all registries of the process, to find the shard of the
+  // calling thread.
+  const uint64_t id_;
+
+  mutable std::mutex shards_lock_;
+  std::vector<std::unique_ptr<ThreadShard>> shards_;
+};
+
+#endif //EASY_CURL_METRICS_H
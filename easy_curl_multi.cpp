@@ -0,0 +1,549 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_multi.h"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <curl/curl.h>
+#include <cassert>
+
+#include "easy_curl_limiter.h"
+
+namespace {
+
+inline Error TranslateMultiError(CURLMcode code) {
+  if (code == CURLM_OK) {
+    return kOk;
+  }
+  return Error(kRuntimeError, string("curl multi error: ") + curl_multi_strerror(code));
+}
+
+int64_t NowUs() {
+  return std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// How long to wait before trying again to start a transfer turned down by
+// the concurrency limit of its limiter, in case the transfer it waits for
+// is not one of this instance.
+const int64_t kLimiterRetryUs = 50000;
+
+} // anonymous namespace
+
+#define CURLM_RETURN_NOT_OK(expr)  { \
+    auto error = TranslateMultiError((expr)); \
+    if (error.code != kOk) { \
+      return error; \
+    } \
+  }
+
+EasyCurlMulti::EasyCurlMulti() {
+  EasyCurl::GlobalInit();
+  multi_ = curl_multi_init();
+  if (multi_ == nullptr) {
+    cerr << "Could not init curl multi";
+    exit(1);
+  }
+}
+
+EasyCurlMulti::~EasyCurlMulti() {
+  // Detach any transfers still in flight without invoking their callbacks;
+  // the caller is tearing everything down.
+  for (auto& entry : transfers_) {
+    curl_multi_remove_handle(multi_, entry.first->curl_);
+    entry.first->FinishRequest(CURLE_ABORTED_BY_CALLBACK);
+  }
+  // Queued transfers haven't touched their handles yet.
+  curl_multi_cleanup(multi_);
+}
+
+Error EasyCurlMulti::AddFetch(EasyCurl* curl,
+                              const string& url,
+                              string* dst,
+                              DoneCallback done,
+                              const vector<string>& headers) {
+  assert(dst != nullptr);
+  return SubmitTransfer(curl, url, nullptr, dst, headers, Transfer{std::move(done), nullptr, nullptr});
+}
+
+Error EasyCurlMulti::AddFetch(EasyCurl* curl,
+                              const string& url,
+                              EasyCurl::WriteSink sink,
+                              DoneCallback done,
+                              const vector<string>& headers) {
+  return SubmitTransfer(curl, url, nullptr, nullptr, headers,
+                     Transfer{std::move(done), std::move(sink), nullptr});
+}
+
+Error EasyCurlMulti::AddPost(EasyCurl* curl,
+                             const string& url,
+                             string_view post_data,
+                             string* dst,
+                             DoneCallback done,
+                             const vector<string>& headers) {
+  assert(dst != nullptr);
+  EasyCurl::PostBody body;
+  body.data = post_data;
+  return SubmitTransfer(curl, url, &body, dst, headers, Transfer{std::move(done), nullptr, nullptr});
+}
+
+Error EasyCurlMulti::AddPost(EasyCurl* curl,
+                             const string& url,
+                             EasyCurl::ReadSource source,
+                             int64_t post_size,
+                             string* dst,
+                             DoneCallback done,
+                             const vector<string>& headers) {
+  assert(dst != nullptr);
+  EasyCurl::PostBody body;
+  body.source_size = post_size;
+  return SubmitTransfer(curl, url, &body, dst, headers,
+                     Transfer{std::move(done), nullptr, std::move(source)});
+}
+
+Error EasyCurlMulti::SubmitTransfer(EasyCurl* curl,
+                                    const string& url,
+                                    EasyCurl::PostBody* post_data,
+                                    string* dst,
+                                    const vector<string>& headers,
+                                    Transfer transfer) {
+  assert(curl != nullptr);
+  if (max_transfers_ == 0 && max_transfers_per_host_ == 0 && queued_.empty() &&
+      curl->limiter_ == nullptr) {
+    return AddTransfer(curl, url, post_data, dst, headers, &transfer);
+  }
+  if (transfers_.count(curl) != 0 || queued_.count(curl) != 0) {
+    return Error(kIllegalState, "EasyCurl handle already has a transfer in flight");
+  }
+  EasyCurl::HostKey(url, &host_key_);
+  string_view host = host_key_;
+  if (max_transfers_per_host_ != 0) {
+    transfer.host.assign(host.data(), host.size());
+  }
+  bool under_limits = max_transfers_ == 0 || transfers_.size() < max_transfers_;
+  if (under_limits && !transfer.host.empty()) {
+    auto it = host_transfers_.find(transfer.host);
+    under_limits = it == host_transfers_.end() || it->second < max_transfers_per_host_;
+  }
+  // With transfers queued already, leave it to StartQueuedTransfers() to
+  // pick which goes first.
+  if (under_limits && queued_.empty() && AcquireLimiter(curl, host)) {
+    return AddTransfer(curl, url, post_data, dst, headers, &transfer);
+  }
+
+  QueuedTransfer queued;
+  queued.curl = curl;
+  queued.url = url;
+  queued.headers = headers;
+  if (post_data != nullptr) {
+    queued.post = true;
+    queued.post_data = *post_data;
+  }
+  queued.dst = dst;
+  queued.transfer = std::move(transfer);
+  queued.queued_us = NowUs();
+
+  int priority = static_cast<int>(curl->priority_);
+  PriorityQueue& queue = queues_[priority];
+  auto& host_queue = queue.hosts[string(host)];
+  if (host_queue.empty()) {
+    queue.round_robin.emplace_back(host);
+  }
+  host_queue.emplace_back(std::move(queued));
+  queued_.emplace(curl, std::make_pair(priority, string(host)));
+  queue_stats_.queued++;
+  queue_stats_.max_queued = std::max(queue_stats_.max_queued, queue_stats_.queued);
+
+  StartQueuedTransfers();
+  return kOk;
+}
+
+void EasyCurlMulti::StartQueuedTransfers() {
+  if (starting_queued_) {
+    return;
+  }
+  starting_queued_ = true;
+  QueuedTransfer queued;
+  while (PopQueuedTransfer(&queued)) {
+    int64_t wait_us = NowUs() - queued.queued_us;
+    queue_stats_.started++;
+    queue_stats_.total_wait_us += wait_us;
+    queue_stats_.max_wait_us = std::max(queue_stats_.max_wait_us, wait_us);
+    EasyCurl* curl = queued.curl;
+    curl->queue_us_ = wait_us;
+    auto error = AddTransfer(curl, queued.url, queued.post ? &queued.post_data : nullptr,
+                             queued.dst, queued.headers, &queued.transfer);
+    if (error.code != kOk) {
+      curl->queue_us_ = 0;
+      // The caller was told the transfer was added, so this is the only
+      // place left to report the error. The callback may add transfers,
+      // which are picked up by the loop.
+      if (queued.transfer.done) {
+        queued.transfer.done(curl, error);
+      }
+    }
+  }
+  starting_queued_ = false;
+}
+
+bool EasyCurlMulti::PopQueuedTransfer(QueuedTransfer* queued) {
+  if (queued_.empty() || (max_transfers_ != 0 && transfers_.size() >= max_transfers_)) {
+    return false;
+  }
+  for (auto& queue : queues_) {
+    // Each host gets its turn, skipping those at their limit, which keep
+    // their place for when a slot frees up.
+    for (size_t i = queue.round_robin.size(); i > 0; i--) {
+      string host = std::move(queue.round_robin.front());
+      queue.round_robin.pop_front();
+      if (max_transfers_per_host_ != 0 && !host.empty()) {
+        auto count = host_transfers_.find(host);
+        if (count != host_transfers_.end() && count->second >= max_transfers_per_host_) {
+          queue.round_robin.emplace_back(std::move(host));
+          continue;
+        }
+      }
+      auto it = queue.hosts.find(host);
+      assert(it != queue.hosts.end() && !it->second.empty());
+      if (!AcquireLimiter(it->second.front().curl, host)) {
+        queue.round_robin.emplace_back(std::move(host));
+        continue;
+      }
+      *queued = std::move(it->second.front());
+      it->second.pop_front();
+      if (it->second.empty()) {
+        queue.hosts.erase(it);
+      } else {
+        queue.round_robin.emplace_back(std::move(host));
+      }
+      queued_.erase(queued->curl);
+      queue_stats_.queued--;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool EasyCurlMulti::RemoveQueuedTransfer(EasyCurl* curl, QueuedTransfer* queued) {
+  auto entry = queued_.find(curl);
+  if (entry == queued_.end()) {
+    return false;
+  }
+  PriorityQueue& queue = queues_[entry->second.first];
+  const string& host = entry->second.second;
+  auto it = queue.hosts.find(host);
+  assert(it != queue.hosts.end());
+  auto& host_queue = it->second;
+  auto pos = std::find_if(host_queue.begin(), host_queue.end(),
+                          [&](const QueuedTransfer& q) { return q.curl == curl; });
+  assert(pos != host_queue.end());
+  *queued = std::move(*pos);
+  host_queue.erase(pos);
+  if (host_queue.empty()) {
+    queue.hosts.erase(it);
+    queue.round_robin.erase(
+        std::find(queue.round_robin.begin(), queue.round_robin.end(), host));
+  }
+  queued_.erase(entry);
+  queue_stats_.queued--;
+  return true;
+}
+
+bool EasyCurlMulti::AcquireLimiter(EasyCurl* curl, string_view host) {
+  EasyCurlLimiter* limiter = curl->limiter_;
+  if (limiter == nullptr) {
+    return true;
+  }
+  int64_t wait_us = limiter->TryAcquire(curl->FindLimiterHost(host));
+  if (wait_us == 0) {
+    curl->acquired_limiter_ = limiter;
+    return true;
+  }
+  // Transfers completing start queued ones anyway; the timer covers rate
+  // limits, and transfers released elsewhere.
+  int64_t retry_us = NowUs() + (wait_us > 0 ? wait_us : kLimiterRetryUs);
+  if (limiter_retry_us_ < 0 || retry_us < limiter_retry_us_) {
+    limiter_retry_us_ = retry_us;
+    if (event_loop_ != nullptr) {
+      ArmTimer();
+    }
+  }
+  return false;
+}
+
+void EasyCurlMulti::StartDueTransfers() {
+  if (limiter_retry_us_ >= 0 && NowUs() >= limiter_retry_us_) {
+    limiter_retry_us_ = -1;
+    StartQueuedTransfers();
+  }
+}
+
+Error EasyCurlMulti::ArmTimer() {
+  int64_t due_us = curl_timer_us_;
+  if (limiter_retry_us_ >= 0 && (due_us < 0 || limiter_retry_us_ < due_us)) {
+    due_us = limiter_retry_us_;
+  }
+  if (due_us < 0) {
+    return event_loop_->SetTimer(-1);
+  }
+  return event_loop_->SetTimer(std::max<int64_t>(0, (due_us - NowUs() + 999) / 1000));
+}
+
+Error EasyCurlMulti::AddTransfer(EasyCurl* curl,
+                                 const string& url,
+                                 EasyCurl::PostBody* post_data,
+                                 string* dst,
+                                 const vector<string>& headers,
+                                 Transfer* transfer) {
+  assert(curl != nullptr);
+  auto inserted = transfers_.emplace(curl, Transfer());
+  if (!inserted.second) {
+    return Error(kIllegalState, "EasyCurl handle already has a transfer in flight");
+  }
+  inserted.first->second = std::move(*transfer);
+  // The sink and the source are handed to libcurl from their final location
+  // in 'transfers_'.
+  const Transfer& t = inserted.first->second;
+  if (t.source) {
+    post_data->source = &t.source;
+  }
+  auto error = curl->PrepareRequest(url, post_data, dst, dst ? nullptr : &t.sink, headers);
+  if (error.code == kOk &&
+      curl_easy_setopt(curl->curl_, CURLOPT_PRIVATE, curl) != CURLE_OK) {
+    error = Error(kRuntimeError, "Failed to associate transfer with its EasyCurl handle");
+  }
+  if (error.code == kOk) {
+    error = TranslateMultiError(curl_multi_add_handle(multi_, curl->curl_));
+  }
+  if (error.code != kOk) {
+    // In case the request was prepared, but not added: the sink is about to
+    // go away, and the limiter was taken for it before it was prepared.
+    curl->AbandonRequest();
+    *transfer = std::move(inserted.first->second);
+    transfers_.erase(inserted.first);
+  } else if (!t.host.empty()) {
+    host_transfers_[t.host]++;
+  }
+  return error;
+}
+
+Error EasyCurlMulti::set_multiplexing(bool v) {
+  CURLM_RETURN_NOT_OK(curl_multi_setopt(
+      multi_, CURLMOPT_PIPELINING, v ? CURLPIPE_MULTIPLEX : CURLPIPE_NOTHING));
+  return kOk;
+}
+
+Error EasyCurlMulti::set_max_concurrent_streams(int max_streams) {
+  CURLM_RETURN_NOT_OK(curl_multi_setopt(
+      multi_, CURLMOPT_MAX_CONCURRENT_STREAMS, static_cast<long>(max_streams))); // NOLINT(*)
+  return kOk;
+}
+
+Error EasyCurlMulti::set_max_host_connections(int max_connections) {
+  CURLM_RETURN_NOT_OK(curl_multi_setopt(
+      multi_, CURLMOPT_MAX_HOST_CONNECTIONS, static_cast<long>(max_connections))); // NOLINT(*)
+  return kOk;
+}
+
+Error EasyCurlMulti::set_max_total_connections(int max_connections) {
+  CURLM_RETURN_NOT_OK(curl_multi_setopt(
+      multi_, CURLMOPT_MAX_TOTAL_CONNECTIONS, static_cast<long>(max_connections))); // NOLINT(*)
+  return kOk;
+}
+
+void EasyCurlMulti::set_max_transfers_per_host(size_t max_transfers) {
+  max_transfers_per_host_ = max_transfers;
+  StartQueuedTransfers();
+}
+
+void EasyCurlMulti::set_max_transfers(size_t max_transfers) {
+  max_transfers_ = max_transfers;
+  StartQueuedTransfers();
+}
+
+Error EasyCurlMulti::Cancel(EasyCurl* curl) {
+  QueuedTransfer queued;
+  if (RemoveQueuedTransfer(curl, &queued)) {
+    if (queued.transfer.done) {
+      queued.transfer.done(curl, Error(kAborted, "curl aborted: transfer cancelled while queued"));
+    }
+    return kOk;
+  }
+  if (transfers_.count(curl) == 0) {
+    return Error(kNotFound, "EasyCurl handle has no transfer in flight");
+  }
+  CompleteTransfer(curl, CURLE_ABORTED_BY_CALLBACK);
+  return kOk;
+}
+
+void EasyCurlMulti::CompleteTransfer(EasyCurl* curl, int curl_code) {
+  auto it = transfers_.find(curl);
+  assert(it != transfers_.end());
+  curl_multi_remove_handle(multi_, curl->curl_);
+  // Detach the transfer before invoking the callback, which may add a new
+  // transfer for the same handle.
+  Transfer transfer = std::move(it->second);
+  transfers_.erase(it);
+  if (!transfer.host.empty()) {
+    auto count = host_transfers_.find(transfer.host);
+    if (--count->second == 0) {
+      host_transfers_.erase(count);
+    }
+  }
+  auto error = curl->FinishRequest(curl_code);
+  if (transfer.done) {
+    transfer.done(curl, error);
+  }
+  // After the callback, so transfers it adds compete for the freed slot.
+  StartQueuedTransfers();
+}
+
+bool EasyCurlMulti::CompleteFinishedTransfers() {
+  int msgs_left;
+  CURLMsg* msg;
+  bool completed = false;
+  while ((msg = curl_multi_info_read(multi_, &msgs_left)) != nullptr) {
+    if (msg->msg != CURLMSG_DONE) {
+      continue;
+    }
+    EasyCurl* curl;
+    curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &curl);
+    CompleteTransfer(curl, msg->data.result);
+    completed = true;
+  }
+  return completed;
+}
+
+Error EasyCurlMulti::Poll(int timeout_ms) {
+  if (event_loop_ != nullptr) {
+    return Error(kIllegalState, "transfers are driven by an event loop");
+  }
+  StartDueTransfers();
+  int running;
+  CURLM_RETURN_NOT_OK(curl_multi_perform(multi_, &running));
+  bool completed = CompleteFinishedTransfers();
+
+  // Return right away once some transfer completed, so the caller can act
+  // on it, e.g. cancel other transfers it no longer needs. Transfers added
+  // by the callbacks above are started by the next curl_multi_perform(), so
+  // otherwise there is nothing to wait for unless some transfer was already
+  // running.
+  // Queued transfers waiting for their limiters are due at
+  // 'limiter_retry_us_'.
+  if (!completed && ((!transfers_.empty() && running > 0) || limiter_retry_us_ >= 0)) {
+    if (limiter_retry_us_ >= 0) {
+      int64_t retry_ms = std::max<int64_t>(0, (limiter_retry_us_ - NowUs() + 999) / 1000);
+      timeout_ms = static_cast<int>(std::min<int64_t>(timeout_ms, retry_ms));
+    }
+    CURLM_RETURN_NOT_OK(curl_multi_poll(multi_, nullptr, 0, timeout_ms, nullptr));
+  }
+  return kOk;
+}
+
+Error EasyCurlMulti::Run() {
+  while (num_transfers() != 0) {
+    auto error = Poll(1000);
+    if (error.code != kOk) {
+      return error;
+    }
+  }
+  return kOk;
+}
+
+Error EasyCurlMulti::set_event_loop(EasyCurlEventLoop* loop) {
+  if (num_transfers() != 0) {
+    return Error(kIllegalState, "can't switch event loops with transfers in flight");
+  }
+  if (loop != nullptr) {
+    CURLM_RETURN_NOT_OK(curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, SocketCallback));
+    CURLM_RETURN_NOT_OK(curl_multi_setopt(multi_, CURLMOPT_SOCKETDATA, this));
+    CURLM_RETURN_NOT_OK(curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, TimerCallback));
+    CURLM_RETURN_NOT_OK(curl_multi_setopt(multi_, CURLMOPT_TIMERDATA, this));
+  } else {
+    CURLM_RETURN_NOT_OK(curl_multi_setopt(multi_, CURLMOPT_SOCKETFUNCTION, nullptr));
+    CURLM_RETURN_NOT_OK(curl_multi_setopt(multi_, CURLMOPT_TIMERFUNCTION, nullptr));
+  }
+  event_loop_ = loop;
+  return kOk;
+}
+
+int EasyCurlMulti::SocketCallback(CURL* /* easy */, int fd, int what, void* user_ptr,
+                                  void* /* socket_ptr */) {
+  auto* multi = reinterpret_cast<EasyCurlMulti*>(user_ptr);
+  int events = 0;
+  if (what == CURL_POLL_IN || what == CURL_POLL_INOUT) {
+    events |= EasyCurlEventLoop::kRead;
+  }
+  if (what == CURL_POLL_OUT || what == CURL_POLL_INOUT) {
+    events |= EasyCurlEventLoop::kWrite;
+  }
+  // Returning -1 fails the transfers using the socket.
+  return multi->event_loop_->WatchSocket(fd, events).code == kOk ? 0 : -1;
+}
+
+int EasyCurlMulti::TimerCallback(CURLM* /* multi */, long timeout_ms, void* user_ptr) { // NOLINT(*)
+  auto* multi = reinterpret_cast<EasyCurlMulti*>(user_ptr);
+  multi->curl_timer_us_ = timeout_ms < 0 ? -1 : NowUs() + timeout_ms * 1000;
+  if (multi->limiter_retry_us_ < 0) {
+    return multi->event_loop_->SetTimer(timeout_ms).code == kOk ? 0 : -1;
+  }
+  return multi->ArmTimer().code == kOk ? 0 : -1;
+}
+
+Error EasyCurlMulti::OnSocketReady(int fd, int events) {
+  int mask = 0;
+  if (events & EasyCurlEventLoop::kRead) {
+    mask |= CURL_CSELECT_IN;
+  }
+  if (events & EasyCurlEventLoop::kWrite) {
+    mask |= CURL_CSELECT_OUT;
+  }
+  if (events & EasyCurlEventLoop::kError) {
+    mask |= CURL_CSELECT_ERR;
+  }
+  int running;
+  CURLM_RETURN_NOT_OK(curl_multi_socket_action(multi_, fd, mask, &running));
+  CompleteFinishedTransfers();
+  return kOk;
+}
+
+Error EasyCurlMulti::OnTimeout() {
+  if (curl_timer_us_ >= 0 && curl_timer_us_ <= NowUs()) {
+    // curl re-arms it as needed from the call below.
+    curl_timer_us_ = -1;
+  }
+  int running;
+  CURLM_RETURN_NOT_OK(curl_multi_socket_action(multi_, CURL_SOCKET_TIMEOUT, 0, &running));
+  CompleteFinishedTransfers();
+  if (limiter_retry_us_ >= 0) {
+    StartDueTransfers();
+    // The timer may have fired for the limiter, with curl's still to come.
+    return ArmTimer();
+  }
+  return kOk;
+}
+
+Error EasyCurlMulti::Wakeup() {
+  CURLM_RETURN_NOT_OK(curl_multi_wakeup(multi_));
+  return kOk;
+}
@@ -0,0 +1,374 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_MULTI_H
+#define EASY_CURL_MULTI_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "easy_curl.h"
+
+typedef void CURLM;
+
+class EasyCurlMulti;
+
+// The interface an event loop implements to drive the transfers of an
+// EasyCurlMulti itself, through EasyCurlMulti::OnSocketReady() and
+// OnTimeout(), rather than have Poll() wait for network activity. See
+// EasyCurlMulti::set_event_loop().
+//
+// The methods below are called by the multi handle, often from within
+// OnSocketReady() or OnTimeout(), which must therefore not be called back
+// right away: the event loop only notes the change and calls the multi
+// handle back on a later iteration.
+//
+// Reference implementations for epoll and io_uring are in easy_curl_epoll.h
+// and easy_curl_io_uring.h.
+class EasyCurlEventLoop {
+ public:
+  // Socket events, combined as a bit mask.
+  static const constexpr int kRead = 1;
+  static const constexpr int kWrite = 2;
+  // Only passed to OnSocketReady(), for sockets with an error or hang-up.
+  static const constexpr int kError = 4;
+
+  virtual ~EasyCurlEventLoop() = default;
+
+  // Start or keep watching 'fd' for the given events, replacing any earlier
+  // ones, or stop watching it if 'events' is 0. Once some of them occur,
+  // call EasyCurlMulti::OnSocketReady().
+  virtual Error WatchSocket(int fd, int events) = 0;
+
+  // Arm the one timer of the multi handle to call EasyCurlMulti::OnTimeout()
+  // in 'timeout_ms' milliseconds, replacing any earlier deadline; 0 means
+  // as soon as possible. A negative value disarms the timer.
+  virtual Error SetTimer(int64_t timeout_ms) = 0;
+};
+
+// Wrapper around curl's "multi" interface, allowing many EasyCurl transfers
+// to make progress concurrently on a single thread.
+//
+// Each transfer is driven by a caller-owned EasyCurl instance, so all the
+// settings of that instance (auth, timeouts, DNS servers, ...) apply exactly
+// as they would for a blocking FetchURL()/PostToURL() call. In particular,
+// the millisecond timeouts of each instance bound its transfer here too,
+// and an expired transfer completes with kTimedOut. An EasyCurl
+// instance can be part of at most one transfer at a time; once its transfer
+// completes it may be reused, keeping its warm connections.
+//
+// Example:
+//   EasyCurlMulti multi;
+//   std::vector<EasyCurl> curls(urls.size());
+//   std::vector<string> bodies(urls.size());
+//   for (size_t i = 0; i < urls.size(); i++) {
+//     multi.AddFetch(&curls[i], urls[i], &bodies[i],
+//                    [](EasyCurl* curl, const Error& e) { ... });
+//   }
+//   multi.Run();
+//
+// For many concurrent requests to the same upstream to share a few HTTP/2
+// connections, enable HTTP/2 and EasyCurl::set_wait_for_multiplexing() on
+// the instances, and keep set_multiplexing() on (the default).
+//
+// To keep a slow upstream from taking over, limit the transfers in flight
+// per host with set_max_transfers_per_host(): the others wait in a queue,
+// and are started as slots free up, by priority class and fairly across
+// hosts.
+//
+// By default Poll() waits for network activity on all the transfers. To
+// run the transfers on an existing event loop instead, without a thread or
+// a wait of their own, see set_event_loop().
+//
+// This is not thread-safe: all calls but Wakeup(), and all callbacks,
+// happen on the thread driving Poll()/Run(). For a thread-safe client
+// running its own polling thread, see EasyCurlAsync in easy_curl_async.h.
+class EasyCurlMulti {
+ public:
+  // Invoked when a transfer finishes, with the same result the equivalent
+  // blocking EasyCurl call would have returned. The callback may add new
+  // transfers, including ones reusing 'curl'.
+  typedef std::function<void(EasyCurl* curl, const Error& error)> DoneCallback;
+
+  EasyCurlMulti();
+  ~EasyCurlMulti();
+
+  EasyCurlMulti(const EasyCurlMulti& that) = delete;
+  EasyCurlMulti& operator=(const EasyCurlMulti& that) = delete;
+
+  // Start fetching the given URL into 'dst' using 'curl'. See
+  // EasyCurl::FetchURL() for details. 'curl' and 'dst' must remain valid
+  // until 'done' has been invoked.
+  Error AddFetch(EasyCurl* curl,
+                 const std::string& url,
+                 string* dst,
+                 DoneCallback done,
+                 const std::vector<std::string>& headers = {});
+
+  // Start fetching the given URL using 'curl', handing the response to
+  // 'sink' as it arrives. See EasyCurl::FetchURL() for details. The sink is
+  // copied; 'curl' must remain valid until 'done' has been invoked.
+  //
+  // The sink may pause the transfer by returning EasyCurl::kPauseTransfer;
+  // call EasyCurl::Unpause() to resume it. Paused transfers stay in flight.
+  Error AddFetch(EasyCurl* curl,
+                 const std::string& url,
+                 EasyCurl::WriteSink sink,
+                 DoneCallback done,
+                 const std::vector<std::string>& headers = {});
+
+  // Start an HTTP POST of 'post_data' to the given URL using 'curl'. See
+  // EasyCurl::PostToURL() for details. 'curl', the data 'post_data' refers
+  // to and 'dst' must remain valid until 'done' has been invoked.
+  Error AddPost(EasyCurl* curl,
+                const std::string& url,
+                std::string_view post_data,
+                string* dst,
+                DoneCallback done,
+                const std::vector<std::string>& headers = {});
+
+  // Start an HTTP POST to the given URL using 'curl', streaming the body
+  // from 'source'. See EasyCurl::PostToURL() for details. The source is
+  // copied; 'curl' and 'dst' must remain valid until 'done' has been invoked.
+  Error AddPost(EasyCurl* curl,
+                const std::string& url,
+                EasyCurl::ReadSource source,
+                int64_t post_size,
+                string* dst,
+                DoneCallback done,
+                const std::vector<std::string>& headers = {});
+
+  // Whether transfers to the same host may share one HTTP/2 connection
+  // rather than each using a connection of their own. Enabled by default
+  // since libcurl 7.62. See 'man CURLMOPT_PIPELINING' for details.
+  Error set_multiplexing(bool v);
+
+  // Maximum number of concurrent streams per multiplexed connection, beyond
+  // which new transfers open another connection. Defaults to 100.
+  Error set_max_concurrent_streams(int max_streams);
+
+  // Limits on the connections libcurl keeps open to any one host, and in
+  // total; 0, the default, means no limit. Transfers beyond them wait within
+  // libcurl for a connection, in no particular order and with their
+  // timeouts running, so set the transfer limits below as well to control
+  // which go first. See 'man CURLMOPT_MAX_HOST_CONNECTIONS' and
+  // 'man CURLMOPT_MAX_TOTAL_CONNECTIONS'.
+  Error set_max_host_connections(int max_connections);
+  Error set_max_total_connections(int max_connections);
+
+  // Limits on the transfers in flight to any one host (as told apart by
+  // EasyCurl::HostKey()), and in total; 0, the default, means no limit.
+  // Transfers added beyond them are queued, and started as others complete:
+  // those of the higher priority classes first (see
+  // EasyCurl::set_priority()), and within a class round-robin across hosts,
+  // so a host with a long queue doesn't hold up the others. A queued
+  // transfer counts as in flight for num_transfers() and Cancel(), but its
+  // timeouts only start running once it is started, and errors starting it
+  // go to its callback.
+  //
+  // Transfers of EasyCurl instances with a limiter (see
+  // EasyCurl::set_limiter()) also wait here until it lets them start, rather
+  // than blocking.
+  //
+  // The per-host limit applies to transfers added after it is set.
+  void set_max_transfers_per_host(size_t max_transfers);
+  void set_max_transfers(size_t max_transfers);
+
+  struct QueueStats {
+    // Transfers queued right now, and the most there were at once.
+    size_t queued = 0;
+    size_t max_queued = 0;
+    // Transfers which were started after waiting in the queue, and their
+    // total and longest wait, in microseconds.
+    int64_t started = 0;
+    int64_t total_wait_us = 0;
+    int64_t max_wait_us = 0;
+  };
+
+  // Returns how busy the queue of transfers was. Long waits with few
+  // transfers in flight per host point to the limits being too low rather
+  // than to slow upstreams. The wait of each transfer is also part of its
+  // TransferStats.
+  const QueueStats& queue_stats() const {
+    return queue_stats_;
+  }
+
+  // Abort the in-flight or queued transfer of 'curl'. Its callback is
+  // invoked with kAborted before this returns.
+  Error Cancel(EasyCurl* curl);
+
+  // Have 'loop' drive the transfers rather than Poll(), or go back to Poll()
+  // if 'loop' is nullptr. Must be called while no transfer is in flight; the
+  // loop must remain valid until it is replaced.
+  Error set_event_loop(EasyCurlEventLoop* loop);
+
+  // Called by the event loop when some of the events EasyCurlEventLoop::
+  // WatchSocket() asked for occurred on 'fd'. Makes progress on the
+  // transfers using the socket and invokes the callbacks of those which
+  // completed.
+  Error OnSocketReady(int fd, int events);
+
+  // Called by the event loop when the timer set by EasyCurlEventLoop::
+  // SetTimer() expires. Handles timeouts and the like, and invokes the
+  // callbacks of the transfers which completed.
+  Error OnTimeout();
+
+  // Make progress on all in-flight transfers and invoke the callbacks of the
+  // transfers which completed. If none did, waits at most 'timeout_ms' for
+  // network activity. Not available when an event loop is set.
+  Error Poll(int timeout_ms);
+
+  // Call Poll() until there are no in-flight transfers left, including
+  // transfers added by callbacks along the way.
+  Error Run();
+
+  // Make a Poll() waiting for network activity, or the next one, return
+  // right away. Unlike everything else, this may be called from any thread,
+  // e.g. to get the polling thread to pick up work handed to it.
+  Error Wakeup();
+
+  // Returns the number of in-flight transfers, including the queued ones.
+  size_t num_transfers() const {
+    return transfers_.size() + queue_stats_.queued;
+  }
+
+ private:
+  struct Transfer {
+    DoneCallback done;
+    EasyCurl::WriteSink sink;
+    EasyCurl::ReadSource source;
+    // The host the transfer counts against in 'host_transfers_', if
+    // limited.
+    std::string host = {};
+  };
+
+  // A transfer waiting for a slot, with copies of what it is started with.
+  struct QueuedTransfer {
+    EasyCurl* curl = nullptr;
+    std::string url;
+    std::vector<std::string> headers;
+    bool post = false;
+    EasyCurl::PostBody post_data;
+    string* dst = nullptr;
+    Transfer transfer;
+    // When it was queued, in microseconds of the steady clock.
+    int64_t queued_us = 0;
+  };
+
+  // The queued transfers of one priority class.
+  struct PriorityQueue {
+    std::unordered_map<std::string, std::deque<QueuedTransfer>> hosts;
+    // The hosts with queued transfers, the next one to start from first.
+    std::deque<std::string> round_robin;
+  };
+
+  static const constexpr int kNumPriorities = 3;
+
+  // Start the transfer right away, or queue it if over the limits.
+  Error SubmitTransfer(EasyCurl* curl,
+                       const std::string& url,
+                       EasyCurl::PostBody* post_data,
+                       string* dst,
+                       const std::vector<std::string>& headers,
+                       Transfer transfer);
+
+  // Start queued transfers while the limits allow.
+  void StartQueuedTransfers();
+
+  // Returns whether the limiter of 'curl', if any, lets it start a transfer
+  // to 'host' now. If not, schedules another try.
+  bool AcquireLimiter(EasyCurl* curl, std::string_view host);
+
+  // Start queued transfers if another try is due for those turned down by
+  // their limiters.
+  void StartDueTransfers();
+
+  // Arm the timer of 'event_loop_' for the earlier of curl's timeout and
+  // the next try of the limiters.
+  Error ArmTimer();
+
+  // Take the next queued transfer allowed to start into 'queued'. Returns
+  // false if there is none.
+  bool PopQueuedTransfer(QueuedTransfer* queued);
+
+  // Remove the queued transfer of 'curl' into 'queued'. Returns false if
+  // 'curl' has none.
+  bool RemoveQueuedTransfer(EasyCurl* curl, QueuedTransfer* queued);
+
+  // Configure 'curl' for the request and register it with the multi handle.
+  // Arguments are as for EasyCurl::PrepareRequest(), with the sink and the
+  // source, if any, taken from 'transfer', which is moved from unless this
+  // fails.
+  Error AddTransfer(EasyCurl* curl,
+                    const std::string& url,
+                    EasyCurl::PostBody* post_data,
+                    string* dst,
+                    const std::vector<std::string>& headers,
+                    Transfer* transfer);
+
+  // Detach the transfer of 'curl' and invoke its callback with the outcome
+  // of the transfer.
+  void CompleteTransfer(EasyCurl* curl, int curl_code);
+
+  // Complete the transfers curl reports as done. Returns whether there
+  // were any.
+  bool CompleteFinishedTransfers();
+
+  // CURLMOPT_SOCKETFUNCTION and CURLMOPT_TIMERFUNCTION callbacks, forwarding
+  // to 'event_loop_'; 'user_ptr' is the EasyCurlMulti instance.
+  static int SocketCallback(CURL* easy, int fd, int what, void* user_ptr, void* socket_ptr);
+  static int TimerCallback(CURLM* multi, long timeout_ms, void* user_ptr); // NOLINT(*)
+
+  CURLM* multi_;
+
+  EasyCurlEventLoop* event_loop_ = nullptr;
+
+  std::unordered_map<EasyCurl*, Transfer> transfers_;
+
+  size_t max_transfers_ = 0;
+  size_t max_transfers_per_host_ = 0;
+
+  // Transfers in flight per limited host.
+  std::unordered_map<std::string, size_t> host_transfers_;
+
+  // Indexed by TransferPriority.
+  PriorityQueue queues_[kNumPriorities];
+  // The priority class and host each queued transfer is queued under.
+  std::unordered_map<EasyCurl*, std::pair<int, std::string>> queued_;
+
+  // Scratch space for EasyCurl::HostKey().
+  std::string host_key_;
+
+  // Set while StartQueuedTransfers() runs, which callbacks may re-enter.
+  bool starting_queued_ = false;
+
+  // When to try again to start the transfers turned down by their limiters,
+  // and when curl wants OnTimeout() called, in microseconds of the steady
+  // clock, or -1 for never.
+  int64_t limiter_retry_us_ = -1;
+  int64_t curl_timer_us_ = -1;
+
+  QueueStats queue_stats_;
+};
+
+#endif //EASY_CURL_MULTI_H
@@ -0,0 +1,134 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_pool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Threads are spread over the shards round-robin, in the order in which
+// they first touch any pool.
+size_t ThisThreadIndex() {
+  static std::atomic<size_t> next_index(0);
+  thread_local size_t index = next_index.fetch_add(1, std::memory_order_relaxed);
+  return index;
+}
+
+} // anonymous namespace
+
+EasyCurlPool::EasyCurlPool(size_t num_handles, InitCallback init)
+    : init_(std::move(init)),
+      num_shards_(std::max(1U, std::thread::hardware_concurrency())),
+      shards_(new Shard[num_shards_]),
+      num_handles_(0) {
+  for (size_t i = 0; i < num_handles; i++) {
+    shards_[i % num_shards_].free.push_back(NewHandle());
+  }
+}
+
+EasyCurlPool::~EasyCurlPool() = default;
+
+size_t EasyCurlPool::ShardForThisThread() const {
+  return ThisThreadIndex() % num_shards_;
+}
+
+EasyCurl* EasyCurlPool::NewHandle() {
+  std::unique_ptr<EasyCurl> curl(new EasyCurl());
+  if (init_) {
+    init_(curl.get());
+  }
+  EasyCurl* ret = curl.get();
+  std::lock_guard<std::mutex> l(handles_lock_);
+  handles_.emplace_back(std::move(curl));
+  num_handles_.fetch_add(1, std::memory_order_relaxed);
+  return ret;
+}
+
+EasyCurlPool::Lease EasyCurlPool::Acquire() {
+  const size_t home = ShardForThisThread();
+  for (size_t i = 0; i < num_shards_; i++) {
+    Shard& shard = shards_[(home + i) % num_shards_];
+    std::lock_guard<std::mutex> l(shard.lock);
+    if (!shard.free.empty()) {
+      // Take the most recently returned handle: its connections are the
+      // least likely to have been closed by the server.
+      EasyCurl* curl = shard.free.back();
+      shard.free.pop_back();
+      return Lease(this, curl, home);
+    }
+  }
+  return Lease(this, NewHandle(), home);
+}
+
+Error EasyCurlPool::Prewarm(const vector<string>& urls, size_t connections_per_url) {
+  // Separate handles, as each connection is kept by the handle which opened
+  // it. For the same reason they can't be driven by an EasyCurlMulti, whose
+  // connections would stay with it; instead a few threads take turns.
+  vector<Lease> leases;
+  for (size_t i = 0; i < connections_per_url; i++) {
+    leases.emplace_back(Acquire());
+  }
+
+  std::mutex error_lock;
+  Error error = kOk;
+  std::atomic<size_t> next_lease(0);
+  auto warm = [&]() {
+    while (true) {
+      size_t i = next_lease.fetch_add(1, std::memory_order_relaxed);
+      if (i >= leases.size()) {
+        return;
+      }
+      for (const auto& url : urls) {
+        auto e = leases[i]->HeadURL(url);
+        if (e.code != kOk && e.code != kRemoteError) {
+          std::lock_guard<std::mutex> l(error_lock);
+          if (error.code == kOk) {
+            error = std::move(e);
+          }
+        }
+      }
+    }
+  };
+  vector<std::thread> threads;
+  for (size_t i = 1; i < std::min(leases.size(), kMaxPrewarmThreads); i++) {
+    threads.emplace_back(warm);
+  }
+  warm();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  return error;
+}
+
+void EasyCurlPool::Return(EasyCurl* curl, size_t shard) {
+  // Both belong to the call the handle was leased for: the token may not
+  // outlive it, and the deadline would fail the requests of the next lease.
+  curl->set_cancellation_token(nullptr);
+  curl->set_deadline(std::chrono::steady_clock::time_point::max());
+  Shard& s = shards_[shard];
+  std::lock_guard<std::mutex> l(s.lock);
+  s.free.push_back(curl);
+}
@@ -0,0 +1,185 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_POOL_H
+#define EASY_CURL_POOL_H
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "easy_curl.h"
+
+// A pool of EasyCurl handles which threads check out for the duration of one
+// or more requests, and which keep their warm connections when returned.
+//
+// Free handles are kept in per-core shards: a thread checks out from, and
+// returns to, its own shard, and only steals from other shards when its own
+// is empty. If every handle is checked out, a new one is created, so
+// Acquire() never blocks on other threads.
+//
+// Example:
+//   EasyCurlPool pool(64, [](EasyCurl* curl) { curl->set_timeout(5); });
+//   ...
+//   auto curl = pool.Acquire();
+//   auto e = curl->FetchURL(url, &resp);
+//   // 'curl' goes back to the pool at the end of the scope.
+//
+// To spare the first requests after startup the cost of connecting, open
+// connections ahead of time with Prewarm().
+//
+// A returned handle drops its cancellation token and deadline, which are
+// those of the call it was leased for; set them on each lease rather than
+// in the InitCallback.
+//
+// This class is thread-safe. The pool must outlive all its leases.
+class EasyCurlPool {
+ public:
+  // Invoked once on each handle the pool creates, to apply the settings
+  // shared by all the handles of the pool.
+  typedef std::function<void(EasyCurl* curl)> InitCallback;
+
+  // A checked out handle, returned to the pool when the lease goes out of
+  // scope. Like ScopedCleanup, but movable so it can be handed around.
+  class Lease {
+   public:
+    Lease() = default;
+    ~Lease() {
+      Release();
+    }
+
+    Lease(Lease&& that) noexcept
+        : pool_(that.pool_),
+          curl_(that.curl_),
+          shard_(that.shard_) {
+      that.curl_ = nullptr;
+    }
+    Lease& operator=(Lease&& that) noexcept {
+      if (this != &that) {
+        Release();
+        pool_ = that.pool_;
+        curl_ = that.curl_;
+        shard_ = that.shard_;
+        that.curl_ = nullptr;
+      }
+      return *this;
+    }
+
+    Lease(const Lease& that) = delete;
+    Lease& operator=(const Lease& that) = delete;
+
+    EasyCurl* get() const {
+      return curl_;
+    }
+    EasyCurl* operator->() const {
+      return curl_;
+    }
+    EasyCurl& operator*() const {
+      return *curl_;
+    }
+    explicit operator bool() const {
+      return curl_ != nullptr;
+    }
+
+    // Return the handle to the pool before the lease goes out of scope.
+    void Release() {
+      if (curl_ != nullptr) {
+        pool_->Return(curl_, shard_);
+        curl_ = nullptr;
+      }
+    }
+
+   private:
+    friend class EasyCurlPool;
+
+    Lease(EasyCurlPool* pool, EasyCurl* curl, size_t shard)
+        : pool_(pool),
+          curl_(curl),
+          shard_(shard) {
+    }
+
+    EasyCurlPool* pool_ = nullptr;
+    EasyCurl* curl_ = nullptr;
+    size_t shard_ = 0;
+  };
+
+  // Create a pool with 'num_handles' handles ready to be checked out.
+  explicit EasyCurlPool(size_t num_handles, InitCallback init = nullptr);
+  ~EasyCurlPool();
+
+  EasyCurlPool(const EasyCurlPool& that) = delete;
+  EasyCurlPool& operator=(const EasyCurlPool& that) = delete;
+
+  // Check out a handle.
+  Lease Acquire();
+
+  // The most threads Prewarm() opens connections on at once.
+  static const constexpr size_t kMaxPrewarmThreads = 16;
+
+  // Open 'connections_per_url' connections to the host of each of 'urls',
+  // one per handle, on up to kMaxPrewarmThreads threads, and leave them
+  // parked in the handles for requests to reuse; the pool grows to
+  // 'connections_per_url' handles if it has fewer. Each connection is opened
+  // with a HEAD request of the URL, so the URLs should be cheap to request,
+  // e.g. health checks; the addresses and TLS sessions are cached along the
+  // way. Responses other than 2xx still leave a connection behind, so only
+  // failures to get any response are reported, the first one if several.
+  //
+  // Each handle keeps up to 5 connections, see 'man CURLOPT_MAXCONNECTS',
+  // and drops those idle for longer than its
+  // EasyCurl::set_max_connection_idle_secs(), so warm no more hosts than
+  // that, and shortly before the traffic arrives.
+  Error Prewarm(const std::vector<std::string>& urls, size_t connections_per_url);
+
+  // Returns the number of handles created by the pool, including the ones
+  // created on demand once the initial handles were all checked out.
+  size_t num_handles() const {
+    return num_handles_.load(std::memory_order_relaxed);
+  }
+
+ private:
+  struct Shard {
+    // Keep each shard on its own cache line so that threads working on
+    // different shards don't contend.
+    alignas(64) std::mutex lock;
+    std::vector<EasyCurl*> free;
+  };
+
+  // Returns the shard of the calling thread.
+  size_t ShardForThisThread() const;
+
+  // Create a new handle, owned by the pool.
+  EasyCurl* NewHandle();
+
+  void Return(EasyCurl* curl, size_t shard);
+
+  const InitCallback init_;
+
+  const size_t num_shards_;
+  std::unique_ptr<Shard[]> shards_;
+
+  // All the handles ever created, for cleanup.
+  std::mutex handles_lock_;
+  std::vector<std::unique_ptr<EasyCurl>> handles_;
+  std::atomic<size_t> num_handles_;
+};
+
+#endif //EASY_CURL_POOL_H
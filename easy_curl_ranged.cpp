@@ -0,0 +1,334 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_ranged.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "scoped_cleanup.h"
+
+EasyCurlRangedFetcher::EasyCurlRangedFetcher(RangedFetchOptions options, InitCallback init)
+    : options_(options),
+      init_(std::move(init)) {
+  if (options_.connections == 0 || options_.range_bytes <= 0 || options_.max_attempts <= 0) {
+    cerr << "Invalid ranged fetch options: connections, range_bytes and max_attempts "
+            "must be positive";
+    exit(1);
+  }
+  if (options_.separate_connections) {
+    auto error = multi_.set_multiplexing(false);
+    if (error.code != kOk) {
+      cerr << "Could not disable multiplexing: " << error.msg;
+      exit(1);
+    }
+  }
+}
+
+EasyCurlRangedFetcher::~EasyCurlRangedFetcher() = default;
+
+Error EasyCurlRangedFetcher::FetchURL(const string& url,
+                                      string* dst,
+                                      const vector<string>& headers) {
+  assert(dst != nullptr);
+  auto start = std::chrono::steady_clock::now();
+  stats_ = RangedFetchStats();
+  auto record_time = MakeScopedCleanup([&]() {
+    stats_.total_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  });
+
+  int64_t size = ProbeSize(url, headers);
+  if (size >= 0) {
+    // Cleared first so resizing doesn't copy the old contents.
+    dst->clear();
+    dst->resize(size);
+    Writer writer = [dst](int64_t offset, const char* data, size_t len) -> Error {
+      memcpy(&(*dst)[offset], data, len);
+      return kOk;
+    };
+    bool range_ignored = false;
+    auto error = FetchRanges(url, size, writer, headers, &range_ignored);
+    if (!range_ignored) {
+      return error;
+    }
+  }
+  stats_.ranges = 1;
+  return curls_[0]->FetchURL(url, dst, headers);
+}
+
+Error EasyCurlRangedFetcher::FetchToFile(const string& url,
+                                         const string& path,
+                                         const vector<string>& headers) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return Error(kIOError, "could not open " + path + ": " + strerror(errno));
+  }
+  auto error = FetchToFile(url, fd, headers);
+  // Errors writing back the data may only show up now.
+  if (close(fd) != 0 && error.code == kOk) {
+    return Error(kIOError, "could not close " + path + ": " + strerror(errno));
+  }
+  return error;
+}
+
+Error EasyCurlRangedFetcher::FetchToFile(const string& url,
+                                         int fd,
+                                         const vector<string>& headers) {
+  auto start = std::chrono::steady_clock::now();
+  stats_ = RangedFetchStats();
+  auto record_time = MakeScopedCleanup([&]() {
+    stats_.total_us = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - start).count();
+  });
+
+  struct stat st;
+  if (fstat(fd, &st) != 0) {
+    return Error(kIOError, string("could not stat downloaded file: ") + strerror(errno));
+  }
+  // Ranges arrive out of order, which only a regular file can take.
+  int64_t size = S_ISREG(st.st_mode) ? ProbeSize(url, headers) : -1;
+  if (size >= 0) {
+    if (ftruncate(fd, 0) != 0) {
+      return Error(kIOError, string("could not truncate downloaded file: ") + strerror(errno));
+    }
+    bool sized = false;
+#ifdef __linux__
+    // Allocating the whole file up front keeps it from fragmenting as the
+    // ranges are written all over the place.
+    if (fallocate(fd, 0, 0, size) == 0) {
+      sized = true;
+    } else if (errno == ENOSPC) {
+      return Error(kIOError, "not enough space for downloaded file");
+    }
+    // Other failures only mean the file system can't do it.
+#endif
+    if (!sized && ftruncate(fd, size) != 0) {
+      return Error(kIOError, string("could not size downloaded file: ") + strerror(errno));
+    }
+    Writer writer = [fd](int64_t offset, const char* data, size_t len) -> Error {
+      while (len > 0) {
+        ssize_t n = pwrite(fd, data, len, offset);
+        if (n < 0) {
+          if (errno == EINTR) {
+            continue;
+          }
+          return Error(kIOError, string("could not write downloaded file: ") + strerror(errno));
+        }
+        data += n;
+        len -= static_cast<size_t>(n);
+        offset += n;
+      }
+      return kOk;
+    };
+    bool range_ignored = false;
+    auto error = FetchRanges(url, size, writer, headers, &range_ignored);
+    if (!range_ignored) {
+      return error;
+    }
+  }
+  AddHandles(1);
+  stats_.ranges = 1;
+  // Truncates the file again.
+  return curls_[0]->FetchToFile(url, fd, FileFetchOptions(), headers);
+}
+
+void EasyCurlRangedFetcher::AddHandles(size_t n) {
+  while (curls_.size() < n) {
+    curls_.emplace_back(new EasyCurl());
+    if (init_) {
+      init_(curls_.back().get());
+    }
+  }
+}
+
+int64_t EasyCurlRangedFetcher::ProbeSize(const string& url, const vector<string>& headers) {
+  AddHandles(1);
+  EasyCurl* curl = curls_[0].get();
+  // If the HEAD request fails, so would a plain request most likely, which
+  // reports the error then.
+  if (curl->HeadURL(url, headers).code != kOk) {
+    return -1;
+  }
+  stats_.size = curl->transfer_stats().content_length;
+  return stats_.size > options_.range_bytes ? stats_.size : -1;
+}
+
+Error EasyCurlRangedFetcher::FetchRanges(const string& url,
+                                         int64_t size,
+                                         const Writer& writer,
+                                         const vector<string>& headers,
+                                         bool* range_ignored) {
+  Download download;
+  download.url = &url;
+  download.headers = &headers;
+  download.writer = &writer;
+  for (int64_t start = 0; start < size; start += options_.range_bytes) {
+    Range range;
+    range.start = start;
+    range.length = std::min(options_.range_bytes, size - start);
+    download.ranges.push_back(range);
+  }
+  stats_.ranges = download.ranges.size();
+
+  size_t concurrency = std::min(options_.connections, download.ranges.size());
+  AddHandles(concurrency);
+  for (size_t i = 0; i < concurrency; i++) {
+    StartNext(curls_[i].get(), &download);
+  }
+
+  auto error = multi_.Run();
+  if (error.code != kOk) {
+    download.failed = true;
+    for (size_t i = 0; i < concurrency; i++) {
+      // Not in flight is fine.
+      multi_.Cancel(curls_[i].get());
+    }
+    return error;
+  }
+  *range_ignored = download.range_ignored;
+  return download.error;
+}
+
+void EasyCurlRangedFetcher::StartNext(EasyCurl* curl, Download* download) {
+  while (!download->failed &&
+         (!download->retry.empty() || download->next < download->ranges.size())) {
+    size_t index;
+    if (!download->retry.empty()) {
+      index = download->retry.front();
+      download->retry.pop_front();
+    } else {
+      index = download->next++;
+    }
+    Range& range = download->ranges[index];
+    range.received = 0;
+    range.attempts++;
+    range.started = false;
+    range.discard = false;
+
+    vector<string> headers = *download->headers;
+    headers.push_back("Range: bytes=" + std::to_string(range.start) + "-" +
+                      std::to_string(range.start + range.length - 1));
+
+    auto sink = [curl, download, index](const char* data, size_t len) -> size_t {
+      if (download->failed) {
+        // Another range failed; drop this one as quickly as possible.
+        return 0;
+      }
+      Range& range = download->ranges[index];
+      if (!range.started) {
+        range.started = true;
+        int response_code = curl->current_response_code();
+        if (response_code == 200) {
+          // The whole object rather than the range.
+          download->range_ignored = true;
+          Fail(download, Error(kNotSupported, "server ignored range request"));
+          return 0;
+        }
+        // An error page, left to Complete() to retry or fail on.
+        range.discard = response_code != 206;
+        if (!range.discard && curl->current_range_start() != range.start) {
+          // Some other part of the object, or no telling which.
+          download->range_ignored = true;
+          Fail(download, Error(kNotSupported, "server ignored range request"));
+          return 0;
+        }
+      }
+      if (range.discard) {
+        return len;
+      }
+      if (static_cast<int64_t>(len) > range.length - range.received) {
+        // More than was asked for, though a 206: don't trust the server
+        // with ranges.
+        download->range_ignored = true;
+        Fail(download, Error(kNotSupported, "server ignored range request"));
+        return 0;
+      }
+      auto error = (*download->writer)(range.start + range.received, data, len);
+      if (error.code != kOk) {
+        Fail(download, error);
+        return 0;
+      }
+      range.received += len;
+      return len;
+    };
+    auto done = [this, index, download](EasyCurl* curl, const Error& error) {
+      Complete(index, curl, error, download);
+      StartNext(curl, download);
+    };
+    auto error = multi_.AddFetch(curl, *download->url, sink, done, headers);
+    if (error.code == kOk) {
+      return;
+    }
+    Fail(download, error);
+  }
+}
+
+void EasyCurlRangedFetcher::Complete(size_t index,
+                                     EasyCurl* curl,
+                                     const Error& error,
+                                     Download* download) {
+  if (download->failed) {
+    return;
+  }
+  Range& range = download->ranges[index];
+  const TransferStats& stats = curl->transfer_stats();
+  if (error.code == kOk && stats.response_code == 200) {
+    // The whole object, and an empty one at that, so the sink never saw it,
+    // e.g. as it shrank since the HEAD request.
+    download->range_ignored = true;
+    Fail(download, Error(kNotSupported, "server ignored range request"));
+    return;
+  }
+  if (error.code == kOk && range.received == range.length) {
+    return;
+  }
+  Error failure = error;
+  if (error.code == kOk) {
+    failure = Error(kIncomplete, "range at " + std::to_string(range.start) + " ended after " +
+                    std::to_string(range.received) + " of " +
+                    std::to_string(range.length) + " bytes");
+  }
+  // Responses the server means, e.g. a 404 as the object was deleted, won't
+  // change by asking again.
+  bool retriable = failure.code != kRemoteError ||
+      stats.response_code == 0 || stats.response_code >= 500;
+  if (retriable && range.attempts < options_.max_attempts) {
+    download->retry.push_back(index);
+    stats_.retries++;
+    return;
+  }
+  Fail(download, failure);
+}
+
+void EasyCurlRangedFetcher::Fail(Download* download, const Error& error) {
+  if (!download->failed) {
+    download->failed = true;
+    download->error = error;
+  }
+}
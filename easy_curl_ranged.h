@@ -0,0 +1,200 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_RANGED_H
+#define EASY_CURL_RANGED_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "easy_curl.h"
+#include "easy_curl_multi.h"
+
+struct RangedFetchOptions {
+  // Number of ranges fetched at once.
+  size_t connections = 8;
+
+  // Size of the ranges the object is split into. A connection which is done
+  // with its range moves on to the next one, so a slow connection holds up
+  // at most one range while the others carry on. Objects of up to this size
+  // are fetched with a single request.
+  int64_t range_bytes = 8 * 1024 * 1024;
+
+  // How many times each range is attempted before the download fails.
+  int max_attempts = 3;
+
+  // Whether each range in flight gets a connection of its own. Otherwise
+  // ranges to an HTTP/2 server may be multiplexed over a single connection,
+  // which is what splitting the object is meant to get around.
+  bool separate_connections = true;
+};
+
+struct RangedFetchStats {
+  // The size of the object according to the server, or -1 if unknown.
+  int64_t size = -1;
+
+  // The number of ranges the object was fetched in: 1 if it was fetched with
+  // a single request, e.g. as the server doesn't support range requests.
+  size_t ranges = 0;
+
+  // Range requests which failed and were sent again.
+  size_t retries = 0;
+
+  // The whole download, including the HEAD request, in microseconds.
+  int64_t total_us = 0;
+};
+
+// Downloads large objects over several connections at once, to get past the
+// throughput of a single TCP stream.
+//
+// The size of the object is learnt with a HEAD request. The object is then
+// split into ranges of 'range_bytes', which are fetched concurrently with
+// Range headers, and written in place into a buffer or file sized up front.
+// Objects of unknown size, small objects, and servers which ignore range
+// requests get a plain request instead.
+//
+// Example:
+//   RangedFetchOptions options;
+//   options.connections = 16;
+//   EasyCurlRangedFetcher fetcher(options, [](EasyCurl* curl) {
+//     curl->set_timeout(600);
+//   });
+//   auto e = fetcher.FetchToFile("https://store.example.com/big.tar", "/data/big.tar");
+//
+// Note that the object is assumed not to change during the download: the
+// ranges of a replaced object would be stitched together with the old ones.
+//
+// Like EasyCurl, this is not thread-safe.
+class EasyCurlRangedFetcher {
+ public:
+  // Invoked once on each handle the fetcher creates.
+  typedef std::function<void(EasyCurl* curl)> InitCallback;
+
+  explicit EasyCurlRangedFetcher(RangedFetchOptions options = RangedFetchOptions(),
+                                 InitCallback init = nullptr);
+  ~EasyCurlRangedFetcher();
+
+  EasyCurlRangedFetcher(const EasyCurlRangedFetcher& that) = delete;
+  EasyCurlRangedFetcher& operator=(const EasyCurlRangedFetcher& that) = delete;
+
+  // Fetch the given URL into 'dst', sending 'headers' with each request.
+  // Any existing data in the buffer is replaced.
+  Error FetchURL(const std::string& url,
+                 string* dst,
+                 const std::vector<std::string>& headers = {});
+
+  // Fetch the given URL into the file at 'path', created or truncated.
+  Error FetchToFile(const std::string& url,
+                    const std::string& path,
+                    const std::vector<std::string>& headers = {});
+
+  // As above, writing to 'fd' after truncating it. If 'fd' is not a regular
+  // file, e.g. a pipe, the object is fetched with a single request. 'fd' is
+  // left open.
+  Error FetchToFile(const std::string& url,
+                    int fd,
+                    const std::vector<std::string>& headers = {});
+
+  // Returns the stats of the last download.
+  const RangedFetchStats& last_stats() const {
+    return stats_;
+  }
+
+  // Returns the underlying multi handle.
+  EasyCurlMulti* multi() {
+    return &multi_;
+  }
+
+ private:
+  // Stores 'len' bytes of the object at 'offset' in the destination.
+  typedef std::function<Error(int64_t offset, const char* data, size_t len)> Writer;
+
+  struct Range {
+    int64_t start = 0;
+    int64_t length = 0;
+    // Bytes of the current attempt received so far.
+    int64_t received = 0;
+    int attempts = 0;
+    // Whether the response of the current attempt was looked at yet, and
+    // whether it is an error page to drop rather than part of the object.
+    bool started = false;
+    bool discard = false;
+  };
+
+  // The download FetchRanges() is working through.
+  struct Download {
+    const std::string* url;
+    const std::vector<std::string>* headers;
+    const Writer* writer;
+    std::vector<Range> ranges;
+    // Index of the next range to start, and ranges to start again.
+    size_t next = 0;
+    std::deque<size_t> retry;
+    // Set once the download failed, so no more ranges are to be started.
+    bool failed = false;
+    Error error = Error(kOk);
+    // Set if the server answered a range request with the whole object.
+    bool range_ignored = false;
+  };
+
+  // Create handles until there are 'n'.
+  void AddHandles(size_t n);
+
+  // Returns the size of the object at 'url' if it is to be fetched in
+  // ranges, or -1.
+  int64_t ProbeSize(const std::string& url, const std::vector<std::string>& headers);
+
+  // Fetch the 'size' bytes of the object at 'url' in ranges, handing them
+  // to 'writer'. Sets 'range_ignored' if the server doesn't support range
+  // requests after all.
+  Error FetchRanges(const std::string& url,
+                    int64_t size,
+                    const Writer& writer,
+                    const std::vector<std::string>& headers,
+                    bool* range_ignored);
+
+  // Start the next range of 'download' on 'curl', until one is
+  // successfully in flight or none are left.
+  void StartNext(EasyCurl* curl, Download* download);
+
+  // Handle the outcome of a transfer of ranges[index]: queue it to be
+  // retried, or fail the download.
+  void Complete(size_t index, EasyCurl* curl, const Error& error, Download* download);
+
+  // Fail 'download' with 'error', unless it failed already.
+  static void Fail(Download* download, const Error& error);
+
+  const RangedFetchOptions options_;
+
+  const InitCallback init_;
+
+  RangedFetchStats stats_;
+
+  // Created on demand, up to 'connections'; the first one also sends the
+  // HEAD requests and the plain requests.
+  std::vector<std::unique_ptr<EasyCurl>> curls_;
+
+  // Declared after the handles so it is destroyed first.
+  EasyCurlMulti multi_;
+};
+
+#endif //EASY_CURL_RANGED_H
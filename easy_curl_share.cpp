@@ -0,0 +1,67 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_share.h"
+
+#include <iostream>
+#include <mutex>
+
+#include <curl/curl.h>
+
+namespace {
+
+extern "C" {
+void LockCallback(CURL* /*curl*/, curl_lock_data data,
+                  curl_lock_access /*access*/, void* user_ptr) {
+  reinterpret_cast<std::mutex*>(user_ptr)[data].lock();
+}
+
+void UnlockCallback(CURL* /*curl*/, curl_lock_data data, void* user_ptr) {
+  reinterpret_cast<std::mutex*>(user_ptr)[data].unlock();
+}
+} // extern "C"
+
+} // anonymous namespace
+
+EasyCurlShare::EasyCurlShare(bool share_connections)
+    : locks_(new std::mutex[CURL_LOCK_DATA_LAST]) {
+  EasyCurl::GlobalInit();
+  share_ = curl_share_init();
+  if (share_ == nullptr) {
+    cerr << "Could not init curl share";
+    exit(1);
+  }
+
+  bool ok = curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, LockCallback) == CURLSHE_OK &&
+      curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, UnlockCallback) == CURLSHE_OK &&
+      curl_share_setopt(share_, CURLSHOPT_USERDATA, locks_.get()) == CURLSHE_OK &&
+      curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS) == CURLSHE_OK &&
+      curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION) == CURLSHE_OK;
+  if (ok && share_connections) {
+    ok = curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT) == CURLSHE_OK;
+  }
+  if (!ok) {
+    cerr << "Failed configuring CURL share";
+    exit(1);
+  }
+}
+
+EasyCurlShare::~EasyCurlShare() {
+  if (curl_share_cleanup(share_) != CURLSHE_OK) {
+    cerr << "CURL share destroyed while still in use";
+  }
+}
@@ -0,0 +1,63 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_SHARE_H
+#define EASY_CURL_SHARE_H
+
+#include <memory>
+#include <mutex>
+
+#include "easy_curl.h"
+
+typedef void CURLSH;
+
+// Wrapper around curl's "share" interface, holding caches which many
+// EasyCurl instances, possibly on different threads, can use together.
+//
+// The DNS cache and the TLS session cache are always shared, so only the
+// first lookup of a host and the first full TLS handshake with a server are
+// paid for by the process rather than by each EasyCurl instance.
+//
+// If 'share_connections' is true, the connection cache is shared as well.
+// Note that libcurl does not support using a shared connection cache from
+// multiple concurrent threads; enable it only when all the attached
+// instances are driven from the same thread (e.g. by one EasyCurlMulti).
+// To keep connections warm across threads, use EasyCurlPool instead.
+//
+// Attach instances with EasyCurl::set_share(). The share must outlive every
+// EasyCurl instance attached to it.
+//
+// This class is thread-safe.
+class EasyCurlShare {
+ public:
+  explicit EasyCurlShare(bool share_connections = false);
+  ~EasyCurlShare();
+
+  EasyCurlShare(const EasyCurlShare& that) = delete;
+  EasyCurlShare& operator=(const EasyCurlShare& that) = delete;
+
+ private:
+  friend class EasyCurl;
+
+  CURLSH* share_;
+
+  // One lock per kind of shared data (curl_lock_data), so that e.g. DNS
+  // lookups never wait on TLS session cache updates.
+  std::unique_ptr<std::mutex[]> locks_;
+};
+
+#endif //EASY_CURL_SHARE_H
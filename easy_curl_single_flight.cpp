@@ -0,0 +1,134 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#include "easy_curl_single_flight.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <cassert>
+
+#include "easy_curl_pool.h"
+#include "scoped_cleanup.h"
+
+EasyCurlSingleFlight::EasyCurlSingleFlight() = default;
+
+EasyCurlSingleFlight::~EasyCurlSingleFlight() {
+  assert(calls_.empty());
+}
+
+Error EasyCurlSingleFlight::FetchURL(EasyCurl* curl,
+                                     const string& url,
+                                     std::shared_ptr<const string>* body,
+                                     const vector<string>& headers,
+                                     bool* shared) {
+  assert(curl != nullptr);
+  string key;
+  MakeKey(url, headers, &key);
+  return Do(key, [&](std::shared_ptr<const string>* result) {
+    auto fetched = std::make_shared<string>();
+    auto error = curl->FetchURL(url, fetched.get(), headers);
+    *result = std::move(fetched);
+    return error;
+  }, body, shared);
+}
+
+Error EasyCurlSingleFlight::FetchURL(EasyCurlPool* pool,
+                                     const string& url,
+                                     std::shared_ptr<const string>* body,
+                                     const vector<string>& headers,
+                                     bool* shared) {
+  assert(pool != nullptr);
+  string key;
+  MakeKey(url, headers, &key);
+  return Do(key, [&](std::shared_ptr<const string>* result) {
+    auto curl = pool->Acquire();
+    auto fetched = std::make_shared<string>();
+    auto error = curl->FetchURL(url, fetched.get(), headers);
+    *result = std::move(fetched);
+    return error;
+  }, body, shared);
+}
+
+Error EasyCurlSingleFlight::Do(const string& key,
+                               const FetchFunction& fetch,
+                               std::shared_ptr<const string>* body,
+                               bool* shared) {
+  assert(body != nullptr);
+  std::shared_ptr<Call> call;
+  {
+    std::unique_lock<std::mutex> l(lock_);
+    auto& slot = calls_[key];
+    if (slot) {
+      followers_.fetch_add(1, std::memory_order_relaxed);
+      // Keeps the call alive after the leader forgot about it.
+      call = slot;
+      call->done_cond.wait(l, [&]() { return call->done; });
+      if (shared != nullptr) {
+        *shared = true;
+      }
+      *body = call->body;
+      return call->error;
+    }
+    slot = std::make_shared<Call>();
+    call = slot;
+  }
+
+  leaders_.fetch_add(1, std::memory_order_relaxed);
+  std::shared_ptr<const string> result;
+  // What the followers get if 'fetch' throws, so they don't wait forever.
+  Error error(kRuntimeError, "single-flight fetch threw an exception");
+  {
+    auto complete = MakeScopedCleanup([&]() {
+      {
+        std::lock_guard<std::mutex> l(lock_);
+        call->done = true;
+        call->error = error;
+        call->body = result;
+        // Requests from now on start a call of their own.
+        calls_.erase(key);
+      }
+      call->done_cond.notify_all();
+    });
+    error = fetch(&result);
+  }
+  if (shared != nullptr) {
+    *shared = false;
+  }
+  *body = std::move(result);
+  return error;
+}
+
+EasyCurlSingleFlight::Counters EasyCurlSingleFlight::counters() const {
+  Counters counters;
+  counters.leaders = leaders_.load(std::memory_order_relaxed);
+  counters.followers = followers_.load(std::memory_order_relaxed);
+  return counters;
+}
+
+void EasyCurlSingleFlight::MakeKey(const string& url,
+                                   const vector<string>& headers,
+                                   string* key) {
+  // Neither URLs nor headers contain newlines.
+  key->assign("GET ");
+  key->append(url);
+  for (const auto& header : headers) {
+    key->push_back('\n');
+    key->append(header);
+  }
+}
@@ -0,0 +1,122 @@
+// Licensed to the Apache Software Foundation (ASF) under one
+// or more contributor license agreements.  See the NOTICE file
+// distributed with this work for additional information
+// regarding copyright ownership.  The ASF licenses this file
+// to you under the Apache License, Version 2.0 (the
+// "License"); you may not use this file except in compliance
+// with the License.  You may obtain a copy of the License at
+//
+//   http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing,
+// software distributed under the License is distributed on an
+// "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+// KIND, either express or implied.  See the License for the
+// specific language governing permissions and limitations
+// under the License.
+
+#ifndef EASY_CURL_SINGLE_FLIGHT_H
+#define EASY_CURL_SINGLE_FLIGHT_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "easy_curl.h"
+
+class EasyCurlPool;
+
+// Coalesces identical concurrent GET requests: while a request is in flight,
+// other threads asking for the same URL with the same headers wait for it
+// and share its outcome, body buffer included, rather than sending requests
+// of their own. Keeps a herd of threads which all missed the same expired
+// key from hitting the server at once.
+//
+// Example:
+//   EasyCurlSingleFlight flights;
+//   EasyCurlPool pool(64);
+//   std::shared_ptr<const std::string> body;
+//   auto e = flights.FetchURL(&pool, url, &body);
+//
+// Only requests which overlap are coalesced; nothing is kept once the
+// request completed. To also reuse responses afterwards, see
+// EasyCurlResponseCache, which coalesces its misses.
+//
+// Waiting requests wait for as long as the request in flight takes, so
+// the settings of the handles, e.g. timeouts, apply to them as well.
+//
+// This class is thread-safe.
+class EasyCurlSingleFlight {
+ public:
+  // Produces the outcome of a request, setting 'body'.
+  typedef std::function<Error(std::shared_ptr<const std::string>* body)> FetchFunction;
+
+  EasyCurlSingleFlight();
+  ~EasyCurlSingleFlight();
+
+  EasyCurlSingleFlight(const EasyCurlSingleFlight& that) = delete;
+  EasyCurlSingleFlight& operator=(const EasyCurlSingleFlight& that) = delete;
+
+  // Fetch 'url' with 'curl', sending 'headers', unless the same request is
+  // in flight already, in which case wait for it and share its outcome. Sets
+  // 'shared', if non-NULL, to whether the outcome came from another
+  // request, in which case 'curl' was left alone, transfer stats included.
+  Error FetchURL(EasyCurl* curl,
+                 const std::string& url,
+                 std::shared_ptr<const std::string>* body,
+                 const std::vector<std::string>& headers = {},
+                 bool* shared = nullptr);
+
+  // As above, with a handle checked out from 'pool' only if the request is
+  // sent, so waiting requests don't hold on to handles.
+  Error FetchURL(EasyCurlPool* pool,
+                 const std::string& url,
+                 std::shared_ptr<const std::string>* body,
+                 const std::vector<std::string>& headers = {},
+                 bool* shared = nullptr);
+
+  // Run 'fetch' unless a call with the same 'key' is in progress, in which
+  // case wait for it and share its outcome, e.g. to coalesce requests which
+  // aren't plain GETs, or to do more than the request itself only once. If
+  // 'fetch' throws, the exception propagates to this caller only; those
+  // waiting for it fail with kRuntimeError.
+  Error Do(const std::string& key,
+           const FetchFunction& fetch,
+           std::shared_ptr<const std::string>* body,
+           bool* shared = nullptr);
+
+  struct Counters {
+    // Calls which ran their fetch, and calls which waited for another one.
+    int64_t leaders = 0;
+    int64_t followers = 0;
+  };
+  Counters counters() const;
+
+  // Sets 'key' to the key of a GET request of 'url' with 'headers'.
+  static void MakeKey(const std::string& url,
+                      const std::vector<std::string>& headers,
+                      std::string* key);
+
+ private:
+  // A call in progress, and its outcome once done.
+  struct Call {
+    bool done = false;
+    Error error = Error(kOk);
+    std::shared_ptr<const std::string> body;
+    std::condition_variable done_cond;
+  };
+
+  std::mutex lock_;
+  std::unordered_map<std::string, std::shared_ptr<Call>> calls_;
+
+  std::atomic<int64_t> leaders_{0};
+  std::atomic<int64_t> followers_{0};
+};
+
+#endif //EASY_CURL_SINGLE_FLIGHT_H